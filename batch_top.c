@@ -1,25 +1,64 @@
 /*
- * Usage: batch_top [-C] [-M] [-B] [-Q] [-s n] [-t n] [-c n] [-m n] [-u n] [-p n] [-q n] [-r n] [-b n] [-n n] [-L n] [-d diskstatpath,diskname]
+ * Usage: batch_top [-C] [-M] [-B] [-T] [-N] [-X] [-Q] [-I] [-s n] [-t n] [-c n] [-m n] [-u n] [-z n] [-i fields] [-p n] [-q n] [-r n] [-b n] [-e n] [-g n] [-x n] [-n n] [-L n] [-f n] [-y cpudir[,statfile]] [-A n] [-k n] [-G n] [-F n] [-S n] [-l n] [-w n] [-K n] [-Z n] [-D tol,K] [-O name:path:opts] [-d diskstatpath,diskname] [-j journalsocket] [-R path [-Y time]] [-U logfile ...] [-E archive logfile ...] [-V query archive]
  *
  * Default option settings:
  *
  *  Show CPU hogs: -C 0
  *  Show Mem hogs: -M 0
  *  Show Block I/O waiters: -B 0
+ *  Show thread hogs: -T 0
+ *  Show thread count growth: -N 0
+ *  Show realtime runaways: -X 0
  *  Show count of PHP tasks: -P 0
  *  Show count of httpd tasks: -H 0
+ *  Low wakeup idle mode: -I 0
  *  Outerloop time (secs): -s 10.000
  *  Innerloop time (secs): -t 10.000
  *  Min busy loadavg: -p 5.000
  *  Min busy CPU load: -c 80.0%
  *  Min busy Mem load: -m 80.0%
  *  Min busy Cpuset memory pressure: -u 100
+ *  Max busy zone headroom over low watermark (0 for off): -z 0.000
+ *  Min busy CPU capacity lost to frequency throttling (0 for off): -f 0.0%
+ *  CPU sysfs dir, per-CPU stat file: -y /sys/devices/system/cpu,/proc/stat
+ *  Extra meminfo fields (kB) and triggers: [-i field[>n|<n],...]
  *  Busy tasks (1/1000 of CPU, aka mcpus): -q 100
  *  RSS mem hogs (1/1000 of RAM, aka mrams): -r 100
  *  Block I/O waiters (msecs per sec): -b 100
+ *  Many threaded tasks (threads): -e 500
+ *  Thread count growth (new threads per interval): -g 50
+ *  Realtime runaways (CPU msecs per sec, 0 for 90% of RT limit): -x 0
  *  Max number tasks to show: -n 10
  *  Length cmdline to display: -L 48
+ *  Heartbeat period (secs, 0 for time marks): -A 0
+ *  Snapshots kept for avgmcpus (0 for none): -k 0
+ *  Max number stalled cgroups to show: -G 0
+ *  Syscalls per cycle counting fds (0 for none): -F 0
+ *  Max number slab caches to show: -S 0
+ *  Max number lock holders to show: -l 0
+ *  Output budget (bytes/sec, 0 for none): -w 0
+ *  Max number correlated tasks to show at episode end: -K 0
+ *  Continuous mode task slices (0 for off): -Z 0
+ *  Change-only tables (tolerance %, 0 for off; full every K): -D 0,10
  *  Show_disks: [-d path,name]
+ *  Journal socket: [-j path]
+ *  Metrics store: [-R path]
+ *  Extra profiles: [-O name:path:options]
+ *  Fleet merge of log files: [-U logfile ...]
+ *  Columnar archive of log files: [-E archive]
+ *  Query of columnar archive: [-V query]
+ *
+ * Use "-R path -Y time" to display what the metrics store at path
+ * recorded at that time (seconds since the epoch, or if negative,
+ * seconds before now), then exit.
+ *
+ * Use "-U logfile ..." to merge batch_top logs from many hosts, one
+ * file per host (optionally .xz or .gz compressed), into rollups by
+ * host, by cmd and by minute, then exit.  See "Fleet merge" below.
+ *
+ * Use "-E archive logfile ..." to convert logs into a columnar archive,
+ * and "-V query archive" to query one, then exit.  See "Columnar
+ * archive" below.
  *
  * Use -Q option to Quiet above option setting display upon
  * initial command invocation
@@ -36,10 +75,14 @@
  *   -        For up to n tasks using either:
  *   - 		(if -C, the default) at least -q mcpus 1/1000-ths of all CPUs,
  *   -		(if -M) at least -r mrams (1/1000-ths of RAM in task RSS)
+ *   -		(if -T) at least -e threads
+ *   -		(if -N) at least -g more threads than the prior scan
+ *   -		(if -X) realtime tasks using at least -x CPU msecs per sec
  *   -        print cmd name, pid, mcpus and mrams.
  *
  * The outer loop is low cost, just reading /proc/loadavg each loop,
- *	and outputting a five character time mark.
+ *	and outputting a five character time mark.  Or, with -A n, just
+ *	outputting one heartbeat summary line every n seconds.
  *
  * The inner loop is more expensive, reading /proc/<pid>/stat for each
  *	process <pid> listed in /proc, and outputting the worst CPU and/or
@@ -47,7 +90,9 @@
  *
  * Compiles cleanly with:
  *
- *    cc -Wall -pedantic -Wextra -O3 -o batch_top  batch_top.c
+ *    cc -Wall -pedantic -Wextra -O3 -pthread -o batch_top  batch_top.c -lm
+ *
+ * (with USDT probes, if <sys/sdt.h> is installed - see "USDT" below.)
  *
  * Paul Jackson
  * pj@usa.net
@@ -58,6 +103,7 @@
 
 #define _GNU_SOURCE
 #include <string.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -71,13 +117,34 @@
 #include <dirent.h>
 #include <errno.h>
 #include <argz.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <ftw.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 long sysconf(int name);
 
 char *cmd;
 const char *usage =
-	"[-C] [-M] [-B] [-Q] [-s n] [-t n] [-c n] [-m n] [-u n] [-p n] [-q n] "
-	"[-r n] [-b n] [-n n] [-L n] [-d diskstatpath,diskname]";
+	"[-C] [-M] [-B] [-T] [-N] [-X] [-Q] [-I] [-s n] [-t n] [-c n] [-m n] "
+	"[-u n] [-z n] [-i fields] [-p n] [-q n] [-r n] [-b n] [-e n] "
+	"[-g n] [-x n] [-n n] [-L n] [-f n] [-y cpudir[,statfile]] "
+	"[-A n] [-k n] [-G n] [-F n] [-S n] [-l n] [-w n] [-K n] [-Z n] "
+	"[-D tol,K] [-O name:path:opts] "
+	"[-d diskstatpath,diskname] "
+	"[-j journalsocket] [-R path [-Y time]] [-U logfile ...] "
+	"[-E archive logfile ...] [-V query archive]";
 
 void show_current_settings();
 
@@ -109,6 +176,139 @@ void __perror_exit(const char *msg, const char *arg,
 	exit(1);
 }
 
+/*
+ * USDT static probes.
+ *
+ * If <sys/sdt.h> (from systemtap-sdt-dev or similar) is available when
+ * compiling, batch_top gets "batch_top" provider USDT probes, which
+ * are just a nop instruction each until someone attaches to them,
+ * as in:
+ *
+ *	bpftrace -e 'usdt:./batch_top:batch_top:tasks_read
+ *		{ printf("%d tasks in %d usecs\n", arg0, arg1); }'
+ *
+ * Probes (and their arguments):
+ *
+ *	cycle_start	(cycle number)
+ *	cycle_end	(cycle number, cycle usecs)
+ *	tasks_read	(tasks read, usecs in get_task_usages())
+ *	hogs_joined	(tasks joined, usecs for join and deltas)
+ *	stat_fail	(pid, read_stat_file() return value)
+ *	output_flush	(flushes so far, usecs in fflush())
+ *
+ * Each probe has a semaphore, which tracers increment while attached,
+ * and the probe's arguments, including the clock_gettime() calls timing
+ * them (see bt_clock()), are only computed while it is set.  So an
+ * untraced probe costs a load and a branch.
+ *
+ * Without <sys/sdt.h>, or if compiled with -DNO_USDT, the probes and
+ * the timing code feeding them compile away to nothing.
+ */
+
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define HAVE_USDT 1
+#endif
+#endif
+
+#ifdef HAVE_USDT
+#define BT_SEMAPHORE(name) \
+	__extension__ unsigned short batch_top_##name##_semaphore \
+	__attribute__ ((unused)) __attribute__ ((section (".probes")))
+
+BT_SEMAPHORE(cycle_start);
+BT_SEMAPHORE(cycle_end);
+BT_SEMAPHORE(tasks_read);
+BT_SEMAPHORE(hogs_joined);
+BT_SEMAPHORE(stat_fail);
+BT_SEMAPHORE(output_flush);
+
+#define bt_enabled(name) \
+	__builtin_expect(batch_top_##name##_semaphore != 0, 0)
+#define bt_probe1(name, a) do { \
+	if (bt_enabled(name)) \
+		DTRACE_PROBE1(batch_top, name, a); \
+	} while (0)
+#define bt_probe2(name, a, b) do { \
+	if (bt_enabled(name)) \
+		DTRACE_PROBE2(batch_top, name, a, b); \
+	} while (0)
+#else
+#define HAVE_USDT 0
+#define bt_enabled(name)	0
+#define bt_probe1(name, a)	do { (void) sizeof(a); } while (0)
+#define bt_probe2(name, a, b)	do { (void) sizeof(a); (void) sizeof(b); } while (0)
+#endif
+
+/*
+ * Monotonic clock in microseconds, for timing probe arguments.
+ */
+
+uint64_t probe_usecs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Start time for probe name's usecs argument, or 0 if not traced */
+#define bt_clock(name)	(bt_enabled(name) ? probe_usecs() : 0)
+
+/*
+ * Output sinks.  Each profile (see "Profiles", below) writes to its
+ * own sink, sinks[k], the first of which is stdout.  oprintf() writes
+ * to the sink of the profile being shown (cur_sink), or if cur_sink is
+ * -1 (as between busy episodes), to all of them.  It also counts
+ * the bytes written to sinks[0], or with out_dry set, just counts them
+ * without writing (see "Output budget", below.)
+ */
+
+#define MAX_PROFILES 8		/* max profiles, including first */
+
+FILE *sinks[MAX_PROFILES];
+int nsinks = 1;			/* number of sinks[] opened */
+int cur_sink = -1;		/* sink being written, -1 for all */
+int out_dry;			/* set if output to sinks[0] only counted */
+uint64_t out_bytes;		/* bytes (as if) written to sinks[0] */
+
+void oprintf(const char *fmt, ...)
+{
+	va_list ap;
+	int k, n;
+
+	for (k = 0; k < nsinks; k++) {
+		if (cur_sink >= 0 && k != cur_sink)
+			continue;
+		va_start(ap, fmt);
+		if (k == 0 && out_dry)
+			n = vsnprintf(NULL, 0, fmt, ap);
+		else
+			n = vfprintf(sinks[k], fmt, ap);
+		va_end(ap);
+		if (k == 0 && n > 0)
+			out_bytes += n;
+	}
+}
+
+/*
+ * Flush the output sinks, firing the output_flush probe.
+ */
+
+void flush_output()
+{
+	static unsigned long nflushes;
+	uint64_t t0 = bt_clock(output_flush);
+	int k;
+
+	for (k = 0; k < nsinks; k++)
+		fflush(sinks[k]);
+	nflushes++;
+	bt_probe2(output_flush, nflushes, probe_usecs() - t0);
+}
+
 #define DEF_s 10.0	/* outer loop s default 10 seconds */
 #define DEF_t 10.0	/* inner loop t default 10 seconds */
 
@@ -121,10 +321,27 @@ void __perror_exit(const char *msg, const char *arg,
 #define DEF_q 100	/* default cpu usage 100 msecs per sec */
 #define DEF_b 100 	/* default diskwait 100 msecs per sec */
 #define DEF_r 100	/* default rss size 100 mrams (100/1000 of RAM) */
+#define DEF_e 500	/* default 500 threads in one task */
+#define DEF_g 50	/* default 50 more threads than prior snapshot */
+#define DEF_x 0		/* default 90% of RT throttling limit (see rt_init) */
 #define DEF_n 10	/* default 10 max number of busy tasks to print */
 
 #define DEF_L 48	/* default length cmdline to show for "hog" tasks */
 
+#define DEF_A 0		/* default no heartbeat compaction of time marks */
+#define DEF_k 0		/* default no snapshot history */
+#define DEF_z 0.0	/* default don't watch zone watermarks */
+#define DEF_f 0.0	/* default don't watch CPU frequencies */
+#define DEF_G 0		/* default don't show stalled cgroups */
+#define DEF_F 0		/* default don't count fds */
+#define DEF_S 0		/* default don't show slab caches */
+#define DEF_l 0		/* default don't show lock waits */
+#define DEF_w 0		/* default no output budget */
+#define DEF_K 0		/* default don't rank tasks by correlation */
+#define DEF_Z 0		/* default no continuous mode */
+#define DEF_D_tol 0.0	/* default show full hogs tables */
+#define DEF_D_full 10	/* default with -D, every 10th table in full */
+
 double val_s = DEF_s;	/* outer loop cycle time in seconds */
 double val_t = DEF_t;	/* inner loop cycle time in seconds */
 
@@ -132,20 +349,431 @@ double val_p = DEF_p;	/* load average that triggers inner loop */
 double val_c = DEF_c;	/* CPU load % that triggers inner loop */
 double val_m = DEF_m;	/* Mem load % that triggers inner loop */
 int val_u = DEF_u;	/* Cpuset memory pressure that triggers inner loop */
+double val_z = DEF_z;	/* zone headroom under which triggers inner loop */
+double val_f = DEF_f;	/* CPU capacity loss % that triggers inner loop */
+const char *val_i;	/* extra meminfo fields shown, and their triggers */
 
-long val_q = DEF_q;	/* msecs/sec of all CPU usage threshold of busy tasks */
-long val_b = DEF_b;	/* msecs/sec waiting on block I/O (diskwait) */
-long val_r = DEF_r;	/* kb/1000 kb of RAM in rss of a big task */
 long val_n = DEF_n;	/* max number of busy tasks to print each inner loop */
 
-/* By default, show just CPU hogs.  If both set, show both. */
+long val_A = DEF_A;	/* secs per heartbeat summary line (0: time marks) */
+long val_k = DEF_k;	/* snapshots kept in history (0: no history) */
+long val_G = DEF_G;	/* max number stalled cgroups to print */
+long val_F = DEF_F;	/* syscalls per inner loop counting fds */
+long val_S = DEF_S;	/* max number slab caches to print */
+long val_l = DEF_l;	/* max number lock holders to print */
+long val_w = DEF_w;	/* output budget, bytes per second */
+long val_K = DEF_K;	/* max number correlated tasks to print */
+long val_Z = DEF_Z;	/* continuous mode slices (0: off) */
+int cont_nscanned;	/* slices in this -Z partial scan, 0 if full */
+double val_D_tol = DEF_D_tol;	/* -D change tolerance (%), 0 for off */
+long val_D_full = DEF_D_full;	/* -D tables per full table */
 
-int flag_C = 0;		/* If set, show CPU hogs (defaults to set, below) */
-int flag_M = 0;		/* If set, show Memory hogs */
-int flag_B = 0;		/* If set, show tasks slowed by block I/O diskwait */
 int flag_P = 0;		/* If set, show count PHP tasks in header */
 int flag_H = 0;		/* If set, show count httpd tasks in header */
 int flag_Q = 0;		/* If set, don't display option settings */
+int flag_I = 0;		/* If set, minimize outer loop wakeups */
+int flag_U = 0;		/* If set, merge log files operands, then exit */
+
+/*
+ * Metric registry.
+ *
+ * Each per-task measure by which tasks can be ranked as "hogs" is
+ * described by one entry in metrics[], below: its source (a routine
+ * computing it from the fields parsed out of /proc/<pid>/stat), whether
+ * what is shown is its change per second (rate), its change since the
+ * prior snapshot (delta) or its current level (gauge), whether it's
+ * further scaled by the number of CPUs, its rank in sorting the tasks
+ * shown (by the enabled metric ranked first), the options that enable ranking by it and set its threshold (such as
+ * "-C" and "-q" for mcpus), and its column heading.
+ *
+ * Parsing, deltas, the sorts selecting hogs, and the output table all
+ * just loop over this table, so a new category of hog costs a table
+ * entry, a source routine, and (if not already parsed) another field
+ * in stat_fields_t.  The per task loops go over only the "active"
+ * metrics: those enabled, plus those whose column is always shown.
+ *
+ * By default, show just CPU hogs.  If several enabled, show all.
+ */
+
+typedef struct {
+	uint64_t utime, stime;		/* ticks in user, sys mode */
+	long cutime, cstime;		/* ticks of waited-for children */
+	uint64_t rsspages;		/* Resident Set Size (pages) */
+	uint64_t blockioticks;		/* total block I/O delays (ticks) */
+	long num_threads;		/* number of threads in task */
+	unsigned rt_priority;		/* realtime priority, 0 if not RT */
+	unsigned policy;		/* scheduling policy (SCHED_*) */
+} stat_fields_t;
+
+enum { METRIC_GAUGE, METRIC_RATE, METRIC_DELTA };	/* metric_t kind */
+
+typedef struct {
+	const char *name;		/* column heading */
+	const char *journal_key;	/* field name in journald entries */
+	uint64_t (*source)(const stat_fields_t *sfp);
+	int kind;			/* METRIC_GAUGE, _RATE or _DELTA */
+	int per_cpu;			/* divide by number CPUs */
+	int sort_rank;			/* lowest ranked enabled sorts shown */
+	int flag_opt;			/* option enabling ranking by this */
+	const char *flag_descr;		/* settings display of flag_opt */
+	int thresh_opt;			/* option setting threshold */
+	const char *thresh_descr;	/* settings display of thresh_opt */
+	long thresh;			/* show tasks with at least this */
+	int enabled;			/* set if ranking tasks by this */
+	int always_shown;		/* show column even if not enabled */
+	int active;			/* set if enabled or always_shown */
+} metric_t;
+
+uint64_t src_cpumsecs(const stat_fields_t *sfp);
+uint64_t src_rssmram(const stat_fields_t *sfp);
+uint64_t src_diskwait(const stat_fields_t *sfp);
+uint64_t src_threads(const stat_fields_t *sfp);
+uint64_t src_rtcpumsecs(const stat_fields_t *sfp);
+
+metric_t metrics[] = {
+	{ "mcpus", "MCPUS", src_cpumsecs, METRIC_RATE, 1, 0,
+		'C', "Show CPU hogs",
+		'q', "Busy tasks (1/1000 of CPU, aka mcpus)", DEF_q, 0, 1, 0 },
+	{ "mrams", "MRAMS", src_rssmram, METRIC_GAUGE, 0, 2,
+		'M', "Show Mem hogs",
+		'r', "RSS mem hogs (1/1000 of RAM, aka mrams)", DEF_r, 0, 1, 0 },
+	{ "diskwait", "DISKWAIT", src_diskwait, METRIC_RATE, 0, 1,
+		'B', "Show Block I/O waiters",
+		'b', "Block I/O waiters (msecs per sec)", DEF_b, 0, 1, 0 },
+	{ "threads", "THREADS", src_threads, METRIC_GAUGE, 0, 3,
+		'T', "Show thread hogs",
+		'e', "Many threaded tasks (threads)", DEF_e, 0, 0, 0 },
+	{ "thrgrowth", "THRGROWTH", src_threads, METRIC_DELTA, 0, 4,
+		'N', "Show thread count growth",
+		'g', "Thread count growth (new threads per interval)", DEF_g,
+		0, 0, 0 },
+	{ "rtcpu", "RTCPU", src_rtcpumsecs, METRIC_RATE, 0, 5,
+		'X', "Show realtime runaways",
+		'x', "Realtime runaways (CPU msecs per sec, 0 for 90% of "
+		"RT limit)", DEF_x, 0, 0, 0 },
+};
+
+#define NMETRICS ((int) (sizeof(metrics) / sizeof(metrics[0])))
+
+/* Index in metrics[] of the metrics referred to by name elsewhere */
+enum { M_CPU, M_RSS, M_DISK, M_THREADS, M_THRGROWTH, M_RTCPU };
+
+int active_metrics[NMETRICS];	/* indices of the active metrics */
+int nactive;			/* number entries in active_metrics[] */
+int collect_metrics[NMETRICS];	/* indices of metrics any profile shows */
+int ncollect;			/* number entries in collect_metrics[] */
+
+/*
+ * Once options are parsed, enable the default (first) metric if none
+ * were asked for, and list the active metrics.
+ */
+
+void metrics_init()
+{
+	int m, any = 0;
+
+	for (m = 0; m < NMETRICS; m++)
+		any |= metrics[m].enabled;
+	if (!any)
+		metrics[0].enabled = 1;
+
+	nactive = 0;
+	for (m = 0; m < NMETRICS; m++) {
+		metrics[m].active = metrics[m].enabled || metrics[m].always_shown;
+		if (metrics[m].active)
+			active_metrics[nactive++] = m;
+	}
+}
+
+void fatal_usage(char *msg, int val);
+
+/*
+ * If option c is one of the metrics' options, handle it and return 1.
+ * Else return 0.
+ */
+
+int metric_option(int c, const char *arg)
+{
+	int m;
+
+	for (m = 0; m < NMETRICS; m++) {
+		if (c == metrics[m].flag_opt) {
+			metrics[m].enabled = 1;
+			return 1;
+		}
+		if (c == metrics[m].thresh_opt) {
+			metrics[m].thresh = strtol(arg, NULL, 10);
+			if (metrics[m].thresh < 1) {
+				static char msg[32];
+
+				sprintf(msg, "-%c val < 1", c);
+				fatal_usage(msg, metrics[m].thresh);
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * If option c is one of the triggers (-p, -c, -m, -u), check its value
+ * and set it, and return 1.  Else return 0.
+ */
+
+int trigger_option(int c, const char *arg)
+{
+	switch (c) {
+	case 'p':			/* min busy loadavg */
+		val_p = strtod(arg, NULL);
+		if (val_p < 0.001)
+			fatal_usage("-p val < 0.001", val_p);
+		return 1;
+	case 'c':			/* min CPU load % */
+		val_c = strtod(arg, NULL);
+		if (val_c < .1)
+			fatal_usage("-c val < .1%", val_c);
+		if (val_c > 100.)
+			fatal_usage("-c val > 100%", val_c);
+		return 1;
+	case 'm':			/* min Mem load % */
+		val_m = strtod(arg, NULL);
+		if (val_m < .1)
+			fatal_usage("-m val < .1%", val_m);
+		if (val_m > 100.)
+			fatal_usage("-m val > 100%", val_m);
+		return 1;
+	case 'u':			/* min cpuset memory pressure */
+		val_u = strtod(arg, NULL);
+		if (val_u < 0)
+			fatal_usage("-u val < 0", val_u);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Append the metrics' option letters to getopt() optstring buf.
+ */
+
+void metric_optstring(char *buf)
+{
+	char *p = buf + strlen(buf);
+	int m;
+
+	for (m = 0; m < NMETRICS; m++) {
+		*p++ = metrics[m].flag_opt;
+		*p++ = metrics[m].thresh_opt;
+		*p++ = ':';
+	}
+	*p = '\0';
+}
+
+/*
+ * Profiles ("-O name:path:options").
+ *
+ * Several monitoring profiles can share one process, and so share one
+ * scan of /proc per cycle.  The options on the command line make up the
+ * first profile, writing to stdout.  Each -O adds another, named name,
+ * writing to (appending to) file path ("-" for stdout), whose options
+ * (separated by spaces) start from those of the first profile, then
+ * override any of its triggers (-p, -c, -m, -u), categories (-C, -M,
+ * -B, -T, -N, -X, replacing those of the first profile if any given),
+ * thresholds (-q, -r, -b, -e, -g, -x) and -n, as in:
+ *
+ *	batch_top -p 2 -n 5 -O "wide:/var/log/bt-wide.log:-M -B -n 12"
+ *
+ * Each cycle, the loaded system measures and the task snapshot (of the
+ * metrics any profile shows) are taken once, then each profile in turn
+ * is made current (its settings copied into the globals the rest of
+ * the code uses), decides if it is busy, and if so shows its header
+ * and hogs to its sink.  So each extra profile costs just its own
+ * selection and formatting.  The other settings (such as -s, -t, -z,
+ * -i and the -G, -F, -S and -l tables) are shared, but the -z, -i and
+ * -f triggers make just the first profile busy.  Those tables are
+ * shown once a cycle, by the first profile busy that cycle, to its
+ * sink.  Journal records are tagged with their profile's name.
+ */
+
+typedef struct {
+	const char *name;		/* as given to -O */
+	const char *path;		/* of sink, "-" for stdout */
+	const char *opts;		/* options string from -O */
+	double p, c, m;			/* -p, -c and -m triggers */
+	int u;				/* -u trigger */
+	long n;				/* -n tasks to show */
+	int enabled[NMETRICS];		/* categories of hogs */
+	long thresh[NMETRICS];		/* thresholds of hogs */
+	int busy;			/* set if in busy episode */
+} profile_t;
+
+profile_t profiles[MAX_PROFILES];	/* profiles[0] from command line */
+int nprofiles = 1;
+int cur_profile;		/* profile whose settings are in the globals */
+int extras_shown;		/* set once -G/-F/-S/-l shown this cycle */
+int metric_collected[NMETRICS];	/* set if any profile shows metric */
+
+void rt_init();
+void change_reset(int pk);
+
+/* Add a profile, from an -O argument */
+
+void profile_add(char *arg)
+{
+	profile_t *pp = profiles + nprofiles;
+	char *p;
+
+	if (nprofiles == MAX_PROFILES)
+		fatal_usage("too many -O profiles", nprofiles);
+	pp->name = arg;
+	if ((p = strchr(arg, ':')) == NULL)
+		fatal_usage("-O needs name:path:options", nprofiles);
+	*p++ = '\0';
+	pp->path = p;
+	if ((p = strchr(p, ':')) == NULL)
+		fatal_usage("-O needs name:path:options", nprofiles);
+	*p++ = '\0';
+	pp->opts = p;
+	nprofiles++;
+}
+
+/* Copy the globals into profile k's settings */
+
+void profile_save(int k)
+{
+	profile_t *pp = profiles + k;
+	int m;
+
+	pp->p = val_p;
+	pp->c = val_c;
+	pp->m = val_m;
+	pp->u = val_u;
+	pp->n = val_n;
+	for (m = 0; m < NMETRICS; m++) {
+		pp->enabled[m] = metrics[m].enabled;
+		pp->thresh[m] = metrics[m].thresh;
+	}
+}
+
+/* Make profile k current, copying its settings into the globals */
+
+void profile_load(int k)
+{
+	profile_t *pp = profiles + k;
+	int m;
+
+	val_p = pp->p;
+	val_c = pp->c;
+	val_m = pp->m;
+	val_u = pp->u;
+	val_n = pp->n;
+	for (m = 0; m < NMETRICS; m++) {
+		metrics[m].enabled = pp->enabled[m];
+		metrics[m].thresh = pp->thresh[m];
+	}
+	metrics_init();
+	cur_profile = k;
+}
+
+/*
+ * Parse profile k's options, starting from the first profile's,
+ * and open its sink.
+ */
+
+void profile_parse(int k)
+{
+	profile_t *pp = profiles + k;
+	char optstring[64];
+	char *argv[64], *opts, *save;
+	int argc = 1, c, m, any = 0;
+
+	profile_load(0);
+	for (m = 0; m < NMETRICS; m++)
+		metrics[m].enabled = 0;
+
+	if ((opts = strdup(pp->opts)) == NULL)
+		perror_exit("strdup", pp->opts);
+	argv[0] = cmd;
+	for (argv[argc] = strtok_r(opts, " ", &save); argv[argc] &&
+			argc < 62; argv[++argc] = strtok_r(NULL, " ", &save))
+		;
+	argv[argc] = NULL;
+
+	strcpy(optstring, "p:c:m:u:n:");
+	metric_optstring(optstring);
+	optind = 0;			/* (re)initialize getopt() */
+	while ((c = getopt(argc, argv, optstring)) != EOF) {
+		if (metric_option(c, optarg) || trigger_option(c, optarg))
+			continue;
+		switch (c) {
+		case 'n':
+			val_n = strtol(optarg, NULL, 10);
+			if (val_n < 1)
+				fatal_usage("-O -n val < 1", val_n);
+			break;
+		default:
+			fprintf(stderr, "%s: bad options for -O profile %s: %s\n",
+				cmd, pp->name, pp->opts);
+			exit(1);
+		}
+	}
+	if (optind < argc) {
+		fprintf(stderr, "%s: bad options for -O profile %s: %s\n",
+			cmd, pp->name, pp->opts);
+		exit(1);
+	}
+
+	/* Categories given replace those of the first profile */
+	for (m = 0; m < NMETRICS; m++)
+		any |= metrics[m].enabled;
+	for (m = 0; !any && m < NMETRICS; m++)
+		metrics[m].enabled = profiles[0].enabled[m];
+	metrics_init();
+	rt_init();
+	profile_save(k);
+
+	if (strcmp(pp->path, "-") == 0)
+		sinks[k] = stdout;
+	else if ((sinks[k] = fopen(pp->path, "a")) == NULL)
+		perror_exit("fopen", pp->path);
+	nsinks = k + 1;
+}
+
+/*
+ * Once options are parsed, and defaults set, set up the -O profiles,
+ * note which metrics any profile shows, and make the first current.
+ */
+
+void profiles_init()
+{
+	int k, m;
+
+	profiles[0].name = "default";
+	profiles[0].path = "-";
+	profiles[0].opts = "";
+	profile_save(0);
+	for (k = 1; k < nprofiles; k++)
+		profile_parse(k);
+	for (k = 0; k < nprofiles; k++) {
+		profile_load(k);
+		for (m = 0; m < NMETRICS; m++)
+			metric_collected[m] |= metrics[m].active;
+	}
+	profile_load(0);
+
+	ncollect = 0;
+	for (m = 0; m < NMETRICS; m++)
+		if (metric_collected[m])
+			collect_metrics[ncollect++] = m;
+}
+
+const char *journal_path = NULL;	/* -j path to journal socket */
+long episode_id;			/* time current overload began */
+
+const char *rrd_path = NULL;		/* -R path to metrics store */
+const char *rrd_query = NULL;		/* -Y time to look up in store */
+
+const char *cpufreq_root = "/sys/devices/system/cpu";	/* -y dir */
+const char *cpustat_path = "/proc/stat";		/* -y ,statfile */
 
 int szcmdlinebuf = DEF_L;
 char *cmdlinebuf;	/* dynamically allocated buf of size szcmdlinebuf */
@@ -336,32 +964,75 @@ char *listdisks()
 void show_current_settings()
 {
 	char *dm;
+	int m;
 
 	printf("Option settings:\n");
-	printf("  Show CPU hogs: -C %d\n", flag_C);
-	printf("  Show Mem hogs: -M %d\n", flag_M);
-	printf("  Show Block I/O waiters: -B %d\n", flag_B);
+	for (m = 0; m < NMETRICS; m++)
+		printf("  %s: -%c %d\n", metrics[m].flag_descr,
+			metrics[m].flag_opt, metrics[m].enabled);
 	printf("  Show count of PHP tasks: -P %d\n", flag_P ? 1 : 0);
 	printf("  Show count of httpd tasks: -H %d\n", flag_H ? 1 : 0);
+	printf("  Low wakeup idle mode: -I %d\n", flag_I);
 	printf("  Outerloop time (secs): -s %.3f\n", val_s);
 	printf("  Innerloop time (secs): -t %.3f\n", val_t);
 	printf("  Min busy loadavg: -p %.3f\n", val_p);
 	printf("  Min busy CPU load: -c %.1f%%\n", val_c);
 	printf("  Min busy Mem load: -m %0.1f%%\n", val_m);
 	printf("  Min busy Cpuset memory pressure: -u %d\n", val_u);
-	printf("  Busy tasks (1/1000 of CPU, aka mcpus): -q %ld\n", val_q);
-	printf("  RSS mem hogs (1/1000 of RAM, aka mrams): -r %ld\n", val_r);
-	printf("  Block I/O waiters (msecs per sec): -b %ld\n", val_b);
+	printf("  Max busy zone headroom over low watermark (0 for off): "
+		"-z %.3f\n", val_z);
+	printf("  Min busy CPU capacity lost to frequency throttling "
+		"(0 for off): -f %.1f%%\n", val_f);
+	printf("  CPU sysfs dir, per-CPU stat file: -y %s,%s\n",
+		cpufreq_root, cpustat_path);
+	if (val_i)
+		printf("  Extra meminfo fields (kB) and triggers: -i %s\n", val_i);
+	else
+		printf("  Extra meminfo fields (kB) and triggers: "
+			"[-i field[>n|<n],...]\n");
+	for (m = 0; m < NMETRICS; m++)
+		printf("  %s: -%c %ld\n", metrics[m].thresh_descr,
+			metrics[m].thresh_opt, metrics[m].thresh);
 	printf("  Max number tasks to show: -n %ld\n", val_n);
 	printf("  Length cmdline to display: -L %d\n", szcmdlinebuf);
+	printf("  Heartbeat period (secs, 0 for time marks): -A %ld\n", val_A);
+	printf("  Snapshots kept for avgmcpus (0 for none): -k %ld\n", val_k);
+	printf("  Max number stalled cgroups to show: -G %ld\n", val_G);
+	printf("  Syscalls per cycle counting fds (0 for none): -F %ld\n", val_F);
+	printf("  Max number slab caches to show: -S %ld\n", val_S);
+	printf("  Max number lock holders to show: -l %ld\n", val_l);
+	printf("  Output budget (bytes/sec, 0 for none): -w %ld\n", val_w);
+	printf("  Max number correlated tasks to show at episode end: "
+		"-K %ld\n", val_K);
+	printf("  Continuous mode task slices (0 for off): -Z %ld\n", val_Z);
+	printf("  Change-only tables (tolerance %%, 0 for off; full every K): "
+		"-D %g,%ld\n", val_D_tol, val_D_full);
 
 	dm = listdisks();
 	printf("%s", dm);
 	free(dm);
 
+	if (journal_path)
+		printf("  Journal socket: -j %s\n", journal_path);
+	else
+		printf("  Journal socket: [-j path]\n");
+
+	if (rrd_path)
+		printf("  Metrics store: -R %s\n", rrd_path);
+	else
+		printf("  Metrics store: [-R path]\n");
+	for (m = 1; m < nprofiles; m++)
+		printf("  Extra profile: -O %s:%s:%s\n", profiles[m].name,
+			profiles[m].path, profiles[m].opts);
+	if (nprofiles == 1)
+		printf("  Extra profiles: [-O name:path:options]\n");
+	printf("  Fleet merge of log files: [-U logfile ...]\n");
+	printf("  Columnar archive of log files: [-E archive]\n");
+	printf("  Query of columnar archive: [-V query]\n");
+
 	printf("Use -Q option to Quiet above option setting display.\n");
 	printf("\n");
-	fflush(stdout);
+	flush_output();
 }
 
 /*
@@ -372,28 +1043,170 @@ void show_current_settings()
  */
 #define TASK_COMM_LEN 16
 
+/*
+ * Command name interning.
+ *
+ * A few hundred distinct command names are shared by the (possibly
+ * tens of thousands of) tasks on a system, and the same names show up
+ * again in every snapshot.  So rather than copy each task's name into
+ * each snapshot, keep one table of the distinct names seen, and store
+ * in each snapshot just the 32 bit id of the task's name in that table.
+ *
+ * The table is an open addressing hash (FNV-1a over the raw name bytes)
+ * of ids, plus an array of the names themselves, indexed by id.  It is
+ * shared by all snapshots, and lives as long as we do - ids are never
+ * reused, so an id from any snapshot stays valid.  Comparing two names
+ * is comparing two ids, and the answer to questions like "does this
+ * name contain 'php'?" can be computed once per name, rather than once
+ * per task per snapshot (see comm_matches(), below).
+ *
+ * So that hosts that run ever new command names (temporary files, per
+ * job binaries) don't grow the table without bound, it holds at most
+ * COMM_MAX_NAMES names.  Once full, each new name gets the id of "?".
+ */
+
+#define COMM_MAX_NAMES 65536
+
+typedef uint32_t comm_id_t;
+
+char **comm_names;		/* comm_names[id] is name with that id */
+comm_id_t comm_nnames;		/* number of names interned */
+comm_id_t comm_maxnames;	/* number allocated in comm_names[] */
+uint32_t *comm_hash;		/* 1 + id, or 0 for empty */
+uint32_t comm_hashsize;		/* power of 2 */
+
+uint32_t comm_fnv1a(const char *p, int len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len-- > 0) {
+		h ^= (unsigned char) *p++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+void comm_rehash(uint32_t newsize)
+{
+	comm_id_t id;
+
+	free(comm_hash);
+	if ((comm_hash = calloc(newsize, sizeof(*comm_hash))) == NULL)
+		perror_exit("calloc", "comm hash");
+	comm_hashsize = newsize;
+
+	for (id = 0; id < comm_nnames; id++) {
+		const char *name = comm_names[id];
+		uint32_t h = comm_fnv1a(name, strlen(name));
+
+		while (comm_hash[h & (newsize - 1)] != 0)
+			h++;
+		comm_hash[h & (newsize - 1)] = 1 + id;
+	}
+}
+
+/*
+ * Return the id of the len byte command name at p (not necessarily
+ * nul-terminated), adding it to the table if not already there.
+ */
+
+comm_id_t comm_intern(const char *p, int len)
+{
+	uint32_t h;
+	uint32_t e;
+	char *name;
+
+	if (len > TASK_COMM_LEN - 1)
+		len = TASK_COMM_LEN - 1;
+
+	if (comm_hashsize == 0)
+		comm_rehash(1024);
+
+	for (h = comm_fnv1a(p, len); (e = comm_hash[h & (comm_hashsize - 1)]); h++) {
+		name = comm_names[e - 1];
+		if (strncmp(name, p, len) == 0 && name[len] == '\0')
+			return e - 1;
+	}
+
+	/* Not found: if full, use "?" (adding it as the last name) */
+	if (comm_nnames >= COMM_MAX_NAMES - 1 && !(len == 1 && *p == '?'))
+		return comm_intern("?", 1);
+
+	/* Else add it at the empty hash slot we stopped on */
+	if (comm_nnames == comm_maxnames) {
+		comm_maxnames = 2 * comm_maxnames + 256;
+		comm_names = realloc(comm_names,
+				comm_maxnames * sizeof(*comm_names));
+		if (comm_names == NULL)
+			perror_exit("realloc", "comm names");
+	}
+	if ((name = strndup(p, len)) == NULL)
+		perror_exit("strndup", "comm name");
+	comm_names[comm_nnames] = name;
+	comm_hash[h & (comm_hashsize - 1)] = 1 + comm_nnames;
+
+	/* Keep hash at most half full */
+	if (++comm_nnames > comm_hashsize / 2)
+		comm_rehash(2 * comm_hashsize);
+
+	return comm_nnames - 1;
+}
+
+const char *comm_name(comm_id_t id)
+{
+	return comm_names[id];
+}
+
+/*
+ * Does the name with this id contain the substring pat?  The answer
+ * for each id is remembered in *memop (one signed char per id: -1 for
+ * not yet known, 0 for no, 1 for yes), so strstr() is called just once
+ * per distinct name, for each pattern, over the life of the program.
+ */
+
+typedef struct {
+	const char *pat;	/* substring to look for */
+	signed char *memo;	/* memo[id]: -1 unknown, else 0 or 1 */
+	comm_id_t nmemo;	/* number elements in memo[] */
+} comm_pattern_t;
+
+int comm_matches(comm_pattern_t *cpp, comm_id_t id)
+{
+	if (id >= cpp->nmemo) {
+		comm_id_t newn = comm_maxnames;
+
+		if ((cpp->memo = realloc(cpp->memo, newn)) == NULL)
+			perror_exit("realloc", "comm pattern memo");
+		memset(cpp->memo + cpp->nmemo, -1, newn - cpp->nmemo);
+		cpp->nmemo = newn;
+	}
+	if (cpp->memo[id] < 0)
+		cpp->memo[id] = strstr(comm_name(id), cpp->pat) != NULL;
+	return cpp->memo[id];
+}
+
 /*
  * When taking snapshot of all tasks, stash for each task
- *  1) its command name,
+ *  1) its command name (as an interned comm_id_t),
  *  2) its process id (pid), and
- *  3) its total milliseconds CPU time so far,
- *	converted from ticks using sysconf(_SC_CLK_TCK),
- *	both user and system time,
- *	both the current task and all waited for children
- *  4) its memory usage (Resident Set Size - rss) in kbytes.
- *  5) its aggregate block I/O delays in msecs
+ *  3) the value of each active metric, such as
+ *	its total milliseconds CPU time so far (val[M_CPU]),
+ *	its memory usage (Resident Set Size - rss) in mrams (val[M_RSS]),
+ *	its aggregate block I/O delays in msecs (val[M_DISK]).
+ *	Inactive metrics are left zero.
  */
 struct task_usage {
- 	char cmd[TASK_COMM_LEN];
+ 	comm_id_t comm;			/* interned command name */
  	pid_t pid;
- 	uint64_t cpumsecs;		/* total msecs CPU usage */
- 	uint64_t rssmram;		/* 1/1000ths of RAM in RSS */
- 	uint64_t diskwait;		/* total msecs block I/O delays */
+ 	unsigned char policy;		/* scheduling policy (SCHED_*) */
+ 	unsigned char rtprio;		/* realtime priority (0 .. 99) */
+ 	uint64_t val[NMETRICS];		/* value of each metric */
 };
 
 typedef struct {
 	struct task_usage *tu_array;	/* dynamic array of task_usage's */
 	int tu_nelem;			/* number elements in tu_array */
+	long tu_nthreads;		/* total threads in all tasks */
 } task_usages_t;
 
 /*
@@ -520,7 +1333,7 @@ int get_ncpus()
 	const char *sys_cpu_path = "/sys/devices/system/cpu";
 
 	if ((fdirp = opendir(sys_cpu_path)) == NULL) {
-		printf("Unable to scan %s directory\n", sys_cpu_path);
+		oprintf("Unable to scan %s directory\n", sys_cpu_path);
 		return 1;	/* don't scale mcpus by num CPUs */
 	}
 	while ((ent = readdir(fdirp)) != NULL) {
@@ -532,7 +1345,7 @@ int get_ncpus()
 	closedir(fdirp);
 
 	if (n == 0) {
-		printf("Found no cpu# in %s\n", sys_cpu_path);
+		oprintf("Found no cpu# in %s\n", sys_cpu_path);
 		return 1;
 	}
 	return n;
@@ -566,10 +1379,11 @@ int get_ncpus()
  * routine, in the file minimal.c, of the package procps-3.2.8 (the
  * packages that provides such commands as 'top'.)
  *
- * If successful, writes cmd, *p_pid, *p_cpusecs and *p_rss with
- * the command name, pid, total (user+sys) (self+children) cpu seconds,
- * and resident set size (in pages) of the task whose pid (as decimal
- * ASCII string) is pidstr, and returns 0.
+ * If successful, writes *tup with the interned command name id, pid,
+ * scheduling policy and realtime priority, and the value of each active
+ * metric (see the metrics[] table), and *p_nthreads with the number of
+ * threads, of the task whose pid (as decimal ASCII string) is pidstr,
+ * and returns 0.
  *
  * If fails, returns various negative numbers, depending on what broke.
  * If the task being examined exits before we complete the open or
@@ -579,17 +1393,13 @@ int get_ncpus()
  * should not happen if this code and the underlying system are bug free.
  * Return -2 or less in these various cases.
  *
- * The units of p_cpumsecs are milliseconds of CPU.  This routine converts
- * from the kernel tick units in the /proc/<pid>/stat file to milliseconds
- * or msecs.
- *
- * The units of p_rssmram are 1/1000th of the systems RAM size (termed
- * here millirams or mrams)  This routine converts from the kernel vm page
- * size units in the /proc/<pid>/stat file to millirams.
+ * The fields are parsed into a stat_fields_t, from which each active
+ * metric's source routine (such as src_cpumsecs(), below) computes
+ * that metric's value, converting from kernel units as need be.
  */
 
-int read_stat_file(const char *pidstr, char *cmd, int cmdlen, pid_t *p_pid,
-	uint64_t *p_cpumsecs, uint64_t *p_rssmram, uint64_t *p_diskwait)
+int read_stat_file(const char *pidstr, struct task_usage *tup,
+	long *p_nthreads)
 { 
 	char buf[800];		/* length suggested in procps minimal.c */
 	int fd;			/* open file desc on /proc/<pid>/stat */
@@ -598,20 +1408,8 @@ int read_stat_file(const char *pidstr, char *cmd, int cmdlen, pid_t *p_pid,
 	char *closeparen;	/* pointer to ')' after the command field */
 	char *restofline;	/* remaining fields past command field */
 	pid_t pid2;		/* input pidstr, as pid_t (integer) type */
-
-	uint64_t utime, stime;		/* ticks in user, sys mode */
-	long int cutime, cstime;	/* ticks of waited-for children */
-	long unsigned ucutime, ucstime;	/* ticks of waited-for children */
-	uint64_t ticks_per_sec;		/* clock Ticks Per Second */
-	uint64_t cputicks;		/* total accumlated CPU ticks */
-	uint64_t cpumsecs;		/* total accumulated CPU msecs */
-	uint64_t rsspages;		/* Resident Set Size (pages) */
-	uint64_t rsskbytes;		/* Resident Set Size (kbytes) */
-	uint64_t rssmram;		/* Resident Set Size (mrams) */
-	uint64_t pgsz;			/* kbytes per kernel page */
-	uint64_t ramsz;			/* kbytes in all of RAM */
-	uint64_t blockioticks;		/* total block I/O delays (ticks) */
-	uint64_t diskwait;		/* total block I/O delays (msecs) */
+	stat_fields_t sf;	/* fields parsed from stat file */
+	int k;			/* scans active_metrics[] */
 
 	/* Ensure next sprintf doesn't overflow buf with silly long pidstr */
 	if (strlen(pidstr) > 30)
@@ -632,20 +1430,19 @@ int read_stat_file(const char *pidstr, char *cmd, int cmdlen, pid_t *p_pid,
 		return -4;		/* broken stat file format */
 	*closeparen = '\0';		/* split into "PID (cmd" and rest */
 	restofline = closeparen + 2;	/* skip space after closeparen */
-	strncpy(cmd, openparen + 1, cmdlen);
-	cmd[cmdlen - 1] = '\0';
+	tup->comm = comm_intern(openparen + 1, closeparen - (openparen + 1));
 
 	/*
 	 * the first field in /proc/<pid>/stat really should be
 	 * the same as the pid in the pathname of that file.
 	 */
-	sscanf(buf, "%d", p_pid);
+	sscanf(buf, "%d", &tup->pid);
 	sscanf(pidstr, "%d", &pid2);
-	if (*p_pid != pid2)
+	if (tup->pid != pid2)
 		return -5;		/* seriously weird pid's */
 	if (strlen(restofline) < 50)
 		return -6;		/* hopelessly short stat line */
-	if (*p_pid == 0 || pid2 == 0)
+	if (tup->pid == 0 || pid2 == 0)
 		return -8;		/* how did that zero pid get here */
 
 	num = sscanf(restofline,
@@ -656,7 +1453,7 @@ int read_stat_file(const char *pidstr, char *cmd, int cmdlen, pid_t *p_pid,
 		"%*u %*u "		/* majflt, cmajflt */
 		"%lu %lu %ld %ld "	/* utime, stime, cutime, cstime */
 		"%*d %*d "		/* priority, nice */
-		"%*d %*d "		/* num_threads, itrealvalue */
+		"%ld %*d "		/* num_threads, itrealvalue */
 		"%*u %*u "		/* starttime, vsize */
 		"%lu %*u "		/* rss, rsslim */
 		"%*u %*u %*u "		/* startcode, endcode, startstack */
@@ -664,70 +1461,124 @@ int read_stat_file(const char *pidstr, char *cmd, int cmdlen, pid_t *p_pid,
 		"%*u %*u %*u %*u "	/* signal, blocked, ignore, catch */
 		"%*u "			/* wchan */
 		"%*u %*u "		/* nswap, cnswap */
-		"%*d %*d %*u %*u "	/* exitsig, cpu, rt_pri, schedpol */
+		"%*d %*d %u %u "	/* exitsig, cpu, rt_pri, schedpol */
 		"%lu "			/* delayacct_blkio_ticks (2.6.18)*/
 		,
 
-	       &utime, &stime, &cutime, &cstime, &rsspages, &blockioticks
+	       &sf.utime, &sf.stime, &sf.cutime, &sf.cstime, &sf.num_threads,
+	       &sf.rsspages, &sf.rt_priority, &sf.policy, &sf.blockioticks
 	    );
 
-	if (num != 6)
-		return -7;		/* didn't get the 6 values */
+	if (num != 9)
+		return -7;		/* didn't get the 9 values */
+	*p_nthreads = sf.num_threads;
+	tup->policy = sf.policy;
+	tup->rtprio = sf.rt_priority;
 
-	/* Convert rss from pages to mrams (1/1000'ths of RAM size) */
-	pgsz = kernel_page_size();
-	ramsz = ram_size_in_kbytes();
-	rsskbytes = rsspages * pgsz;	/* convert pages to kbytes */
-	rssmram = 1000 * rsskbytes;	/* multiply before divide ... */
-	rssmram /= ramsz;		/* ... for better precision */
-	*p_rssmram = rssmram;		/* RSS size in milli-rams */
+	memset(tup->val, 0, NMETRICS * sizeof(*tup->val));
+	for (k = 0; k < ncollect; k++) {
+		int m = collect_metrics[k];
 
-	/*
-	 * Convert total accumlated CPU ticks to msecs.
-	 *
-	 * The kernel and top (procps) have cutime and cstime as
-	 * signed longs, not unsigned.  This seems strange, so I
-	 * discard (take as if 0) cutime or cstime if less than zero.
-	 */
+		tup->val[m] = metrics[m].source(&sf);
+	}
+
+	return 0;			/* Success */
+}
+
+/*
+ * Convert total accumulated CPU ticks to msecs.
+ *
+ * The kernel and top (procps) have cutime and cstime as
+ * signed longs, not unsigned.  This seems strange, so I
+ * discard (take as if 0) cutime or cstime if less than zero.
+ */
+
+uint64_t src_cpumsecs(const stat_fields_t *sfp)
+{
+	long unsigned ucutime, ucstime;	/* ticks of waited-for children */
+	uint64_t cputicks;		/* total accumlated CPU ticks */
+	uint64_t cpumsecs;		/* total accumulated CPU msecs */
 
-	ucutime = (cutime < 0L ? 0UL : (unsigned) cutime);
-	ucstime = (cstime < 0L ? 0UL : (unsigned) cstime);
-	ticks_per_sec = kernel_clock_ticks_per_second();
-	cputicks = utime + stime + ucutime + ucstime;
+	ucutime = (sfp->cutime < 0L ? 0UL : (unsigned) sfp->cutime);
+	ucstime = (sfp->cstime < 0L ? 0UL : (unsigned) sfp->cstime);
+	cputicks = sfp->utime + sfp->stime + ucutime + ucstime;
 	cpumsecs = 1000 * cputicks;	/* multiply before divide ... */
-	cpumsecs /= ticks_per_sec;	/* ... for better precision */
-	*p_cpumsecs = cpumsecs;		/* CPU usage in mcpus */
+	cpumsecs /= kernel_clock_ticks_per_second();	/* ... for precision */
+	return cpumsecs;
+}
 
-	/* Convert total block I/O delay ticks to msecs */
-	diskwait = 1000 * blockioticks;
-	diskwait /= ticks_per_sec;
-	*p_diskwait = diskwait;
+/* Convert rss from pages to mrams (1/1000'ths of RAM size) */
 
-	return 0;			/* Success */
+uint64_t src_rssmram(const stat_fields_t *sfp)
+{
+	uint64_t rsskbytes;		/* Resident Set Size (kbytes) */
+	uint64_t rssmram;		/* Resident Set Size (mrams) */
+
+	rsskbytes = sfp->rsspages * kernel_page_size();
+	rssmram = 1000 * rsskbytes;	/* multiply before divide ... */
+	rssmram /= ram_size_in_kbytes();	/* ... for better precision */
+	return rssmram;
 }
 
-task_usages_t get_task_usages()
+/* Convert total block I/O delay ticks to msecs */
+
+uint64_t src_diskwait(const stat_fields_t *sfp)
 {
-	int nt, i;
-	task_usages_t task_usages;
-	DIR *procdir;
-	struct dirent *ent;
-	int ret;
+	uint64_t diskwait;		/* total block I/O delays (msecs) */
 
-	nt = est_num_tasks();
-	task_usages.tu_array = malloc(nt * sizeof(struct task_usage));
+	diskwait = 1000 * sfp->blockioticks;
+	diskwait /= kernel_clock_ticks_per_second();
+	return diskwait;
+}
 
-	i = 0;			/* index task_usages.tup[0 .. nt-1] */
-	procdir = opendir("/proc");
-	while ((ent = readdir(procdir)) != NULL && i < nt) {
-		struct task_usage *tup;
+/* CPU msecs, of only SCHED_FIFO and SCHED_RR (realtime) tasks */
 
-		if (!isdigit(ent->d_name[0]))
-			continue;
+uint64_t src_rtcpumsecs(const stat_fields_t *sfp)
+{
+	if (sfp->policy != SCHED_FIFO && sfp->policy != SCHED_RR)
+		return 0;
+	return src_cpumsecs(sfp);
+}
+
+/* Number of threads, as a gauge (threads) or a delta (thrgrowth) */
+
+uint64_t src_threads(const stat_fields_t *sfp)
+{
+	return sfp->num_threads;
+}
+
+/*
+ * Read the tasks in the slices set in want[] (those whose pid % nslices
+ * is set there), or all tasks if want is NULL.  See "Continuous mode".
+ */
+
+task_usages_t get_task_slices(const unsigned char *want, int nslices)
+{
+	int nt, i;
+	task_usages_t task_usages;
+	DIR *procdir;
+	struct dirent *ent;
+	int ret;
+	long nthreads;
+
+	uint64_t t0 = bt_clock(tasks_read);
+
+	nt = est_num_tasks();
+	task_usages.tu_array = malloc(nt * sizeof(struct task_usage));
+	task_usages.tu_nthreads = 0;
+
+	i = 0;			/* index task_usages.tup[0 .. nt-1] */
+	procdir = opendir("/proc");
+	while ((ent = readdir(procdir)) != NULL && i < nt) {
+		struct task_usage *tup;
+
+		if (!isdigit(ent->d_name[0]))
+			continue;
+		if (want && !want[atoi(ent->d_name) % nslices])
+			continue;
 		tup = task_usages.tu_array + i;
-		if ((ret = read_stat_file(ent->d_name, tup->cmd,
-			sizeof(tup->cmd), &tup->pid, &tup->cpumsecs,
-			&tup->rssmram, &tup->diskwait)) < 0) {
+		if ((ret = read_stat_file(ent->d_name, tup, &nthreads)) < 0) {
+				bt_probe2(stat_fail, atoi(ent->d_name), ret);
 				if (ret <= -2) {
 				    fprintf(stderr,
 					"read_stat_file(%s) ==> %d\n",
@@ -736,13 +1587,20 @@ task_usages_t get_task_usages()
 				}
 				continue;
 			}
+		task_usages.tu_nthreads += nthreads;
 		i++;
 	}
 	task_usages.tu_nelem = i;
 	closedir(procdir);
+	bt_probe2(tasks_read, i, probe_usecs() - t0);
 	return task_usages;
 }
 
+task_usages_t get_task_usages()
+{
+	return get_task_slices(NULL, 1);
+}
+
 int min(int a, int b)
 {
 	return a < b ? a : b;
@@ -753,6 +1611,294 @@ int max(int a, int b)
 	return a > b ? a : b;
 }
 
+/*
+ * Snapshot history ("-k n").
+ *
+ * Keep the last n inner loop snapshots, for looking back further than
+ * just the prior snapshot.  Keeping each in full would cost
+ * tasks * sizeof(struct task_usage) * n bytes, too much on hosts with
+ * 50,000 tasks.  But between one snapshot and the next, most tasks'
+ * counters don't change at all, and those that do change by small
+ * amounts.  So each snapshot is stored as a byte string of per-task
+ * deltas against the snapshot before it, with a full "keyframe" (which
+ * is just the deltas against an empty snapshot) every HIST_KEYINT
+ * snapshots.  The oldest retained snapshot is always a keyframe.
+ *
+ * For each task, in increasing pid order, the encoding is:
+ *
+ *	varint	pid - previous task's pid
+ *	varint	mask of HIST_* bits: which fields follow
+ *	varint	comm id			(if HIST_COMM)
+ *	varint	zigzag val[m] delta	(if HIST_VAL(m), for each active m)
+ *
+ * where a task not in the snapshot before it has HIST_NEW set in
+ * its mask, and all its fields follow, as deltas from zero.  Tasks
+ * that exited are just not mentioned.  An unchanged task costs two
+ * or three bytes, rather than a full struct task_usage.
+ *
+ * Decoding any retained snapshot means decoding the keyframe at or
+ * before it, and applying at most HIST_KEYINT - 1 sets of deltas,
+ * O(tasks) work.
+ */
+
+#define HIST_KEYINT 8		/* keyframe every HIST_KEYINT snapshots */
+
+#define HIST_COMM	0x01
+#define HIST_NEW	0x02
+#define HIST_VAL(m)	(0x04 << (m))
+
+typedef struct {
+	unsigned char *buf;	/* encoded deltas */
+	size_t len;		/* bytes used in buf */
+	size_t size;		/* bytes allocated in buf */
+	int ntasks;		/* tasks in this snapshot */
+	int keyframe;		/* set if deltas against empty snapshot */
+} hist_sample_t;
+
+hist_sample_t *hist_samples;	/* ring of val_k samples */
+int hist_oldest;		/* index in ring of oldest sample */
+int hist_count;			/* number samples in ring */
+int hist_since_key;		/* samples pushed since last keyframe */
+task_usages_t hist_last;	/* copy of newest sample, to diff against */
+
+void hist_putc(hist_sample_t *hsp, unsigned char c)
+{
+	if (hsp->len == hsp->size) {
+		hsp->size = 2 * hsp->size + 4096;
+		if ((hsp->buf = realloc(hsp->buf, hsp->size)) == NULL)
+			perror_exit("realloc", "history sample");
+	}
+	hsp->buf[hsp->len++] = c;
+}
+
+void hist_put_varint(hist_sample_t *hsp, uint64_t v)
+{
+	while (v >= 0x80) {
+		hist_putc(hsp, (v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	hist_putc(hsp, v);
+}
+
+void hist_put_delta(hist_sample_t *hsp, uint64_t cur, uint64_t prev)
+{
+	int64_t d = (int64_t) (cur - prev);
+
+	/* zigzag: small negative and positive deltas both encode small */
+	hist_put_varint(hsp, ((uint64_t) d << 1) ^ (uint64_t) (d >> 63));
+}
+
+uint64_t hist_get_varint(const unsigned char **pp)
+{
+	const unsigned char *p = *pp;
+	uint64_t v = 0;
+	int shift = 0;
+
+	do {
+		v |= (uint64_t) (*p & 0x7f) << shift;
+		shift += 7;
+	} while (*p++ & 0x80);
+	*pp = p;
+	return v;
+}
+
+uint64_t hist_get_delta(const unsigned char **pp, uint64_t prev)
+{
+	uint64_t z = hist_get_varint(pp);
+
+	return prev + ((z >> 1) ^ -(z & 1));
+}
+
+/*
+ * Encode snapshot cur into hsp as deltas against snapshot prev
+ * (both in increasing pid order, as read from /proc).
+ */
+
+void hist_encode(hist_sample_t *hsp, task_usages_t prev, task_usages_t cur)
+{
+	int i, pi = 0;
+	pid_t lastpid = 0;
+
+	hsp->len = 0;
+	hsp->ntasks = cur.tu_nelem;
+	hsp->keyframe = (prev.tu_nelem == 0);
+
+	for (i = 0; i < cur.tu_nelem; i++) {
+		struct task_usage *c = cur.tu_array + i;
+		struct task_usage *p;
+		unsigned mask = 0;
+		int k, m;
+
+		while (pi < prev.tu_nelem && prev.tu_array[pi].pid < c->pid)
+			pi++;
+		if (pi < prev.tu_nelem && prev.tu_array[pi].pid == c->pid) {
+			p = prev.tu_array + pi;
+			mask |= (c->comm != p->comm) ? HIST_COMM : 0;
+			for (k = 0; k < ncollect; k++) {
+				m = collect_metrics[k];
+				if (c->val[m] != p->val[m])
+					mask |= HIST_VAL(m);
+			}
+		} else {
+			static struct task_usage zero;
+
+			p = &zero;
+			mask = HIST_NEW|HIST_COMM;
+			for (k = 0; k < ncollect; k++)
+				mask |= HIST_VAL(collect_metrics[k]);
+		}
+
+		hist_put_varint(hsp, (uint32_t) (c->pid - lastpid));
+		lastpid = c->pid;
+		hist_put_varint(hsp, mask);
+		if (mask & HIST_COMM)
+			hist_put_varint(hsp, c->comm);
+		for (k = 0; k < ncollect; k++) {
+			m = collect_metrics[k];
+			if (mask & HIST_VAL(m))
+				hist_put_delta(hsp, c->val[m], p->val[m]);
+		}
+	}
+}
+
+/*
+ * Decode hsp, as deltas against prev, into cur (which must have
+ * room for hsp->ntasks tasks).
+ */
+
+void hist_decode(const hist_sample_t *hsp, task_usages_t prev,
+		task_usages_t *cur)
+{
+	const unsigned char *p = hsp->buf;
+	int i, pi = 0;
+	pid_t pid = 0;
+
+	for (i = 0; i < hsp->ntasks; i++) {
+		struct task_usage *c = cur->tu_array + i;
+		unsigned mask;
+		int k, m;
+
+		pid += (uint32_t) hist_get_varint(&p);
+		mask = hist_get_varint(&p);
+
+		if (mask & HIST_NEW) {
+			memset(c, 0, sizeof(*c));
+		} else {
+			while (prev.tu_array[pi].pid < pid)
+				pi++;
+			*c = prev.tu_array[pi];
+		}
+		c->pid = pid;
+		if (mask & HIST_COMM)
+			c->comm = hist_get_varint(&p);
+		for (k = 0; k < ncollect; k++) {
+			m = collect_metrics[k];
+			if (mask & HIST_VAL(m))
+				c->val[m] = hist_get_delta(&p, c->val[m]);
+		}
+	}
+	cur->tu_nelem = hsp->ntasks;
+}
+
+/*
+ * Return a malloc'd copy of the snapshot pushed "age" pushes ago
+ * (age 0 is the most recent.)  Free it with free_task_usages().
+ */
+
+task_usages_t hist_get(int age)
+{
+	task_usages_t snap, next;
+	int k, n;
+
+	if (age < 0 || age >= hist_count) {
+		fprintf(stderr, "hist_get(%d): only %d samples\n",
+			age, hist_count);
+		exit(10);
+	}
+
+	/* Back up from the requested sample to its keyframe */
+	n = hist_count - 1 - age;		/* age as offset from oldest */
+	k = n;
+	while (!hist_samples[(hist_oldest + k) % val_k].keyframe)
+		k--;
+
+	snap.tu_array = NULL;
+	snap.tu_nelem = 0;
+	snap.tu_nthreads = 0;		/* not kept in history */
+	next.tu_nthreads = 0;
+	for (; k <= n; k++) {
+		hist_sample_t *hsp = hist_samples + (hist_oldest + k) % val_k;
+
+		next.tu_array = malloc((hsp->ntasks + 1) * sizeof(*next.tu_array));
+		if (next.tu_array == NULL)
+			perror_exit("malloc", "history snapshot");
+		hist_decode(hsp, snap, &next);
+		free(snap.tu_array);
+		snap = next;
+	}
+	return snap;
+}
+
+void hist_reset()
+{
+	hist_count = 0;
+	hist_since_key = 0;
+	hist_last.tu_nelem = 0;
+}
+
+/*
+ * Append snapshot snap to the history, evicting the oldest sample
+ * if the history is full.
+ */
+
+void hist_push(task_usages_t snap)
+{
+	static const task_usages_t empty;
+	hist_sample_t *hsp;
+
+	if (val_k == 0)
+		return;
+	if (hist_samples == NULL) {
+		if ((hist_samples = calloc(val_k, sizeof(*hist_samples))) == NULL)
+			perror_exit("calloc", "history samples");
+	}
+
+	if (hist_count == val_k) {
+		/*
+		 * Evict oldest; keep the new oldest a keyframe.  Decode it
+		 * before evicting, while the keyframe it is based on is
+		 * still in the ring.
+		 */
+		int next = (hist_oldest + 1) % val_k;
+
+		if (hist_count > 1 && !hist_samples[next].keyframe) {
+			task_usages_t t = hist_get(hist_count - 2);
+
+			hist_encode(hist_samples + next, empty, t);
+			free(t.tu_array);
+		}
+		hist_oldest = next;
+		hist_count--;
+	}
+
+	hsp = hist_samples + (hist_oldest + hist_count) % val_k;
+	if (hist_count == 0 || ++hist_since_key >= HIST_KEYINT) {
+		hist_encode(hsp, empty, snap);
+		hist_since_key = 0;
+	} else {
+		hist_encode(hsp, hist_last, snap);
+	}
+	hist_count++;
+
+	hist_last.tu_array = realloc(hist_last.tu_array,
+			(snap.tu_nelem + 1) * sizeof(*snap.tu_array));
+	if (hist_last.tu_array == NULL)
+		perror_exit("realloc", "history last snapshot");
+	memcpy(hist_last.tu_array, snap.tu_array,
+		snap.tu_nelem * sizeof(*snap.tu_array));
+	hist_last.tu_nelem = snap.tu_nelem;
+}
+
 /*
  * pread(2) doesn't work on special files for some Linux kernels.
  * Rather such calls can fail with ESPIPE "Illegal seek" (even though
@@ -765,26 +1911,50 @@ int max(int a, int b)
 
 /*
  * Table of file descriptors and paths that we might try to pread on
- * indexed by the file descriptor we first opened it on.
+ * indexed by the file descriptor we first opened it on.  Grown as
+ * needed, as the cgroup stall collector (-G) may hold thousands.
  */
-#define MAX_PREAD_FD 32
-char *pread_fds[MAX_PREAD_FD];
+char **pread_fds;
+int npread_fds;			/* number entries allocated in pread_fds[] */
 int broken_pread = 0;
 
 void stash_pread_fd(int fd, const char *path)
 {
-	if (fd < 0 || fd >= MAX_PREAD_FD)
+	if (fd < 0)
 		perror_exit("stash_pread_fd", "fd out of range");
+	if (fd >= npread_fds) {
+		int n = max(fd + 1, 2 * npread_fds);
+
+		if ((pread_fds = realloc(pread_fds, n * sizeof(*pread_fds))) == NULL)
+			perror_exit("realloc", "pread_fds");
+		memset(pread_fds + npread_fds, 0,
+			(n - npread_fds) * sizeof(*pread_fds));
+		npread_fds = n;
+	}
+	free(pread_fds[fd]);
 	if ((pread_fds[fd] = strdup(path)) == NULL)
 		perror_exit("malloc", path);
 }
 
+/* Close fd, and forget it was stashed above. */
+void close_pread_fd(int fd)
+{
+	if (fd < npread_fds) {
+		free(pread_fds[fd]);
+		pread_fds[fd] = NULL;
+	}
+	close(fd);
+}
+
 /*
  * Replacement wrapper for pread(2) -- handles open/read/close
  * workaround in case kernel refused to pread on all of the files
  * that we attempt to pread from.
+ *
+ * If soft is set, return -1 on failure (such as reading a file
+ * of a cgroup that has since been removed), rather than exit.
  */
-ssize_t my_pread(int fd, void *buf, size_t count, off_t offset)
+ssize_t __my_pread(int fd, void *buf, size_t count, off_t offset, int soft)
 {
 	ssize_t sz;
 
@@ -792,19 +1962,22 @@ ssize_t my_pread(int fd, void *buf, size_t count, off_t offset)
 		int fd2;
 
 		errno = 0;
-		if (fd >= MAX_PREAD_FD)
+		if (fd >= npread_fds)
 			perror_exit("my_pread", "fd unexpectedly large");
 		if (pread_fds[fd] == NULL) {
 			fprintf(stderr, "my_pread(fd %d)\n", fd);
 			perror_exit("pread_fds", "unexpectedly NULL");
 		}
-		if ((fd2 = open(pread_fds[fd], O_RDONLY)) < 0)
+		if ((fd2 = open(pread_fds[fd], O_RDONLY)) < 0) {
+			if (soft)
+				return -1;
 			perror_exit("open", pread_fds[fd]);
+		}
 		if (offset != (off_t) 0) {
 			if (lseek(fd2, offset, SEEK_SET) == (off_t) -1)
 				perror_exit("lseek", pread_fds[fd]);
 		}
-		if ((sz = read(fd2, buf, count)) < 0)
+		if ((sz = read(fd2, buf, count)) < 0 && !soft)
 			perror_exit("read", pread_fds[fd]);
 		close(fd2);
 		return sz;
@@ -813,14 +1986,26 @@ ssize_t my_pread(int fd, void *buf, size_t count, off_t offset)
 	if ((sz = pread(fd, buf, count, offset)) < 0) {
 		if (errno == ESPIPE) {
 			broken_pread = 1;
-			return my_pread(fd, buf, count, offset);
+			return __my_pread(fd, buf, count, offset, soft);
 		}
+		if (soft)
+			return -1;
 		perror_exit("pread", "unexpected errno");
 	}
 
 	return sz;
 }
 
+ssize_t my_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	return __my_pread(fd, buf, count, offset, 0);
+}
+
+ssize_t my_pread_soft(int fd, void *buf, size_t count, off_t offset)
+{
+	return __my_pread(fd, buf, count, offset, 1);
+}
+
 /*
  * CPU load is computed using change in total and idle ticks
  * since previous time read, so we keep the previous ticks
@@ -932,6 +2117,367 @@ double read_cpuload()
 	return load;
 }
 
+/*
+ * Realtime runaways.
+ *
+ * A SCHED_FIFO or SCHED_RR task spinning can starve everything else
+ * on its CPU, up to the kernel's RT throttling limit: realtime tasks
+ * get at most sched_rt_runtime_us of each sched_rt_period_us (by
+ * default 950 msecs per sec.)  On a system of many CPUs, one such CPU
+ * barely moves the loadavg or the total CPU load.  So with -X:
+ *
+ *  - the "rtcpu" metric ranks realtime tasks by CPU msecs per sec
+ *    (1000 is all of one CPU), with threshold -x, or if -x is not
+ *    given, 90% of the RT throttling limit;
+ *  - realtime tasks at or over that threshold are listed first in
+ *    the hogs table, with their policy and priority, and counted in
+ *    rt_runaways (of the profile showing them), which keeps that
+ *    profile's inner loop going while any remain;
+ *  - the outer loop also reads the per-CPU lines of /proc/stat, and
+ *    a single CPU busy at least that much triggers the inner loop,
+ *    to see whether a realtime task is the cause.
+ */
+
+int rt_runaways[MAX_PROFILES];	/* per profile, RT tasks over -x last cycle */
+
+/* Read one number from a /proc/sys file, or return dflt */
+
+long read_sysctl_long(const char *path, long dflt)
+{
+	char buf[32];
+	int fd, n;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return dflt;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return dflt;
+	buf[n] = '\0';
+	return strtol(buf, NULL, 10);
+}
+
+void rt_init()
+{
+	long runtime, period, limit;
+
+	if (metrics[M_RTCPU].thresh != 0)
+		return;
+	runtime = read_sysctl_long("/proc/sys/kernel/sched_rt_runtime_us",
+		950000);
+	period = read_sysctl_long("/proc/sys/kernel/sched_rt_period_us",
+		1000000);
+	if (runtime < 0 || period <= 0 || runtime > period)
+		limit = 1000;		/* RT throttling disabled */
+	else
+		limit = 1000 * runtime / period;
+	metrics[M_RTCPU].thresh = max(1, limit * 9 / 10);
+}
+
+/*
+ * Set cpu_busy[cpu] to the busy fraction (0 to 1) of each CPU since
+ * the last call, from the per-CPU lines of /proc/stat, or to 0 if
+ * not known (as on the first call.)  Reads nothing unless -X or -f,
+ * which use them.  Called once each cycle, before either does.
+ */
+
+double *cpu_busy;		/* busy fraction of each CPU, last cycle */
+int ncpu_busy;			/* number entries in cpu_busy[] */
+
+void read_cpus_busy()
+{
+	static int fd = -1;
+	static char *buf;
+	static size_t bufsize;
+	static unsigned long *prev_active, *prev_total;
+	const char *statfile = cpustat_path;
+	ssize_t n;
+	char *p;
+
+	if (!metric_collected[M_RTCPU] && val_f == 0)
+		return;
+	if (fd < 0) {
+		if ((fd = open(statfile, O_RDONLY)) < 0)
+			perror_exit("open", statfile);
+		stash_pread_fd(fd, statfile);
+		bufsize = (ncpus + 1) * 256;
+		if ((buf = malloc(bufsize)) == NULL)
+			perror_exit("malloc", statfile);
+	}
+	while ((n = my_pread(fd, buf, bufsize - 1, (off_t)0)) ==
+			(ssize_t) bufsize - 1) {
+		bufsize *= 2;		/* more CPUs than we thought */
+		if ((buf = realloc(buf, bufsize)) == NULL)
+			perror_exit("realloc", statfile);
+	}
+	buf[n] = '\0';
+
+	for (p = buf; (p = strstr(p, "\ncpu")) != NULL; ) {
+		unsigned long f, sum_ticks = 0, idle_ticks = 0;
+		unsigned long active;
+		int cpu, fldnum;
+
+		p += 4;
+		if (!isdigit(*p))
+			continue;
+		cpu = strtol(p, &p, 10);
+		for (fldnum = 1; *p == ' '; fldnum++) {
+			f = strtoul(p, &p, 10);
+			if (fldnum == 4)	/* 4th number is idle ticks */
+				idle_ticks = f;
+			sum_ticks += f;
+		}
+		active = sum_ticks - idle_ticks;
+
+		if (cpu >= ncpu_busy) {
+			int newn = max(cpu + 1, 2 * ncpu_busy);
+
+			prev_active = realloc(prev_active, newn * sizeof(long));
+			prev_total = realloc(prev_total, newn * sizeof(long));
+			cpu_busy = realloc(cpu_busy, newn * sizeof(double));
+			if (prev_active == NULL || prev_total == NULL ||
+			    cpu_busy == NULL)
+				perror_exit("realloc", "per cpu ticks");
+			memset(prev_active + ncpu_busy, 0,
+				(newn - ncpu_busy) * sizeof(long));
+			memset(prev_total + ncpu_busy, 0,
+				(newn - ncpu_busy) * sizeof(long));
+			memset(cpu_busy + ncpu_busy, 0,
+				(newn - ncpu_busy) * sizeof(double));
+			ncpu_busy = newn;
+		}
+		cpu_busy[cpu] = 0;
+		if (prev_total[cpu] != 0 && sum_ticks > prev_total[cpu] &&
+		    active >= prev_active[cpu])
+			cpu_busy[cpu] = (double) (active - prev_active[cpu]) /
+				(sum_ticks - prev_total[cpu]);
+		prev_active[cpu] = active;
+		prev_total[cpu] = sum_ticks;
+	}
+}
+
+/*
+ * Return busy fraction (0 to 1) of the busiest CPU last cycle,
+ * or 0 unless -X.
+ */
+
+double read_max_cpubusy()
+{
+	double maxbusy = 0;
+	int cpu;
+
+	if (!metric_collected[M_RTCPU])
+		return 0;
+	for (cpu = 0; cpu < ncpu_busy; cpu++)
+		if (cpu_busy[cpu] > maxbusy)
+			maxbusy = cpu_busy[cpu];
+	return maxbusy;
+}
+
+/*
+ * Keyed /proc/meminfo fields.
+ *
+ * The fields wanted from /proc/meminfo are MemTotal and MemAvailable
+ * (for memory load, below) plus any extra fields selected with -i.
+ * Rather than scan the whole file each read, meminfo_index() notes the
+ * offset of each wanted field's line, and each read just preads up
+ * through the last such line, and scans the number at each offset.
+ * If a line is not where the index says (the layout changed, as when
+ * a kernel upgrade adds fields before it), the index is rebuilt.
+ *
+ * The -i option is a comma separated list of meminfo field names, such
+ * as Dirty,Writeback,Shmem,SUnreclaim,AnonHugePages,SwapFree,Committed_AS.
+ * Each is shown (in kB) in the inner loop header.  A field followed by
+ * ">n" or "<n" is also a trigger, making the system busy when that
+ * field is above or below n kB, as in "-i Dirty>1000000,SwapFree<100000".
+ */
+
+#define MEMINFO_MAX 24		/* max fields, including MemTotal, Avail */
+#define MEMINFO_KEYLEN 32
+
+typedef struct {
+	char key[MEMINFO_KEYLEN];	/* field name, as in "Dirty" */
+	int op;				/* '>' or '<' if trigger, else 0 */
+	unsigned long limit;		/* trigger limit (kB) */
+	unsigned long val;		/* latest value read (kB) */
+	int off;			/* offset of line in meminfo, or -1 */
+	int hidden;			/* set if not shown in header */
+} meminfo_field_t;
+
+enum { MI_MEMTOTAL, MI_MEMAVAILABLE, MI_EXTRA };
+
+meminfo_field_t meminfo_fields[MEMINFO_MAX] = {
+	{ "MemTotal", 0, 0, 0, -1, 1 },
+	{ "MemAvailable", 0, 0, 0, -1, 1 },
+};
+int nmeminfo_fields = MI_EXTRA;
+int meminfo_readlen;		/* bytes to pread to get all fields */
+
+/* Add fields (and any triggers) from -i option arg */
+
+void meminfo_select(const char *arg)
+{
+	const char *p, *q;
+
+	val_i = arg;
+	for (p = arg; *p; p = q + (*q == ',')) {
+		meminfo_field_t *mfp;
+		size_t len;
+
+		q = p + strcspn(p, ",");
+		len = strcspn(p, "<>,");
+		if (len == 0 || len >= MEMINFO_KEYLEN)
+			fatal_usage("-i field name bad length", len);
+		if (nmeminfo_fields == MEMINFO_MAX)
+			fatal_usage("-i too many fields", nmeminfo_fields);
+		mfp = meminfo_fields + nmeminfo_fields++;
+		memcpy(mfp->key, p, len);
+		mfp->key[len] = '\0';
+		mfp->off = -1;
+		if (p + len < q) {
+			char *endp;
+
+			mfp->op = p[len];
+			mfp->limit = strtoul(p + len + 1, &endp, 10);
+			if (endp != q)
+				fatal_usage("-i bad trigger limit",
+					nmeminfo_fields - MI_EXTRA);
+		}
+	}
+}
+
+/* Return index of field key, adding it (not shown) if need be */
+
+int meminfo_want(const char *key)
+{
+	int i;
+
+	for (i = 0; i < nmeminfo_fields; i++)
+		if (strcmp(meminfo_fields[i].key, key) == 0)
+			return i;
+	if (nmeminfo_fields == MEMINFO_MAX)
+		fatal_usage("-i too many fields", nmeminfo_fields);
+	snprintf(meminfo_fields[i].key, MEMINFO_KEYLEN, "%s", key);
+	meminfo_fields[i].off = -1;
+	meminfo_fields[i].hidden = 1;
+	return nmeminfo_fields++;
+}
+
+/*
+ * Scan /proc/meminfo text buf (len bytes) for the wanted fields,
+ * noting their line offsets, and how many bytes to read to get them.
+ */
+
+void meminfo_index(const char *buf, int len, const char *memfile)
+{
+	const char *line, *end = buf + len;
+	int i;
+
+	for (i = 0; i < nmeminfo_fields; i++)
+		meminfo_fields[i].off = -1;
+	meminfo_readlen = 0;
+
+	for (line = buf; line < end; ) {
+		const char *nl = memchr(line, '\n', end - line);
+		const char *colon = memchr(line, ':', (nl ? nl : end) - line);
+
+		if (nl == NULL)
+			nl = end;
+		for (i = 0; colon && i < nmeminfo_fields; i++) {
+			meminfo_field_t *mfp = meminfo_fields + i;
+
+			if ((size_t) (colon - line) == strlen(mfp->key) &&
+			    memcmp(line, mfp->key, colon - line) == 0) {
+				mfp->off = line - buf;
+				if (nl - buf + 1 > meminfo_readlen)
+					meminfo_readlen = nl - buf + 1;
+			}
+		}
+		line = nl + 1;
+	}
+
+	for (i = 0; i < nmeminfo_fields; i++) {
+		if (meminfo_fields[i].off < 0) {
+			fprintf(stderr, "%s: no %s field in %s\n", cmd,
+				meminfo_fields[i].key, memfile);
+			exit(6);
+		}
+	}
+}
+
+/*
+ * Scan the number in meminfo line at buf + off for field mfp, into
+ * mfp->val.  Return 0, or -1 if that line isn't for mfp's key, or if
+ * its number runs up to the end of buf, so might have been cut short
+ * (as a count with no " kB" after it is, once it gains a digit.)
+ */
+
+int meminfo_scan(const char *buf, int len, meminfo_field_t *mfp)
+{
+	size_t keylen = strlen(mfp->key);
+	const char *p = buf + mfp->off;
+	const char *end = buf + len;
+	unsigned long v = 0;
+
+	if (mfp->off + (int) keylen >= len ||
+	    memcmp(p, mfp->key, keylen) != 0 || p[keylen] != ':' ||
+	    (mfp->off > 0 && p[-1] != '\n'))
+		return -1;
+	for (p += keylen + 1; p < end && *p == ' '; p++)
+		;
+	if (p == end || !isdigit(*p))
+		return -1;
+	for (; p < end && isdigit(*p); p++)
+		v = v * 10 + (*p - '0');
+	if (p == end)
+		return -1;
+	mfp->val = v;
+	return 0;
+}
+
+/* Return 1 if any -i trigger is tripped */
+
+int meminfo_triggered()
+{
+	int i;
+
+	for (i = MI_EXTRA; i < nmeminfo_fields; i++) {
+		meminfo_field_t *mfp = meminfo_fields + i;
+
+		if ((mfp->op == '>' && mfp->val > mfp->limit) ||
+		    (mfp->op == '<' && mfp->val < mfp->limit))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Return the largest fraction of its limit that any -i trigger has
+ * reached: val / limit for '>', limit / val for '<'.
+ */
+
+double meminfo_level()
+{
+	double level = 0, l;
+	int i;
+
+	for (i = MI_EXTRA; i < nmeminfo_fields; i++) {
+		meminfo_field_t *mfp = meminfo_fields + i;
+
+		if (mfp->op == '>')
+			l = mfp->limit > 0 ?
+				(double) mfp->val / mfp->limit : mfp->val > 0;
+		else if (mfp->op == '<')
+			l = mfp->val > 0 ?
+				(double) mfp->limit / mfp->val : mfp->limit > 0;
+		else
+			continue;
+		if (l > level)
+			level = l;
+	}
+	return level;
+}
+
 /*
  * double read_memload()
  *
@@ -942,54 +2488,60 @@ double read_cpuload()
  * that is in use for other purposes (not easily repurposed) is the memory
  * load.
  *
- * The first three lines of /proc/meminfo provide the data needed to calculate
- * memory load:
- *	MemTotal:        xxx kB
- *	MemFree:         xxx kB
- *	MemAvailable:    xxx kB
- *
- * Memory load is calculated as:
+ * Memory load is calculated from two /proc/meminfo fields as:
  *	MemLoad = (MemTotal - MemAvailable) / MemTotal
  *
  * Memory load is some fraction between 0 and 1.  It is displayed by this
  * program as a percentage (multiplied by 100 on output).
  *
+ * Also reads any extra fields selected by -i, in the same pread.
+ *
  * The procps command "free" is an important intellectual ancestor of this code.
  */
 
 double read_memload()
 {
-	unsigned long MemTotal, MemFree, MemAvailable;
+	unsigned long MemTotal, MemAvailable;
 	double MemLoad;
-	char buf[512];
+	char buf[8192];
 	const char *memfile = "/proc/meminfo";
-	char *fmt;
 	int minread = 40;	/* Fail if read < 40 bytes from meminfo */
 	static int fd = -1;
+	int i, len;
 
 	if (fd < 0) {
 		if ((fd = open(memfile, O_RDONLY)) < 0)
 			perror_exit("open", memfile);
 		stash_pread_fd(fd, memfile);
 	}
-        if (my_pread(fd, buf, sizeof(buf), (off_t)0) < minread)
-                perror_exit("short read", memfile);
-
-        fmt =	"MemTotal: %lu kB\n"
-        	"MemFree: %lu kB\n"
-        	"MemAvailable: %lu kB\n";
-
-        if (sscanf(buf, fmt, &MemTotal, &MemFree, &MemAvailable) != 3)
-        	perror_exit("sscanf", memfile);
-
-        if (MemTotal == 0UL)
-        	perror_exit("zero MemTotal", memfile);
-
-        if (MemAvailable > MemTotal)
-        	perror_exit("Avail mem > total mem!", memfile);
-
-        MemLoad = (double) (MemTotal - MemAvailable) / MemTotal;
-        return MemLoad;
+	if (meminfo_readlen == 0)
+		goto reindex;
+	len = my_pread(fd, buf, meminfo_readlen, (off_t)0);
+	for (i = 0; i < nmeminfo_fields; i++)
+		if (meminfo_scan(buf, len, meminfo_fields + i) < 0)
+			goto reindex;
+	goto scanned;
+
+reindex:
+	if ((len = my_pread(fd, buf, sizeof(buf), (off_t)0)) < minread)
+		perror_exit("short read", memfile);
+	meminfo_index(buf, len, memfile);
+	for (i = 0; i < nmeminfo_fields; i++)
+		if (meminfo_scan(buf, len, meminfo_fields + i) < 0)
+			perror_exit("scan", memfile);
+
+scanned:
+	MemTotal = meminfo_fields[MI_MEMTOTAL].val;
+	MemAvailable = meminfo_fields[MI_MEMAVAILABLE].val;
+
+	if (MemTotal == 0UL)
+		perror_exit("zero MemTotal", memfile);
+
+	if (MemAvailable > MemTotal)
+		perror_exit("Avail mem > total mem!", memfile);
+
+	MemLoad = (double) (MemTotal - MemAvailable) / MemTotal;
+	return MemLoad;
 }
 
 /*
@@ -1178,321 +2730,1903 @@ int read_mempres()
 }
 
 /*
- * show_hogs(prior, latest):
- *
- * Show top val_n tasks using or having more than specified CPU, Memory
- * or block I/O disk waits.
+ * Zone watermark headroom.
  *
- * The Linux kernel returns the <pid> subdirectory entries of /proc
- * already in numerically sorted order (as a side affect of a bug
- * fix to reliably return all of them.)
- *
- * So don't need to sort prior and latest on pid; rather just fail
- * if we ever see them out of order.  Go directly to the joining
- * of these two on the pid field, calculating the cpumsecs and diskwait
- * used in the elapsed time between these two snapshots.  It is OK to
- * fail, during that join, if we notice they're not sorted.  The check()
- * define, below, makes this test.
+ * The kernel wakes kswapd when a zone's free pages fall below its
+ * "low" watermark, and allocating tasks stall in direct reclaim when
+ * they fall below "min".  Memory load (see read_memload(), above) can
+ * look fine while one zone is about to cross these, so with -z frac,
+ * also watch each populated zone's headroom above its low watermark:
  *
- * Then sort the result on the various fields (CPU, Memory or Diskwait)
- * for which we want the hogs.
+ *	headroom = (free - low) / low
  *
- * The cpumsecs field below is the portion of one CPU used in the
- * time interval between prior and latest, scaled so that 1000
- * means all of one CPU was used.  This value can be over 1000 if
- * the process has multiple threads on multiple CPUs.
+ * and consider the system busy when the least headroom of any zone is
+ * below frac.  Zero headroom is right at the low watermark; negative
+ * means kswapd should already be running.
  *
- * Say for example we're asked to show tasks using over half of all
- * CPU (val_q == 500).  Say some task had used 9000 ticks (user + sys,
- * self + children) at the prior snapshot, and had used 9700 ticks
- * at the latest snapshot.  Then during that interval, that task
- * used an additional 9700 - 9000 == 700 ticks.  Say that the
- * kernel_clock_ticks_per_second was 100 (ticks/second).  Then that
- * task used 7 CPU seconds (cpusecs) during that interval.  Say that
- * the inner loop is running every 10 seconds (val_t == 10).  Then
- * that task used 7/10 or 70% of all CPU during that interval.  We would
- * set the scaled cpumsecs to 700 (70% expressed per thousands.)  If this
- * task were in the top val_n busiest CPU hogs in that interval, then
- * we would decide to display that because 700 > 500 (val_q * 10, to
- * the same scale.)
- *
- * We bother with this scaling of cpumsecs in order to collapse it to an
- * integer, expecting that the qsort comparison routine will run faster
- * comparing int's than comparing double's.  We have to qsort the list
- * of potential tasks on each possible hog type field, so that we can find
- * the val_n busiest hogs on the list.
- *
- * The cpumsecs, rssmrams, and diskwait fields are kept in the join'd
- * structure even though they can be recomputed from the indexed prior and
- * latest snapshot structures (via the i and j indices), because these
- * fields are needed by the qsort comparison routines, which we want to be
- * fast, to minimize qsort time.
+ * /proc/zoneinfo is large (it lists per-node stats, and each zone's
+ * per-cpu pagesets), and we want just two numbers per zone.  So it is
+ * parsed once into an index of the offset of each zone's "pages free"
+ * line, and thereafter each zone is re-read by pread'ing a small
+ * window around that offset.  The offsets drift as numbers earlier in
+ * the file change width, so each window is searched for its "pages
+ * free" line, and the offset updated.  Each zone takes well over
+ * 2 * ZONE_SLACK bytes, so the line found within ZONE_SLACK bytes of
+ * where it was is the same zone's.  If that line has drifted further
+ * than that, the index is rebuilt.
  */
 
+#define MAX_ZONES 64
+#define ZONE_SLACK 64		/* bytes of drift tolerated each way */
+#define ZONE_WINDOW 256		/* bytes pread'd for each zone */
+
 typedef struct {
-	int i, j;		/* index into prior, latest with same pid */
-	unsigned cpumsecs;	/* msecs per sec of cpu usage */
-	unsigned rssmrams;	/* milli-ram's in RSS */
-	unsigned diskwait;	/* msecs per sec of block I/O diskwait */
-	int showme;		/* set if this task is to be displayed */
-} join_on_pid_t;
+	char name[32];		/* "N/NAME", for display */
+	off_t off;		/* offset of "\n  pages free" line */
+	unsigned long free;	/* free pages */
+	unsigned long low;	/* low watermark (pages) */
+} zone_t;
+
+zone_t zones[MAX_ZONES];
+int nzones;			/* number zones in zones[] */
+int zone_worst = -1;		/* index in zones[] of least headroom */
+int zone_fd = -1;
+const char *zonefile = "/proc/zoneinfo";
 
 /*
- * The indices i and j in the join_on_pid_t elements (of the joinp
- * array, allocated below) index into the prior and latest arrays,
- * where the pid, cmd, rssmram, accumulated cpumsecs and diskwait
- * of that task are stored.  The PID, CMD, and RAM macros
- * facilitate accessing these pid, cmd, and rssmram, values.
+ * Parse zone's free pages and low watermark, from p, just
+ * after the "pages free" of that zone.  Return 0 on success.
  */
 
-#define PID(p, i) 	((p).tu_array[(i)].pid)
-#define CMD(p, i)	((p).tu_array[(i)].cmd)
-#define RAM(p, i)	((p).tu_array[(i)].rssmram)
+int zone_parse(const char *p, unsigned long *freep, unsigned long *lowp)
+{
+	char *q;
+
+	*freep = strtoul(p, &q, 10);
+	if (q == p || (q = strstr(q, "\n        low ")) == NULL)
+		return -1;
+	*lowp = strtoul(q + 13, NULL, 10);
+	return 0;
+}
 
 /*
- * To show the worst cpu hogs ("top" CPU users) we need to sort all
- * tasks on the amount of CPU (here in units of cpumsecs) used in the
- * last time interval (val_t).  The following comparison routine is
- * passed to qsort(), for this sorting.
+ * Read all of /proc/zoneinfo, and rebuild zones[] from it, skipping
+ * zones with no managed pages (such as an empty Movable zone.)
  */
 
-int cpumsecs_cmp(const void *p1, const void *p2)
+void zone_index()
 {
-	join_on_pid_t *jp1 = (join_on_pid_t *) p1;
-	join_on_pid_t *jp2 = (join_on_pid_t *) p2;
+	static char *buf;
+	static size_t bufsize;
+	size_t len = 0;
+	ssize_t n;
+	char *p, *q, *r;
 
-	return (jp2->cpumsecs) - (jp1->cpumsecs);
+	for (;;) {
+		if (bufsize - len < 4096) {
+			bufsize = bufsize ? 2 * bufsize : 16384;
+			if ((buf = realloc(buf, bufsize)) == NULL)
+				perror_exit("realloc", zonefile);
+		}
+		if ((n = my_pread(zone_fd, buf + len, bufsize - len - 1,
+				(off_t) len)) == 0)
+			break;
+		len += n;
+	}
+	buf[len] = '\0';
+
+	nzones = 0;
+	for (p = buf; (p = strstr(p, "Node ")) != NULL; p++) {
+		zone_t *zp = zones + nzones;
+		unsigned long managed;
+		char zname[16];
+		int node;
+
+		if ((p > buf && p[-1] != '\n') ||
+		    sscanf(p, "Node %d, zone %15s", &node, zname) != 2 ||
+		    (q = strstr(p, "\n  pages free")) == NULL ||
+		    zone_parse(q + 13, &zp->free, &zp->low) < 0 ||
+		    (r = strstr(q, "\n        managed ")) == NULL)
+			continue;
+		managed = strtoul(r + 17, NULL, 10);
+		if (managed == 0 || zp->low == 0)
+			continue;
+		snprintf(zp->name, sizeof(zp->name), "%d/%s", node, zname);
+		zp->off = q - buf;
+		if (++nzones == MAX_ZONES)
+			break;
+	}
 }
 
 /*
- * To show the worst mem hogs ("top" RSS size) we need to sort all
- * tasks on the amount of RAM (here in units of rssmram) used in the
- * lastest snapshot.  The following comparison routine is passed to
- * qsort(), for this sorting.
+ * Return least headroom of any zone, as a fraction of its low
+ * watermark, and set zone_worst to that zone.  Returns 0 (and
+ * reads nothing) unless -z was set, or HUGE_VAL (never busy) if
+ * no zone has a low watermark.
  */
 
-int rssmrams_cmp(const void *p1, const void *p2)
+double read_zoneroom()
 {
-	join_on_pid_t *jp1 = (join_on_pid_t *) p1;
-	join_on_pid_t *jp2 = (join_on_pid_t *) p2;
+	char buf[ZONE_WINDOW + 1];
+	double room, worst = 0;
+	int i;
+
+	if (val_z == 0)
+		return 0;
+
+	if (zone_fd < 0) {
+		if ((zone_fd = open(zonefile, O_RDONLY)) < 0)
+			perror_exit("open", zonefile);
+		stash_pread_fd(zone_fd, zonefile);
+		zone_index();
+	} else {
+		for (i = 0; i < nzones; i++) {
+			zone_t *zp = zones + i;
+			off_t off = zp->off > ZONE_SLACK ? zp->off - ZONE_SLACK : 0;
+			ssize_t n = my_pread(zone_fd, buf, ZONE_WINDOW, off);
+			char *p;
+
+			buf[n] = '\0';
+			if ((p = strstr(buf, "\n  pages free")) == NULL ||
+			    p - buf > 2 * ZONE_SLACK ||
+			    zone_parse(p + 13, &zp->free, &zp->low) < 0 ||
+			    zp->low == 0) {
+				zone_index();
+				break;
+			}
+			zp->off = off + (p - buf);
+		}
+	}
+
+	if (nzones == 0) {
+		static int warned;
+
+		if (!warned++)
+			fprintf(stderr, "%s: no zones with a low watermark in %s,"
+				" -z ignored\n", cmd, zonefile);
+		zone_worst = -1;
+		return HUGE_VAL;
+	}
 
-	return (jp2->rssmrams) - (jp1->rssmrams);
+	zone_worst = -1;
+	for (i = 0; i < nzones; i++) {
+		room = ((double) zones[i].free - zones[i].low) / zones[i].low;
+		if (zone_worst < 0 || room < worst) {
+			worst = room;
+			zone_worst = i;
+		}
+	}
+	return worst;
 }
 
 /*
- * To show the worst diskwait hogs ("top" RSS size) we need to sort all
- * tasks on the amount of block I/O diskwait (msecs) used in the
- * lastest interval (val_t).  The following comparison routine is passed to
- * qsort(), for this sorting.
+ * CPU frequency and thermal throttling.
+ *
+ * A CPU running at half its rated frequency does half the work, yet
+ * its tasks' mcpus (time on CPU) look just as they would at full
+ * speed.  So on hosts whose CPUs throttle, for power or thermal
+ * reasons, throughput can collapse with nothing unusual in the hogs
+ * tables.  With -f n, the outer loop also reads each CPU's current
+ * frequency (cpufreq/scaling_cur_freq), and computes the capacity
+ * lost, as the fraction of the summed rated frequencies of all CPUs
+ * that they are not running at while busy: each CPU's shortfall is
+ * weighted by its busy fraction last cycle, from /proc/stat.  The
+ * rated frequency is cpufreq/base_frequency where the driver provides
+ * it (intel_pstate, whose cpuinfo_max_freq is the maximum single-core
+ * turbo, which an all-core load never reaches), else cpuinfo_max_freq.
+ * An idle CPU clocked down by its governor (as most are, most of the
+ * time) loses no work, so costs no capacity; a busy one held below its
+ * rated frequency, by a thermal or power limit, does.  A loss over n%
+ * triggers the inner loop, and the loss is shown in the header.
+ *
+ * Where the kernel counts thermal throttling events (x86, in
+ * thermal_throttle/core_throttle_count), the number of such events
+ * since the previous cycle, summed over all CPUs, is shown as well.
+ *
+ * The CPU directories are found once, and an fd held open on each
+ * file read each cycle, which is then pread.  A CPU whose files
+ * can't be read (say, it was taken offline) is left out of that
+ * cycle's sums.  The directory searched defaults to the usual sysfs
+ * one, but can be changed with -y, to test against a fixture tree;
+ * -y dir,statfile also replaces /proc/stat (for -X too), so that a
+ * fixture stat file supplies the busy fractions as well.
  */
 
-int diskwait_cmp(const void *p1, const void *p2)
+typedef struct {
+	int cpu;			/* CPU number */
+	int cur_fd;			/* open on scaling_cur_freq */
+	int thr_fd;			/* on core_throttle_count, or -1 */
+	unsigned long max;		/* rated frequency (kHz) */
+	unsigned long throttles;	/* core_throttle_count, last read */
+} cpufreq_t;
+
+cpufreq_t *cpufreqs;
+int ncpufreqs = -1;		/* number in cpufreqs[], -1 until found */
+double cap_loss;		/* capacity lost, fraction, last cycle */
+long cap_throttles;		/* throttling events during last cycle */
+int cap_have_throttles;		/* set if any CPU counts such events */
+
+/* Read the one number in file open on fd into *valp.  Return 0 on success. */
+
+int cpufreq_read(int fd, unsigned long *valp)
 {
-	join_on_pid_t *jp1 = (join_on_pid_t *) p1;
-	join_on_pid_t *jp2 = (join_on_pid_t *) p2;
+	char buf[32];
+	ssize_t n;
 
-	return (jp2->diskwait) - (jp1->diskwait);
+	if ((n = my_pread_soft(fd, buf, sizeof(buf) - 1, (off_t) 0)) <= 0)
+		return -1;
+	buf[n] = '\0';
+	*valp = strtoul(buf, NULL, 10);
+	return 0;
 }
 
-char *get_cmdline(pid_t pid)
+/* Open file in directory of CPU cpu, stashing it for pread. */
+
+int cpufreq_open(int cpu, const char *file)
 {
+	char path[PATH_MAX];
 	int fd;
-	char cmdlinepath[32];
-	int cnt, i;
-
-	sprintf(cmdlinepath, "/proc/%d/cmdline", pid);
 
-	if ((fd = open(cmdlinepath, O_RDONLY)) < 0) {
-		sprintf(cmdlinebuf, "%*s", szcmdlinebuf, "<unknown>");
-		cmdlinebuf[szcmdlinebuf-1] = '\0';
-		return cmdlinebuf;
-	}
-	cnt = read(fd, cmdlinebuf, szcmdlinebuf);
-	close(fd);
+	snprintf(path, sizeof(path), "%s/cpu%d/%s", cpufreq_root, cpu, file);
+	if ((fd = open(path, O_RDONLY)) >= 0)
+		stash_pread_fd(fd, path);
+	return fd;
+}
 
-	/*
-	 * cmdline has embedded NUL's between args,
-	 * plus a terminating NUL (which we might not
-	 * have read, if length of cmdline > szcmdlinebuf).
-	 *
-	 * Replace embedded NUL's with spaces.
-	 */
+/* Find the CPUs with a rated frequency under cpufreq_root */
 
-	for (i = 0; i < cnt-1; i++) {
-		if (cmdlinebuf[i] == '\0')
-			cmdlinebuf[i] = ' ';
+void cpufreq_find()
+{
+	DIR *dirp;
+	struct dirent *ent;
+	int maxcpufreqs = 0;
+
+	ncpufreqs = 0;
+	if ((dirp = opendir(cpufreq_root)) == NULL)
+		perror_exit("opendir", cpufreq_root);
+	while ((ent = readdir(dirp)) != NULL) {
+		cpufreq_t *cfp;
+		char path[PATH_MAX];
+		int fd, cpu;
+		char c;
+
+		if (sscanf(ent->d_name, "cpu%d%c", &cpu, &c) != 1)
+			continue;
+		if (ncpufreqs == maxcpufreqs) {
+			maxcpufreqs = maxcpufreqs ? 2 * maxcpufreqs : 64;
+			if ((cpufreqs = realloc(cpufreqs, maxcpufreqs *
+					sizeof(*cpufreqs))) == NULL)
+				perror_exit("realloc", "cpufreqs");
+		}
+		cfp = cpufreqs + ncpufreqs;
+		snprintf(path, sizeof(path), "%s/cpu%d/cpufreq/base_frequency",
+			cpufreq_root, cpu);
+		if ((cfp->max = read_sysctl_long(path, 0)) <= 0) {
+			snprintf(path, sizeof(path),
+				"%s/cpu%d/cpufreq/cpuinfo_max_freq",
+				cpufreq_root, cpu);
+			cfp->max = read_sysctl_long(path, 0);
+		}
+		if (cfp->max > 0 &&
+		    (fd = cpufreq_open(cpu, "cpufreq/scaling_cur_freq")) >= 0) {
+			cfp->cpu = cpu;
+			cfp->cur_fd = fd;
+			cfp->thr_fd = cpufreq_open(cpu,
+				"thermal_throttle/core_throttle_count");
+			if (cfp->thr_fd >= 0 &&
+			    cpufreq_read(cfp->thr_fd, &cfp->throttles) == 0)
+				cap_have_throttles = 1;
+			ncpufreqs++;
+		}
 	}
-	cmdlinebuf[i] = '\0';
-
-	return cmdlinebuf;
+	closedir(dirp);
+	if (ncpufreqs == 0)
+		fprintf(stderr, "%s: no CPU frequencies in %s, -f ignored\n",
+			cmd, cpufreq_root);
 }
 
-char *skipwhitespace(char *p)
-{
-	while(*p == ' ' || *p == '\t')
-		p++;
-	if (*p && isgraph(*p))
-		return p;
-	else
-		return NULL;
-}
+/*
+ * Set cap_loss to the capacity lost to busy CPUs running below their
+ * rated frequencies, and cap_throttles to the thermal throttling events
+ * since the last call.  Does nothing unless -f was set.  Uses the
+ * cpu_busy[] of read_cpus_busy().
+ */
 
-char *skipfieldchars(char *p)
+void read_capacity()
 {
-	while (isgraph(*p))
-		p++;
-	return p;
+	unsigned long cur, sum_max = 0, throttles;
+	double busy, sum_lost = 0;
+	int i;
+
+	if (val_f == 0)
+		return;
+	if (ncpufreqs < 0)
+		cpufreq_find();
+
+	cap_throttles = 0;
+	for (i = 0; i < ncpufreqs; i++) {
+		cpufreq_t *cfp = cpufreqs + i;
+
+		if (cfp->thr_fd >= 0 &&
+		    cpufreq_read(cfp->thr_fd, &throttles) == 0) {
+			if (throttles > cfp->throttles)
+				cap_throttles += throttles - cfp->throttles;
+			cfp->throttles = throttles;
+		}
+		if (cpufreq_read(cfp->cur_fd, &cur) < 0)
+			continue;
+		busy = cfp->cpu < ncpu_busy ? cpu_busy[cfp->cpu] : 0;
+		if (cur < cfp->max)
+			sum_lost += busy * (cfp->max - cur);
+		sum_max += cfp->max;
+	}
+	cap_loss = sum_max ? sum_lost / sum_max : 0;
 }
 
 /*
- * Get field number 'fieldnum' from file 'path'.
+ * Per-cgroup pressure stall information (PSI).
  *
- * Fields are numbered  with field 1.  Fields are separated by one or more
- * spaces or tabs. Only the first line of file is considered.  Leading spaces
- * on line are ignored.
+ * The loadavg, CPU load and memory pressure above say that the system
+ * is stalling, but not which of the (cgroup v2) workloads sharing it
+ * are the ones stalled.  With -G n, each inner loop also shows the n
+ * cgroups that spent the most time stalled on CPU, memory or I/O, just
+ * below the hogs table, so stall victims and resource hogs can be seen
+ * side by side.
  *
- * Return malloc'c copy of field string if found.  Return NULL if
- * field not found, or if malloc fails.
+ * Each cgroup's cpu.pressure, memory.pressure and io.pressure files
+ * give the cumulative microseconds ("total=") in which some task in the
+ * cgroup was stalled ("some"), and in which all its tasks were stalled
+ * ("full"), on that resource.  Cgroups are ranked by the change in the
+ * sum of their three "some" totals per second of the last interval.
+ *
+ * The cgroup v2 hierarchy is found from /proc/mounts and walked once,
+ * at the start of each busy episode, holding open fds on each cgroup's
+ * pressure files, which are then pread each inner loop.  Cgroups
+ * created during an episode are seen at the start of the next episode;
+ * those removed just read as failed, and are skipped.
  */
 
-char *getfield(const char *path, int fieldnum)
-{
-	char buf[256];
-	char *startoffield = NULL;
-	int cnt;
-	char *p;
-	int fd;
+enum { CG_CPU_SOME, CG_CPU_FULL, CG_MEM_SOME, CG_MEM_FULL,
+	CG_IO_SOME, CG_IO_FULL, CG_NSTALLS };
 
-	if ((fd = open(path, O_RDONLY)) < 0)
-		perror_exit("open", path);
-	if ((cnt = read(fd, buf, sizeof(buf))) < 0)
-		perror_exit("read", path);
-	if (close(fd) < 0)
-		perror_exit("close", path);
+const char *cg_files[] = { "cpu.pressure", "memory.pressure", "io.pressure" };
+#define CG_NFILES ((int) (sizeof(cg_files) / sizeof(cg_files[0])))
 
-	buf[cnt-1] = '\0';
+const char *cg_headings[CG_NSTALLS] = {
+	"cpusome", "cpufull", "memsome", "memfull", "iosome", "iofull"
+};
+const char *cg_journal_keys[CG_NSTALLS] = {
+	"CPUSOME", "CPUFULL", "MEMSOME", "MEMFULL", "IOSOME", "IOFULL"
+};
 
-	errno = 0;	/* stays 0 unless strdup() failure sets */
-	p = buf;
-	while (fieldnum--) {
-		if ((p = skipwhitespace(p)) == NULL)
-			return NULL;
-		if (fieldnum == 0) 
-			startoffield = p;
-		if ((p = skipfieldchars(p)) == NULL)
-			return NULL;
-		if (fieldnum == 0) {
-			char *fdup;
-			*p = '\0';
-			if ((fdup = strdup(startoffield)) == NULL)
-				perror_exit("strdup", "requested field");
-			return fdup;
+typedef struct {
+	char *path;			/* relative to cgroup2 mount */
+	int fd[CG_NFILES];		/* open on cg_files[], or -1 */
+	uint64_t prev[CG_NSTALLS];	/* stall usecs, as of last read */
+	unsigned val[CG_NSTALLS];	/* stall msecs/sec, last interval */
+	unsigned rank;			/* sum of val[] "some" stalls */
+	int ok;				/* set if last two reads worked */
+} cgroup_t;
+
+cgroup_t *cgroups;
+int ncgroups;			/* number entries used in cgroups[] */
+int maxcgroups;			/* number entries allocated in cgroups[] */
+char *cg_mount;			/* cgroup2 mount point, NULL if none */
+size_t cg_mountlen;		/* strlen(cg_mount) */
+int cg_emfile;			/* set if ran out of fds during walk */
+
+/*
+ * Find where cgroup v2 is mounted, or leave cg_mount NULL, with a
+ * note, if it's not.
+ */
+
+void cgroup_find_mount()
+{
+	char buf[PATH_MAX];
+	char mnt[PATH_MAX], fstype[64];
+	FILE *fp;
+
+	if ((fp = fopen("/proc/mounts", "r")) == NULL)
+		perror_exit("fopen", "/proc/mounts");
+	while (flgets(buf, sizeof(buf), fp) != NULL) {
+		if (sscanf(buf, "%*s %4095s %63s", mnt, fstype) == 2 &&
+		    strcmp(fstype, "cgroup2") == 0) {
+			if ((cg_mount = strdup(mnt)) == NULL)
+				perror_exit("strdup", "cg_mount");
+			cg_mountlen = strlen(cg_mount);
+			break;
 		}
 	}
-	return NULL;
+	fclose(fp);
+
+	if (cg_mount == NULL)
+		puts("Note: cgroup2 not mounted - no cgroup stalls (-G) shown.");
 }
 
 /*
- * How many of our tasks are PHP tasks?
+ * Read one cgroup's stall totals into vals[].  Return 0 if all of
+ * its pressure files could be read, else -1.
  */
 
-int get_cnt_php(task_usages_t latest)
+int cgroup_read(const cgroup_t *cgp, uint64_t *vals)
 {
-	int ni, i;
-	int cnt = 0;
+	char buf[256];
+	int i;
+
+	for (i = 0; i < CG_NFILES; i++) {
+		char *some, *full;
+		ssize_t n;
+
+		if (cgp->fd[i] < 0 ||
+		    (n = my_pread_soft(cgp->fd[i], buf, sizeof(buf) - 1, 0)) <= 0)
+			return -1;
+		buf[n] = '\0';
+		if ((some = strstr(buf, "total=")) == NULL)
+			return -1;
+		vals[2 * i] = strtoull(some + 6, NULL, 10);
+		full = strstr(some + 6, "total=");
+		vals[2 * i + 1] = full ? strtoull(full + 6, NULL, 10) : 0;
+	}
+	return 0;
+}
 
-	ni = latest.tu_nelem;
-	for (i = 0; i < ni; i++) {
-		if (strstr(CMD(latest, i), "php") != NULL)
-			cnt++;
+/* nftw() callback for cgroup_scan(), adding each non-root cgroup. */
+
+int cgroup_add(const char *path, const struct stat *sb, int flag,
+		struct FTW *ftwbuf)
+{
+	cgroup_t *cgp;
+	int i;
+
+	(void) sb;
+	if (flag != FTW_D || ftwbuf->level == 0)
+		return 0;
+
+	if (ncgroups == maxcgroups) {
+		maxcgroups = maxcgroups ? 2 * maxcgroups : 64;
+		if ((cgroups = realloc(cgroups,
+				maxcgroups * sizeof(*cgroups))) == NULL)
+			perror_exit("realloc", "cgroups");
 	}
-	return cnt;
+	cgp = cgroups + ncgroups;
+	for (i = 0; i < CG_NFILES; i++) {
+		char *p = pathcat(path, cg_files[i]);
+
+		if ((cgp->fd[i] = open(p, O_RDONLY)) >= 0) {
+			stash_pread_fd(cgp->fd[i], p);
+		} else if (errno == EMFILE || errno == ENFILE) {
+			free(p);
+			while (--i >= 0)
+				close_pread_fd(cgp->fd[i]);
+			cg_emfile = 1;
+			return 1;	/* stop the walk */
+		}
+		free(p);
+	}
+	if ((cgp->path = strdup(path + cg_mountlen)) == NULL)
+		perror_exit("strdup", path);
+	cgp->ok = cgroup_read(cgp, cgp->prev) == 0;
+	ncgroups++;
+	return 0;
 }
 
 /*
- * How many of our tasks are httpd tasks?
+ * (Re)build cgroups[] from the current cgroup hierarchy, reading
+ * each cgroup's initial stall totals.  Does nothing unless -G n.
  */
 
-int get_cnt_httpd(task_usages_t latest)
+void cgroup_scan()
 {
-	int ni, i;
-	int cnt = 0;
+	static int initialized;
+	int i, j;
 
-	ni = latest.tu_nelem;
-	for (i = 0; i < ni; i++) {
-		if (strstr(CMD(latest, i), "httpd") != NULL)
-			cnt++;
+	if (val_G == 0)
+		return;
+	if (!initialized) {
+		struct rlimit rl;
+
+		initialized = 1;
+		cgroup_find_mount();
+
+		/* We may hold three fds per cgroup, so allow all we can. */
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+			rl.rlim_cur = rl.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &rl);
+		}
+	}
+	if (cg_mount == NULL)
+		return;
+
+	for (i = 0; i < ncgroups; i++) {
+		for (j = 0; j < CG_NFILES; j++)
+			if (cgroups[i].fd[j] >= 0)
+				close_pread_fd(cgroups[i].fd[j]);
+		free(cgroups[i].path);
+	}
+	ncgroups = 0;
+
+	if (nftw(cg_mount, cgroup_add, 16, FTW_PHYS) < 0)
+		perror_exit("nftw", cg_mount);
+	if (cg_emfile) {
+		fprintf(stderr, "%s: out of file descriptors - "
+			"only %d cgroups monitored\n", cmd, ncgroups);
+		cg_emfile = 0;
 	}
-	return cnt;
 }
 
 /*
- * Extract from /sys/block/.../stat how much disk has been used on each
- * monitored disk in disks_monitored, since the previous time we were
- * called.  Return results as malloc'd ready to display string.
- * Be sure to free() result once done using it.
- *
- * Update the prev_time_in_queue values to the current value for each
- * monitored disk, and update the static "prev_now", so that the next
- * time this routine is called, it can compute the difference in usage
- * (delta_usage) for the elapsed time between the two calls.
+ * Read each cgroup's stall totals, setting its val[] to the msecs
+ * of stall per second since the prior read, and its rank.
+ */
+
+void cgroup_sample()
+{
+	int i, j;
+
+	for (i = 0; i < ncgroups; i++) {
+		cgroup_t *cgp = cgroups + i;
+		uint64_t cur[CG_NSTALLS];
+		int ok = cgroup_read(cgp, cur) == 0;
+
+		cgp->rank = 0;
+		if (ok && cgp->ok) {
+			for (j = 0; j < CG_NSTALLS; j++) {
+				cgp->val[j] = cur[j] > cgp->prev[j] ?
+					(cur[j] - cgp->prev[j]) / 1000 / val_t : 0;
+				if (j % 2 == 0)
+					cgp->rank += cgp->val[j];
+			}
+		}
+		if (ok)
+			memcpy(cgp->prev, cur, sizeof(cur));
+		cgp->ok = ok;
+	}
+}
+
+/*
+ * File descriptor leak detection.
  *
- * Output is in units of "mdsk", which is a made up unit for how many
- * milliseconds of disk being used (command in flight, either in queue
- * or being processed) per second of elapsed time.
+ * Daemons leaking sockets or files run until they hit their open files
+ * limit (RLIMIT_NOFILE), then fail in ways slow to diagnose.  The number
+ * of fds a task has open is the number of entries in /proc/<pid>/fd,
+ * but reading that directory for every task every cycle could cost more
+ * than all the rest of the inner loop.  So with -F budget, each inner
+ * loop counts the fds of only as many tasks as it can within budget
+ * system calls (the open, getdents64's and close of /proc/<pid>/fd,
+ * plus reading /proc/<pid>/limits, once per task), resuming the next
+ * cycle where this one left off, in pid order, so that every task is
+ * counted every so many cycles.
  *
- * In other words, the output values for diskusage are scaled so that
- * a disk made 100% busy by a single threaded task will display about
- * "1000" for diskusage (1000 msecs per sec of one op in flight.)
+ * The last FD_HIST counts of each task, and when they were taken, are
+ * kept as long as that task lives (across busy episodes.)  A task is
+ * reported if over at least FD_MIN_SAMPLES counts its fds never went
+ * down and grew by at least FD_MIN_GROWTH, or if it is using at least
+ * FD_NEAR_PCT percent of its soft limit.  Tasks whose fds can't be read
+ * (not ours), or that had none (kernel threads), are not tried again.
  */
 
-char *get_disks_monitored()
+#define FD_HIST 8		/* counts kept per task */
+#define FD_MIN_SAMPLES 3	/* counts needed to call it growing */
+#define FD_MIN_GROWTH 16	/* fds growth needed to call it growing */
+#define FD_NEAR_PCT 80		/* percent of soft limit that's near it */
+
+typedef struct {
+	pid_t pid;
+	comm_id_t comm;			/* to notice pid reuse */
+	int skip;			/* set if not to be counted again */
+	unsigned long softlimit;	/* soft RLIMIT_NOFILE, 0 if none */
+	int nsamples;			/* number valid in nfds[], when[] */
+	int nfds[FD_HIST];		/* fd counts, oldest first */
+	time_t when[FD_HIST];		/* when each count was taken */
+} fdtrack_t;
+
+fdtrack_t *fdtracks;		/* one per task in last snapshot */
+int nfdtracks;			/* number entries in fdtracks[] */
+pid_t fd_cursor;		/* resume counting at first pid >= this */
+
+/* Layout of the records returned by getdents64(2) */
+typedef struct {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+} fd_dirent64_t;
+
+/*
+ * Return number of fds task pid has open, or -1 if can't tell.
+ * Adds the system calls made to *ncallsp.
+ */
+
+int fd_count(pid_t pid, long *ncallsp)
 {
-	time_t now;		/* time now (seconds since epoch) */
-	static time_t prev_now;	/* time last called (secs since epoch) */
-	diskstat_t **dspp;	/* scans disks_monitored */
-	char *argz = NULL;
-	size_t argz_len = 0;
-	int e;			/* errno return from argz_* routines */
+	uint64_t buf[1024];	/* uint64_t for dirent alignment */
+	char path[32];
+	long nread = 0;
+	int fd, cnt = 0;
+
+	sprintf(path, "/proc/%d/fd", pid);
+	(*ncallsp)++;
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY)) < 0)
+		return -1;
+	for (;;) {
+		long off;
 
-	if (!disks_monitored) {	/* empty result if no disks monitored */
-		if ((argz = strdup("")) == NULL)
-			perror_exit("strdup", "empty string");
-		return argz;
-	}
+		(*ncallsp)++;
+		if ((nread = syscall(SYS_getdents64, fd, buf, sizeof(buf))) <= 0)
+			break;
+		for (off = 0; off < nread; ) {
+			fd_dirent64_t *dp = (fd_dirent64_t *) ((char *) buf + off);
 
-	now = time(NULL);
-	if ((e = argz_add(&argz, &argz_len, "; diskusage")) != 0) {
-		errno = e;
-		perror_exit("argz_add", "diskusage");
+			if (dp->d_name[0] != '.')
+				cnt++;
+			off += dp->d_reclen;
+		}
 	}
+	(*ncallsp)++;
+	close(fd);
+	return nread < 0 ? -1 : cnt;
+}
 
-	for (dspp = disks_monitored; *dspp; dspp++) {
-		uint32_t cur_time_in_queue;
-		time_t delta_time;
-		uint32_t delta_usage;
-		uint32_t mdsk;
-		char *mstr;
-		int mlen;
-		char *fld11_str;
-		diskstat_t *dsp;
+/*
+ * Return soft limit on open files of task pid, from its
+ * /proc/<pid>/limits, or 0 if unlimited or can't tell.
+ * Adds the system calls made to *ncallsp.
+ */
 
-		dsp = *dspp;
-		if ((fld11_str = getfield(dsp->path, 11)) == NULL) {
-			fprintf(stderr, "File %s no field 11\n", dsp->path);
-			exit(1);
-		}
-		if ((sscanf(fld11_str, "%u", &cur_time_in_queue)) != 1)
-			perror_exit("sscanf", "cur_time_in_queue");
-		free(fld11_str);
+unsigned long fd_softlimit(pid_t pid, long *ncallsp)
+{
+	char buf[4096];
+	char *p;
+	int fd, n;
+
+	sprintf(buf, "/proc/%d/limits", pid);
+	(*ncallsp)++;
+	if ((fd = open(buf, O_RDONLY)) < 0)
+		return 0;
+	(*ncallsp) += 2;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+	if ((p = strstr(buf, "Max open files")) == NULL)
+		return 0;
+	return strtoul(p + strlen("Max open files"), NULL, 10);
+}
 
-		delta_usage = cur_time_in_queue - dsp->prev_time_in_queue;
-		delta_time = now - prev_now;
-		if (delta_time < 1)
-			delta_time = 1;
-		mdsk = delta_usage / (uint32_t) delta_time;
-		mlen = strlen(dsp->name) + 16;
-		if ((mstr = malloc(mlen)) == NULL)
+/*
+ * Carry fdtracks[] over to the tasks in latest (dropping exited tasks,
+ * adding new ones), then count fds of the next tasks, within budget.
+ */
+
+void fd_sample(task_usages_t latest)
+{
+	fdtrack_t *newtracks;
+	int i, j, k, n, start;
+	long ncalls = 0;
+	time_t now = time(NULL);
+
+	n = latest.tu_nelem;
+	if ((newtracks = calloc(n + 1, sizeof(*newtracks))) == NULL)
+		perror_exit("calloc", "fdtracks");
+	start = -1;
+	for (i = j = 0; j < n; j++) {
+		fdtrack_t *ftp = newtracks + j;
+		struct task_usage *tup = latest.tu_array + j;
+
+		while (i < nfdtracks && fdtracks[i].pid < tup->pid)
+			i++;
+		if (i < nfdtracks && fdtracks[i].pid == tup->pid &&
+		    fdtracks[i].comm == tup->comm) {
+			*ftp = fdtracks[i];
+		} else {
+			ftp->pid = tup->pid;
+			ftp->comm = tup->comm;
+		}
+		if (start < 0 && tup->pid >= fd_cursor)
+			start = j;
+	}
+	free(fdtracks);
+	fdtracks = newtracks;
+	nfdtracks = n;
+	if (n == 0)
+		return;
+	if (start < 0)
+		start = 0;
+
+	for (k = 0; k < n && ncalls < val_F; k++) {
+		fdtrack_t *ftp = fdtracks + (start + k) % n;
+		int cnt;
+
+		if (ftp->skip)
+			continue;
+		if (ftp->nsamples == 0)
+			ftp->softlimit = fd_softlimit(ftp->pid, &ncalls);
+		cnt = fd_count(ftp->pid, &ncalls);
+		if (cnt < 0 || (cnt == 0 && ftp->nsamples == 0)) {
+			ftp->skip = 1;
+			continue;
+		}
+		if (ftp->nsamples == FD_HIST) {
+			memmove(ftp->nfds, ftp->nfds + 1,
+				(FD_HIST - 1) * sizeof(*ftp->nfds));
+			memmove(ftp->when, ftp->when + 1,
+				(FD_HIST - 1) * sizeof(*ftp->when));
+			ftp->nsamples--;
+		}
+		ftp->nfds[ftp->nsamples] = cnt;
+		ftp->when[ftp->nsamples] = now;
+		ftp->nsamples++;
+	}
+	fd_cursor = fdtracks[(start + k) % n].pid;
+}
+
+/* Return 1 if task's fd counts never went down and grew enough */
+
+int fd_growing(const fdtrack_t *ftp)
+{
+	int i;
+
+	if (ftp->nsamples < FD_MIN_SAMPLES)
+		return 0;
+	for (i = 1; i < ftp->nsamples; i++)
+		if (ftp->nfds[i] < ftp->nfds[i - 1])
+			return 0;
+	return ftp->nfds[ftp->nsamples - 1] - ftp->nfds[0] >= FD_MIN_GROWTH;
+}
+
+/* Return 1 if task is using at least FD_NEAR_PCT of its soft limit */
+
+int fd_near_limit(const fdtrack_t *ftp)
+{
+	return ftp->nsamples > 0 && ftp->softlimit > 0 &&
+		ftp->nfds[ftp->nsamples - 1] * 100UL >=
+			ftp->softlimit * FD_NEAR_PCT;
+}
+
+/* Fraction of soft limit in use, for ordering the report */
+
+double fd_usage(const fdtrack_t *ftp)
+{
+	if (ftp->softlimit == 0)
+		return 0;
+	return (double) ftp->nfds[ftp->nsamples - 1] / ftp->softlimit;
+}
+
+/*
+ * Kernel slab caches ("-S n").
+ *
+ * Some memory blowups are in the kernel (dentry or inode caches
+ * growing without bound, a leaking kmalloc cache), with no task's RSS
+ * growing, so show_hogs() shows nothing.  With -S n, while the kernel
+ * slab is large (Slab at least SLAB_LARGE_PCT percent of MemTotal) or
+ * growing (SUnreclaim up at least SLAB_GROW_PCT percent of MemTotal
+ * since the last inner loop), /proc/slabinfo is read, and the n largest
+ * caches shown, with each one's growth in kB per second since it was
+ * last read.
+ *
+ * Caches are listed in /proc/slabinfo in the same order each read, so
+ * slabs[] is kept in that order, and each line is matched to its cache
+ * by just checking the name in the next slot.  Only when a cache comes
+ * or goes are the others searched, and moved to where they now are.
+ *
+ * /proc/slabinfo is readable only by root.  If not readable, -S shows
+ * nothing, after noting that once.
+ */
+
+#define SLAB_LARGE_PCT 10	/* Slab this percent of MemTotal is large */
+#define SLAB_GROW_PCT 1		/* SUnreclaim growth that counts, per loop */
+
+typedef struct {
+	char name[64];			/* cache name */
+	uint64_t kbytes;		/* kB in its slabs, last read */
+	uint64_t prev_kbytes;		/* kB in its slabs, read before */
+	unsigned long objs;		/* active objects, last read */
+	int new;			/* set if no prior read */
+} slab_t;
+
+slab_t *slabs;			/* caches, in /proc/slabinfo order */
+int nslabs, maxslabs;		/* number used, allocated in slabs[] */
+double slab_when, slab_prev_when; /* when last, before last read */
+int mi_slab, mi_sunreclaim;	/* meminfo_fields[] index of each */
+
+/* Note we need Slab and SUnreclaim from /proc/meminfo */
+
+void slab_init()
+{
+	if (val_S == 0)
+		return;
+	mi_slab = meminfo_want("Slab");
+	mi_sunreclaim = meminfo_want("SUnreclaim");
+}
+
+/* Return 1 if kernel slab is large, or grew since last called */
+
+int slab_busy()
+{
+	static unsigned long prev_sunreclaim;
+	unsigned long total = meminfo_fields[MI_MEMTOTAL].val;
+	unsigned long slab = meminfo_fields[mi_slab].val;
+	unsigned long sunreclaim = meminfo_fields[mi_sunreclaim].val;
+	int busy;
+
+	busy = 100. * slab >= SLAB_LARGE_PCT * (double) total ||
+		(prev_sunreclaim && 100. * ((double) sunreclaim -
+			prev_sunreclaim) >= SLAB_GROW_PCT * (double) total);
+	prev_sunreclaim = sunreclaim;
+	return busy;
+}
+
+/* Return slab_t for cache name, that should be at slabs[k] */
+
+slab_t *slab_get(int k, const char *name)
+{
+	slab_t tmp;
+	int i;
+
+	if (k < nslabs && strcmp(slabs[k].name, name) == 0)
+		return slabs + k;
+
+	for (i = k + 1; i < nslabs; i++)
+		if (strcmp(slabs[i].name, name) == 0)
+			break;
+	if (i >= nslabs) {
+		i = nslabs;
+		if (nslabs == maxslabs) {
+			maxslabs = maxslabs ? 2 * maxslabs : 256;
+			if ((slabs = realloc(slabs, maxslabs * sizeof(*slabs)))
+					== NULL)
+				perror_exit("realloc", "slabs");
+		}
+		memset(slabs + nslabs, 0, sizeof(*slabs));
+		snprintf(slabs[nslabs].name, sizeof(slabs->name), "%s", name);
+		slabs[nslabs].new = 1;
+		nslabs++;
+	}
+	tmp = slabs[k];
+	slabs[k] = slabs[i];
+	slabs[i] = tmp;
+	return slabs + k;
+}
+
+/*
+ * Read /proc/slabinfo, updating slabs[].  Return 0, or -1 if
+ * it can't be read.
+ */
+
+int slab_sample()
+{
+	static int fd = -1;
+	static char *buf;
+	static size_t bufsz = 32768;
+	const char *slabfile = "/proc/slabinfo";
+	long pagekb = sysconf(_SC_PAGESIZE) / 1024;
+	struct timespec ts;
+	char *line, *nl;
+	ssize_t len, n;
+	int k;
+
+	if (fd == -2)
+		return -1;
+	if (fd < 0) {
+		if ((fd = open(slabfile, O_RDONLY)) < 0) {
+			oprintf("Note: %s not readable - no slab caches "
+				"(-S) shown.\n", slabfile);
+			fd = -2;
+			return -1;
+		}
+		stash_pread_fd(fd, slabfile);
+	}
+	/* Each read returns just a page or so, so read to EOF */
+	for (len = 0; ; len += n) {
+		if ((size_t) len == bufsz - 1 || buf == NULL) {
+			if (buf)
+				bufsz *= 2;
+			if ((buf = realloc(buf, bufsz)) == NULL)
+				perror_exit("realloc", slabfile);
+		}
+		if ((n = my_pread(fd, buf + len, bufsz - 1 - len, len)) <= 0)
+			break;
+	}
+	buf[len] = '\0';
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	slab_prev_when = slab_when;
+	slab_when = ts.tv_sec + ts.tv_nsec / 1e9;
+
+	for (k = 0; k < nslabs; k++)
+		slabs[k].new = 0;
+	k = 0;
+	for (line = buf; *line; line = nl + 1) {
+		unsigned long v[7];
+		char name[64], *p;
+		slab_t *sp;
+		int i;
+
+		if ((nl = strchr(line, '\n')) == NULL)
+			break;
+		*nl = '\0';
+		if (strncmp(line, "slabinfo", 8) == 0 || line[0] == '#')
+			continue;
+
+		/* name active_objs num_objs objsize objperslab pagesperslab
+		 * : tunables l b s : slabdata active_slabs num_slabs ... */
+		p = line + strcspn(line, " ");
+		snprintf(name, sizeof(name), "%.*s", (int) (p - line), line);
+		for (i = 0; i < 7 && *p; ) {
+			while (*p == ' ' || *p == ':' || isalpha(*p))
+				p++;
+			if (!isdigit(*p))
+				break;
+			v[i++] = strtoul(p, &p, 10);
+			if (i == 5) {		/* skip to slabdata */
+				char *q = strstr(p, "slabdata");
+
+				if (q == NULL)
+					break;
+				p = q + 8;
+			}
+		}
+		if (i < 7)
+			continue;
+		sp = slab_get(k++, name);
+		sp->prev_kbytes = sp->kbytes;
+		sp->kbytes = (uint64_t) v[6] * v[4] * pagekb;
+		sp->objs = v[0];
+	}
+	nslabs = k;		/* caches now gone were moved past here */
+	return 0;
+}
+
+/* Growth of slab cache sp in kB per second, since prior read */
+
+double slab_growth(const slab_t *sp)
+{
+	if (sp->new || slab_prev_when == 0 || slab_when <= slab_prev_when)
+		return 0;
+	return ((double) sp->kbytes - sp->prev_kbytes) /
+		(slab_when - slab_prev_when);
+}
+
+/* Sort slab caches in decreasing order of size. */
+
+int slab_cmp(const void *p1, const void *p2)
+{
+	const slab_t *sp1 = *(const slab_t * const *) p1;
+	const slab_t *sp2 = *(const slab_t * const *) p2;
+
+	return (sp2->kbytes > sp1->kbytes) - (sp2->kbytes < sp1->kbytes);
+}
+
+/*
+ * File lock waits ("-l n").
+ *
+ * Tasks piled up waiting on a file lock (such as PHP workers waiting on
+ * a flock()'d session file) use no CPU and do no I/O, so no hogs table
+ * shows them.  With -l n, each inner loop reads /proc/locks, where each
+ * lock held is listed, followed by "->" lines for the locks blocked
+ * waiting on it, and shows the (at most) n lock holders, by pid and
+ * inode, with the most waiters, along with what commands are waiting.
+ *
+ * To bound the cost when there are very many locks, at most
+ * LOCKS_MAX_BYTES of /proc/locks are read, at most LOCKS_MAX_GROUPS
+ * holders with waiters are tracked, and the pids of at most
+ * LOCKS_MAX_PIDS waiters per holder are kept (though all are counted.)
+ */
+
+#define LOCKS_MAX_BYTES (1 << 20)	/* max bytes of /proc/locks read */
+#define LOCKS_MAX_GROUPS 256		/* max holders tracked */
+#define LOCKS_MAX_PIDS 32		/* max waiter pids kept per holder */
+
+typedef struct {
+	pid_t holder;			/* pid holding the lock */
+	unsigned maj, min;		/* device of locked file */
+	unsigned long ino;		/* inode of locked file */
+	int nwaiters;			/* number of locks waiting on it */
+	int npids;			/* number valid in pids[] */
+	pid_t pids[LOCKS_MAX_PIDS];	/* pids of (first) waiters */
+} lockgrp_t;
+
+lockgrp_t *lockgrps;		/* holders with waiters, last read */
+int nlockgrps;			/* number used in lockgrps[] */
+
+/*
+ * Parse a /proc/locks line, as in:
+ *	"1: FLOCK  ADVISORY  WRITE 1234 08:01:5678 0 EOF"
+ *	"1: -> FLOCK  ADVISORY  WRITE 4321 08:01:5678 0 EOF"
+ * Return 0 if it parsed, setting *waiter if a "->" line.
+ */
+
+int lock_parse(char *line, int *waiter, pid_t *pid, unsigned *maj,
+		unsigned *min, unsigned long *ino)
+{
+	char *tok, *save;
+	int i;
+
+	if ((tok = strtok_r(line, " ", &save)) == NULL)	/* "1:" */
+		return -1;
+	if ((tok = strtok_r(NULL, " ", &save)) == NULL)
+		return -1;
+	*waiter = strcmp(tok, "->") == 0;
+	if (*waiter && (tok = strtok_r(NULL, " ", &save)) == NULL)
+		return -1;
+	for (i = 0; i < 2; i++)		/* skip "ADVISORY" and "WRITE" */
+		if ((tok = strtok_r(NULL, " ", &save)) == NULL)
+			return -1;
+	if ((tok = strtok_r(NULL, " ", &save)) == NULL)
+		return -1;
+	*pid = strtol(tok, NULL, 10);
+	if ((tok = strtok_r(NULL, " ", &save)) == NULL ||
+	    sscanf(tok, "%x:%x:%lu", maj, min, ino) != 3)
+		return -1;
+	return 0;
+}
+
+/* Read /proc/locks, setting lockgrps[] to holders with waiters. */
+
+void lock_sample()
+{
+	static int fd = -1;
+	static char *buf;
+	static size_t bufsz = 16384;
+	const char *locksfile = "/proc/locks";
+	lockgrp_t *cur = NULL;		/* group of latest holder line */
+	char *line, *nl;
+	ssize_t len, n;
+
+	nlockgrps = 0;
+	if (fd < 0) {
+		if ((fd = open(locksfile, O_RDONLY)) < 0)
+			perror_exit("open", locksfile);
+		stash_pread_fd(fd, locksfile);
+		if ((lockgrps = malloc(LOCKS_MAX_GROUPS * sizeof(*lockgrps)))
+				== NULL)
+			perror_exit("malloc", "lockgrps");
+	}
+
+	/* Each read returns just a page or so, so read to EOF, or max */
+	for (len = 0; ; len += n) {
+		if ((size_t) len == bufsz - 1 || buf == NULL) {
+			if (buf && bufsz * 2 > LOCKS_MAX_BYTES)
+				break;
+			if (buf)
+				bufsz *= 2;
+			if ((buf = realloc(buf, bufsz)) == NULL)
+				perror_exit("realloc", locksfile);
+		}
+		if ((n = my_pread(fd, buf + len, bufsz - 1 - len, len)) <= 0)
+			break;
+	}
+	buf[len] = '\0';
+
+	for (line = buf; (nl = strchr(line, '\n')) != NULL; line = nl + 1) {
+		unsigned maj, min;
+		unsigned long ino;
+		pid_t pid;
+		int waiter, i;
+
+		*nl = '\0';
+		if (lock_parse(line, &waiter, &pid, &maj, &min, &ino) < 0)
+			continue;
+		if (!waiter) {
+			/* Holder: note it, but add a group only if waited on */
+			for (i = 0; i < nlockgrps; i++)
+				if (lockgrps[i].holder == pid &&
+				    lockgrps[i].ino == ino &&
+				    lockgrps[i].maj == maj &&
+				    lockgrps[i].min == min)
+					break;
+			if (i == nlockgrps) {
+				if (nlockgrps == LOCKS_MAX_GROUPS) {
+					cur = NULL;
+					continue;
+				}
+				memset(lockgrps + i, 0, sizeof(*lockgrps));
+				lockgrps[i].holder = pid;
+				lockgrps[i].maj = maj;
+				lockgrps[i].min = min;
+				lockgrps[i].ino = ino;
+			}
+			cur = lockgrps + i;
+			continue;
+		}
+		if (cur == NULL)
+			continue;
+		if (cur == lockgrps + nlockgrps)	/* first waiter */
+			nlockgrps++;
+		if (cur->npids < LOCKS_MAX_PIDS)
+			cur->pids[cur->npids++] = pid;
+		cur->nwaiters++;
+	}
+}
+
+/* Sort lock holders in decreasing order of waiters. */
+
+int lockgrp_cmp(const void *p1, const void *p2)
+{
+	const lockgrp_t *lgp1 = p1;
+	const lockgrp_t *lgp2 = p2;
+
+	return lgp2->nwaiters - lgp1->nwaiters;
+}
+
+/*
+ * Output budget ("-w bytes").
+ *
+ * During a long overload, the full tables every inner loop can add up
+ * to hundreds of MB of log, and compressing it competes with the very
+ * workload being watched.  With -w n, the bytes the first profile's
+ * tables write are counted over each BUDGET_WINDOW seconds.  Once a
+ * window averages over n bytes per second, its tables are no longer
+ * written (just counted, as if they were), though each cycle's one
+ * line header still is, so -U and -E still see busy episodes.  Every
+ * window, a condensed summary is written instead: the top offenders
+ * of that window (how many cycles each was a hog, and its peak of each
+ * metric), the new entrants (offenders not in the prior window) and
+ * the dropouts (offenders in the prior window, but not this one.)
+ * Full tables resume once a window would have averaged under n/2
+ * bytes per second.
+ */
+
+#define BUDGET_WINDOW 60	/* secs per budget window, and summary */
+
+typedef struct {
+	pid_t pid;
+	comm_id_t comm;
+	int cycles;			/* cycles shown as a hog */
+	unsigned maxval[NMETRICS];	/* peak value of each metric */
+} offender_t;
+
+int summarizing;		/* set if writing summaries, not tables */
+double budget_start;		/* when current window began */
+int summary_cycles;		/* cycles noted in current summary */
+offender_t *offenders;		/* hogs noted in current window */
+int noffenders, maxoffenders;
+offender_t *prev_offenders;	/* hogs noted in prior window */
+int nprev_offenders, maxprev_offenders;
+
+double mono_secs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Return index of pid, comm in list, or -1 if not there */
+
+int offender_find(const offender_t *list, int n, pid_t pid, comm_id_t comm)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (list[i].pid == pid && list[i].comm == comm)
+			return i;
+	return -1;
+}
+
+/* While summarizing, note that task pid, comm was shown with vals[] */
+
+void summary_note(pid_t pid, comm_id_t comm, const unsigned *vals)
+{
+	offender_t *op;
+	int i, m;
+
+	if (!summarizing || cur_profile != 0)
+		return;
+	if ((i = offender_find(offenders, noffenders, pid, comm)) < 0) {
+		if (noffenders == maxoffenders) {
+			maxoffenders = maxoffenders ? 2 * maxoffenders : 64;
+			offenders = realloc(offenders,
+				maxoffenders * sizeof(*offenders));
+			if (offenders == NULL)
+				perror_exit("realloc", "offenders");
+		}
+		i = noffenders++;
+		memset(offenders + i, 0, sizeof(*offenders));
+		offenders[i].pid = pid;
+		offenders[i].comm = comm;
+	}
+	op = offenders + i;
+	op->cycles++;
+	for (m = 0; m < NMETRICS; m++)
+		if (vals[m] > op->maxval[m])
+			op->maxval[m] = vals[m];
+}
+
+/* Sort offenders in decreasing order of cycles as a hog */
+
+int offender_cmp(const void *p1, const void *p2)
+{
+	const offender_t *op1 = p1;
+	const offender_t *op2 = p2;
+
+	if (op1->cycles != op2->cycles)
+		return op2->cycles - op1->cycles;
+	return (op2->maxval[0] > op1->maxval[0]) -
+		(op2->maxval[0] < op1->maxval[0]);
+}
+
+/* Show the up to val_n tasks in a that aren't in b, labeled label */
+
+void summary_changes(const char *label, const offender_t *a, int na,
+		const offender_t *b, int nb)
+{
+	int i, n = 0;
+
+	for (i = 0; i < na; i++) {
+		if (offender_find(b, nb, a[i].pid, a[i].comm) >= 0)
+			continue;
+		if (n++ == 0)
+			oprintf("    %s:", label);
+		if (n > val_n) {
+			oprintf(" ...");
+			break;
+		}
+		oprintf(" %s/%d", comm_name(a[i].comm), a[i].pid);
+	}
+	if (n)
+		oprintf("\n");
+}
+
+/* Write summary of cycles noted since last summary, and start anew */
+
+void summary_flush()
+{
+	char tmbuf[128];
+	time_t now;
+	offender_t *tmp;
+	int i, k, saved_dry = out_dry, saved_sink = cur_sink;
+
+	if (summary_cycles == 0)
+		return;
+	out_dry = 0;
+	if (nsinks > 1)
+		cur_sink = 0;
+
+	now = time(NULL);
+	strftime(tmbuf, sizeof(tmbuf), "%c", localtime(&now));
+	qsort(offenders, noffenders, sizeof(*offenders), offender_cmp);
+
+	oprintf("\n%s - summary of %d cycles (over -w budget)\n", tmbuf,
+		summary_cycles);
+	if (noffenders > 0) {
+		oprintf("    %8s  %16s  %6s", "pid", "cmd", "cycles");
+		for (k = 0; k < nactive; k++)
+			oprintf("  %10s", metrics[active_metrics[k]].name);
+		oprintf("\n");
+	}
+	for (i = 0; i < noffenders && i < val_n; i++) {
+		oprintf("    %8d  %16s  %6d", offenders[i].pid,
+			comm_name(offenders[i].comm), offenders[i].cycles);
+		for (k = 0; k < nactive; k++)
+			oprintf("  %10u", offenders[i].maxval[active_metrics[k]]);
+		oprintf("\n");
+	}
+	summary_changes("new", offenders, noffenders, prev_offenders,
+		nprev_offenders);
+	summary_changes("gone", prev_offenders, nprev_offenders, offenders,
+		noffenders);
+	flush_output();
+
+	/* This window's offenders become the prior window's */
+	tmp = prev_offenders;
+	prev_offenders = offenders;
+	nprev_offenders = noffenders;
+	k = maxprev_offenders;
+	maxprev_offenders = maxoffenders;
+	offenders = tmp;
+	maxoffenders = k;
+	noffenders = 0;
+	summary_cycles = 0;
+
+	out_dry = saved_dry;
+	cur_sink = saved_sink;
+}
+
+/*
+ * Called at the start of each inner loop display of the first profile.
+ * At the end of each window, switch to or from summarizing, as the
+ * bytes written (or that would have been) in that window call for.
+ * Returns with out_dry set if this cycle's tables are only counted.
+ */
+
+void budget_cycle()
+{
+	double now = mono_secs();
+	double rate;
+
+	out_dry = 0;
+	if (val_w == 0)
+		return;
+	if (budget_start == 0)
+		budget_start = now;
+	if (now - budget_start >= BUDGET_WINDOW) {
+		rate = out_bytes / (now - budget_start);
+		if (summarizing) {
+			summary_flush();
+			if (rate < val_w / 2.) {
+				summarizing = 0;
+				nprev_offenders = 0;
+				change_reset(0);	/* -D: tables unseen */
+				oprintf("\nOutput %.0f bytes/sec, under -w "
+					"budget: full tables resume.\n", rate);
+			}
+		} else if (rate > val_w) {
+			summarizing = 1;
+			oprintf("\nOutput %.0f bytes/sec, over -w budget: "
+				"summaries every %d secs.\n", rate,
+				BUDGET_WINDOW);
+		}
+		out_bytes = 0;
+		budget_start = now;
+	}
+	if (summarizing) {
+		summary_cycles++;
+		out_dry = 1;
+	}
+}
+
+/*
+ * show_hogs(prior, latest):
+ *
+ * Show top val_n tasks using or having more than the specified threshold
+ * of each enabled metric (such as CPU, Memory or block I/O disk waits.)
+ *
+ * The Linux kernel returns the <pid> subdirectory entries of /proc
+ * already in numerically sorted order (as a side affect of a bug
+ * fix to reliably return all of them.)
+ *
+ * So don't need to sort prior and latest on pid; rather just fail
+ * if we ever see them out of order.  Go directly to the joining
+ * of these two on the pid field, calculating the change per second
+ * of each delta metric (such as cpumsecs and diskwait) in the elapsed
+ * time between these two snapshots.  It is OK to
+ * fail, during that join, if we notice they're not sorted.  The check()
+ * define, below, makes this test.
+ *
+ * Then, for each enabled metric (CPU, Memory, Diskwait, ...) for which
+ * we want the hogs, pick the top val_n of the tasks over its threshold.
+ *
+ * The cpumsecs field below is the portion of one CPU used in the
+ * time interval between prior and latest, scaled so that 1000
+ * means all of one CPU was used.  This value can be over 1000 if
+ * the process has multiple threads on multiple CPUs.
+ *
+ * Say for example we're asked to show tasks using over half of all
+ * CPU (-q 500).  Say some task had used 9000 ticks (user + sys,
+ * self + children) at the prior snapshot, and had used 9700 ticks
+ * at the latest snapshot.  Then during that interval, that task
+ * used an additional 9700 - 9000 == 700 ticks.  Say that the
+ * kernel_clock_ticks_per_second was 100 (ticks/second).  Then that
+ * task used 7 CPU seconds (cpusecs) during that interval.  Say that
+ * the inner loop is running every 10 seconds (val_t == 10).  Then
+ * that task used 7/10 or 70% of all CPU during that interval.  We would
+ * set the scaled cpumsecs to 700 (70% expressed per thousands.)  If this
+ * task were in the top val_n busiest CPU hogs in that interval, then
+ * we would decide to display that because 700 > 500.
+ *
+ * We bother with this scaling of cpumsecs in order to collapse it to an
+ * integer, expecting that the qsort comparison routine will run faster
+ * comparing int's than comparing double's.  Only the tasks over each
+ * enabled metric's threshold need be qsort'd, to find the val_n busiest
+ * hogs on the list (see the kernels below.)
+ *
+ * The scaled metric values are kept in the join'd structure even though
+ * they can be recomputed from the indexed prior and latest snapshot
+ * structures (via the i and j indices), because these values are needed
+ * by the qsort comparison routine, which we want to be fast, to minimize
+ * qsort time.
+ */
+
+typedef struct {
+	int i, j;		/* index into prior, latest with same pid */
+	unsigned val[NMETRICS];	/* scaled value of each active metric */
+	int showme;		/* set if this task is to be displayed */
+} join_on_pid_t;
+
+/*
+ * The indices i and j in the join_on_pid_t elements (of the joinp
+ * array, allocated below) index into the prior and latest arrays,
+ * where the pid, cmd, and raw metric values of that task are stored.
+ * The PID and CMD macros facilitate accessing these pid and cmd values.
+ */
+
+#define PID(p, i) 	((p).tu_array[(i)].pid)
+#define CMD(p, i)	(comm_name((p).tu_array[(i)].comm))
+
+/*
+ * To show the worst hogs of some metric (such as "top" CPU users) we
+ * need to sort all tasks on that metric's value in the last time
+ * interval (val_t).  The following comparison routine is passed to
+ * qsort_r(), for this sorting, with the index in metrics[] of the
+ * metric to sort on as its third argument.  Sorts in decreasing order.
+ */
+
+int metric_cmp(const void *p1, const void *p2, void *arg)
+{
+	const join_on_pid_t *jp1 = p1;
+	const join_on_pid_t *jp2 = p2;
+	int m = *(int *) arg;
+
+	return (jp2->val[m] > jp1->val[m]) - (jp2->val[m] < jp1->val[m]);
+}
+
+/*
+ * Like metric_cmp(), but for sorting an array of indices into joinp[],
+ * for picking the top val_n of the tasks over a metric's threshold.
+ */
+
+typedef struct {
+	const join_on_pid_t *joinp;
+	int m;
+} cand_cmp_arg_t;
+
+int cand_cmp(const void *p1, const void *p2, void *arg)
+{
+	const cand_cmp_arg_t *ap = arg;
+	unsigned v1 = ap->joinp[*(const int *) p1].val[ap->m];
+	unsigned v2 = ap->joinp[*(const int *) p2].val[ap->m];
+
+	return (v2 > v1) - (v2 < v1);
+}
+
+/*
+ * Delta, scaling and threshold kernels.
+ *
+ * For each active metric, show_hogs() gathers that metric's prior and
+ * latest counters of all joined tasks into two contiguous arrays, and
+ * then one kernel pass computes, for each task i:
+ *
+ *	d = latest[i] - prior[i]	(0 if the counter went backwards)
+ *	out[i] = (d * mul) >> shift
+ *	bit i of mask set iff out[i] >= thresh
+ *
+ * where mul and shift are a fixed point reciprocal of the divisor
+ * (such as val_t * ncpus for mcpus), replacing the per task floating
+ * point and integer divisions.  See scale_init(), below.
+ *
+ * Counters are handled modulo 2^32, in the same way as the disk
+ * time_in_queue counters above: so long as a counter changes by less
+ * than 2^31 between snapshots (24 days of CPU msecs in one interval),
+ * the low 32 bits of the two samples give the exact difference.  A
+ * gauge metric (values under 2^31) is handled with prior[] all zeros.
+ *
+ * There is a scalar kernel, plus SSE2, AVX2 and AVX-512 kernels on x86,
+ * all computing exactly the same results.  The best one this CPU can
+ * run is chosen at startup by simd_init().  Setting the environment
+ * variable BATCH_TOP_SIMD to "scalar", "sse2", "avx2" or "avx512" forces
+ * a particular kernel (if supported), for testing.
+ */
+
+typedef void scale_kernel_t(const uint32_t *prior, const uint32_t *latest,
+	uint32_t *out, int n, uint32_t mul, int shift, uint32_t thresh,
+	uint64_t *mask);
+
+/*
+ * Choose mul and shift so that (d * mul) >> shift is d * factor,
+ * rounded down, with mul as large as will fit in 32 bits (and so
+ * the most precise.)  mul is rounded up, so that exact multiples,
+ * such as 5000 msecs in 5 seconds, don't come out one short.
+ */
+
+void scale_init(double factor, uint32_t *mul, int *shift)
+{
+	double scaled = factor * 9223372036854775808.0;	/* 2^63 */
+	int s = 63;
+	uint64_t m;
+
+	while (s > 0 && scaled >= 4294967295.0) {
+		scaled /= 2;
+		s--;
+	}
+	m = (uint64_t) scaled;
+	if (m < scaled)
+		m++;			/* round up */
+	*shift = s;
+	*mul = m;
+}
+
+/*
+ * Scalar kernel for tasks [from, n), with mask[] already cleared.
+ * Also finishes the tasks left over after the vector kernels.
+ */
+
+void scale_range(const uint32_t *prior, const uint32_t *latest,
+	uint32_t *out, int from, int n, uint32_t mul, int shift,
+	uint32_t thresh, uint64_t *mask)
+{
+	int i;
+
+	for (i = from; i < n; i++) {
+		uint32_t d = latest[i] - prior[i];
+
+		if ((int32_t) d < 0)
+			d = 0;
+		out[i] = ((uint64_t) d * mul) >> shift;
+		if (out[i] >= thresh)
+			mask[i / 64] |= (uint64_t) 1 << (i % 64);
+	}
+}
+
+void scale_kernel_scalar(const uint32_t *prior, const uint32_t *latest,
+	uint32_t *out, int n, uint32_t mul, int shift, uint32_t thresh,
+	uint64_t *mask)
+{
+	memset(mask, 0, ((n + 63) / 64) * sizeof(*mask));
+	scale_range(prior, latest, out, 0, n, mul, shift, thresh, mask);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/*
+ * The vector kernels do 64 bit multiplies (_mul_epu32) of the even
+ * and odd 32 bit lanes separately, then shift, and merge the low 32
+ * bits of each product back into one vector.  Unsigned compares are
+ * done as signed compares with the sign bits flipped, except in
+ * AVX-512, which has unsigned compares.  The remaining n % width
+ * tasks are done by the scalar kernel.
+ */
+
+__attribute__((target("sse2")))
+void scale_kernel_sse2(const uint32_t *prior, const uint32_t *latest,
+	uint32_t *out, int n, uint32_t mul, int shift, uint32_t thresh,
+	uint64_t *mask)
+{
+	__m128i vmul = _mm_set1_epi32(mul);
+	__m128i vshift = _mm_cvtsi32_si128(shift);
+	__m128i lo32 = _mm_set1_epi64x(0xffffffff);
+	__m128i sign = _mm_set1_epi32(0x80000000);
+	__m128i vthresh = _mm_xor_si128(_mm_set1_epi32(thresh), sign);
+	int i, nv = n & ~3;
+
+	memset(mask, 0, ((n + 63) / 64) * sizeof(*mask));
+
+	for (i = 0; i < nv; i += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i *) (prior + i));
+		__m128i l = _mm_loadu_si128((const __m128i *) (latest + i));
+		__m128i d = _mm_sub_epi32(l, p);
+		__m128i even, odd, q, lt;
+
+		d = _mm_andnot_si128(_mm_srai_epi32(d, 31), d);
+		even = _mm_srl_epi64(_mm_mul_epu32(d, vmul), vshift);
+		odd = _mm_srl_epi64(_mm_mul_epu32(_mm_srli_epi64(d, 32), vmul),
+			vshift);
+		q = _mm_or_si128(_mm_and_si128(even, lo32),
+			_mm_slli_epi64(odd, 32));
+		_mm_storeu_si128((__m128i *) (out + i), q);
+
+		lt = _mm_cmpgt_epi32(vthresh, _mm_xor_si128(q, sign));
+		mask[i / 64] |= (uint64_t) (~_mm_movemask_ps(_mm_castsi128_ps(lt))
+			& 0xf) << (i % 64);
+	}
+	scale_range(prior, latest, out, nv, n, mul, shift, thresh, mask);
+}
+
+__attribute__((target("avx2")))
+void scale_kernel_avx2(const uint32_t *prior, const uint32_t *latest,
+	uint32_t *out, int n, uint32_t mul, int shift, uint32_t thresh,
+	uint64_t *mask)
+{
+	__m256i vmul = _mm256_set1_epi32(mul);
+	__m128i vshift = _mm_cvtsi32_si128(shift);
+	__m256i lo32 = _mm256_set1_epi64x(0xffffffff);
+	__m256i sign = _mm256_set1_epi32(0x80000000);
+	__m256i vthresh = _mm256_xor_si256(_mm256_set1_epi32(thresh), sign);
+	int i, nv = n & ~7;
+
+	memset(mask, 0, ((n + 63) / 64) * sizeof(*mask));
+
+	for (i = 0; i < nv; i += 8) {
+		__m256i p = _mm256_loadu_si256((const __m256i *) (prior + i));
+		__m256i l = _mm256_loadu_si256((const __m256i *) (latest + i));
+		__m256i d = _mm256_sub_epi32(l, p);
+		__m256i even, odd, q, lt;
+
+		d = _mm256_andnot_si256(_mm256_srai_epi32(d, 31), d);
+		even = _mm256_srl_epi64(_mm256_mul_epu32(d, vmul), vshift);
+		odd = _mm256_srl_epi64(_mm256_mul_epu32(
+			_mm256_srli_epi64(d, 32), vmul), vshift);
+		q = _mm256_or_si256(_mm256_and_si256(even, lo32),
+			_mm256_slli_epi64(odd, 32));
+		_mm256_storeu_si256((__m256i *) (out + i), q);
+
+		lt = _mm256_cmpgt_epi32(vthresh, _mm256_xor_si256(q, sign));
+		mask[i / 64] |= (uint64_t) (~_mm256_movemask_ps(
+			_mm256_castsi256_ps(lt)) & 0xff) << (i % 64);
+	}
+	scale_range(prior, latest, out, nv, n, mul, shift, thresh, mask);
+}
+
+__attribute__((target("avx512f")))
+void scale_kernel_avx512(const uint32_t *prior, const uint32_t *latest,
+	uint32_t *out, int n, uint32_t mul, int shift, uint32_t thresh,
+	uint64_t *mask)
+{
+	__m512i vmul = _mm512_set1_epi32(mul);
+	__m128i vshift = _mm_cvtsi32_si128(shift);
+	__m512i vthresh = _mm512_set1_epi32(thresh);
+	__m512i zero = _mm512_setzero_si512();
+	int i, nv = n & ~15;
+
+	memset(mask, 0, ((n + 63) / 64) * sizeof(*mask));
+
+	for (i = 0; i < nv; i += 16) {
+		__m512i p = _mm512_loadu_si512((const void *) (prior + i));
+		__m512i l = _mm512_loadu_si512((const void *) (latest + i));
+		__m512i d = _mm512_sub_epi32(l, p);
+		__m512i even, odd, q;
+
+		d = _mm512_mask_mov_epi32(d,
+			_mm512_cmplt_epi32_mask(d, zero), zero);
+		even = _mm512_srl_epi64(_mm512_mul_epu32(d, vmul), vshift);
+		odd = _mm512_srl_epi64(_mm512_mul_epu32(
+			_mm512_srli_epi64(d, 32), vmul), vshift);
+		q = _mm512_mask_mov_epi32(even, 0xaaaa,
+			_mm512_slli_epi64(odd, 32));
+		_mm512_storeu_si512((void *) (out + i), q);
+
+		mask[i / 64] |= (uint64_t) _mm512_cmpge_epu32_mask(q, vthresh)
+			<< (i % 64);
+	}
+	scale_range(prior, latest, out, nv, n, mul, shift, thresh, mask);
+}
+
+#endif
+
+scale_kernel_t *scale_kernel = scale_kernel_scalar;
+const char *scale_kernel_name = "scalar";
+
+void simd_init()
+{
+	const char *want = getenv("BATCH_TOP_SIMD");
+
+	(void) want;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (want && strcmp(want, "scalar") == 0)
+		return;
+	if (__builtin_cpu_supports("avx512f") &&
+			(!want || strcmp(want, "avx512") == 0)) {
+		scale_kernel = scale_kernel_avx512;
+		scale_kernel_name = "avx512";
+	} else if (__builtin_cpu_supports("avx2") &&
+			(!want || strcmp(want, "avx2") == 0)) {
+		scale_kernel = scale_kernel_avx2;
+		scale_kernel_name = "avx2";
+	} else if (__builtin_cpu_supports("sse2") &&
+			(!want || strcmp(want, "sse2") == 0)) {
+		scale_kernel = scale_kernel_sse2;
+		scale_kernel_name = "sse2";
+	}
+#endif
+}
+
+/* Show task's realtime policy and priority, such as "FF/99", or "-" */
+
+const char *rt_policy_str(const struct task_usage *tup)
+{
+	static char buf[16];
+
+	if (tup->policy == SCHED_FIFO)
+		sprintf(buf, "FF/%d", tup->rtprio);
+	else if (tup->policy == SCHED_RR)
+		sprintf(buf, "RR/%d", tup->rtprio);
+	else
+		strcpy(buf, "-");
+	return buf;
+}
+
+int task_usage_pid_cmp(const void *p1, const void *p2)
+{
+	const struct task_usage *tp1 = p1;
+	const struct task_usage *tp2 = p2;
+
+	return (tp1->pid > tp2->pid) - (tp1->pid < tp2->pid);
+}
+
+char *get_cmdline(pid_t pid)
+{
+	int fd;
+	char cmdlinepath[32];
+	int cnt, i;
+
+	sprintf(cmdlinepath, "/proc/%d/cmdline", pid);
+
+	if ((fd = open(cmdlinepath, O_RDONLY)) < 0) {
+		sprintf(cmdlinebuf, "%*s", szcmdlinebuf, "<unknown>");
+		cmdlinebuf[szcmdlinebuf-1] = '\0';
+		return cmdlinebuf;
+	}
+	cnt = read(fd, cmdlinebuf, szcmdlinebuf);
+	close(fd);
+
+	/*
+	 * cmdline has embedded NUL's between args,
+	 * plus a terminating NUL (which we might not
+	 * have read, if length of cmdline > szcmdlinebuf).
+	 *
+	 * Replace embedded NUL's with spaces.
+	 */
+
+	for (i = 0; i < cnt-1; i++) {
+		if (cmdlinebuf[i] == '\0')
+			cmdlinebuf[i] = ' ';
+	}
+	cmdlinebuf[i] = '\0';
+
+	return cmdlinebuf;
+}
+
+char *skipwhitespace(char *p)
+{
+	while(*p == ' ' || *p == '\t')
+		p++;
+	if (*p && isgraph(*p))
+		return p;
+	else
+		return NULL;
+}
+
+char *skipfieldchars(char *p)
+{
+	while (isgraph(*p))
+		p++;
+	return p;
+}
+
+/*
+ * Get field number 'fieldnum' from file 'path'.
+ *
+ * Fields are numbered  with field 1.  Fields are separated by one or more
+ * spaces or tabs. Only the first line of file is considered.  Leading spaces
+ * on line are ignored.
+ *
+ * Return malloc'c copy of field string if found.  Return NULL if
+ * field not found, or if malloc fails.
+ */
+
+char *getfield(const char *path, int fieldnum)
+{
+	char buf[256];
+	char *startoffield = NULL;
+	int cnt;
+	char *p;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		perror_exit("open", path);
+	if ((cnt = read(fd, buf, sizeof(buf))) < 0)
+		perror_exit("read", path);
+	if (close(fd) < 0)
+		perror_exit("close", path);
+
+	buf[cnt-1] = '\0';
+
+	errno = 0;	/* stays 0 unless strdup() failure sets */
+	p = buf;
+	while (fieldnum--) {
+		if ((p = skipwhitespace(p)) == NULL)
+			return NULL;
+		if (fieldnum == 0) 
+			startoffield = p;
+		if ((p = skipfieldchars(p)) == NULL)
+			return NULL;
+		if (fieldnum == 0) {
+			char *fdup;
+			*p = '\0';
+			if ((fdup = strdup(startoffield)) == NULL)
+				perror_exit("strdup", "requested field");
+			return fdup;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * How many of our tasks are PHP tasks?
+ */
+
+int get_cnt_php(task_usages_t latest)
+{
+	static comm_pattern_t php = { "php", NULL, 0 };
+	int ni, i;
+	int cnt = 0;
+
+	ni = latest.tu_nelem;
+	for (i = 0; i < ni; i++) {
+		if (comm_matches(&php, latest.tu_array[i].comm))
+			cnt++;
+	}
+	return cnt;
+}
+
+/*
+ * How many of our tasks are httpd tasks?
+ */
+
+int get_cnt_httpd(task_usages_t latest)
+{
+	static comm_pattern_t httpd = { "httpd", NULL, 0 };
+	int ni, i;
+	int cnt = 0;
+
+	ni = latest.tu_nelem;
+	for (i = 0; i < ni; i++) {
+		if (comm_matches(&httpd, latest.tu_array[i].comm))
+			cnt++;
+	}
+	return cnt;
+}
+
+/*
+ * Extract from /sys/block/.../stat how much disk has been used on each
+ * monitored disk in disks_monitored, since the previous time we were
+ * called.  Return results as malloc'd ready to display string.
+ * Be sure to free() result once done using it.
+ *
+ * Update the prev_time_in_queue values to the current value for each
+ * monitored disk, and update the static "prev_now", so that the next
+ * time this routine is called, it can compute the difference in usage
+ * (delta_usage) for the elapsed time between the two calls.
+ *
+ * Output is in units of "mdsk", which is a made up unit for how many
+ * milliseconds of disk being used (command in flight, either in queue
+ * or being processed) per second of elapsed time.
+ *
+ * In other words, the output values for diskusage are scaled so that
+ * a disk made 100% busy by a single threaded task will display about
+ * "1000" for diskusage (1000 msecs per sec of one op in flight.)
+ */
+
+char *get_disks_monitored()
+{
+	time_t now;		/* time now (seconds since epoch) */
+	static time_t prev_now;	/* time last called (secs since epoch) */
+	diskstat_t **dspp;	/* scans disks_monitored */
+	char *argz = NULL;
+	size_t argz_len = 0;
+	int e;			/* errno return from argz_* routines */
+
+	if (!disks_monitored) {	/* empty result if no disks monitored */
+		if ((argz = strdup("")) == NULL)
+			perror_exit("strdup", "empty string");
+		return argz;
+	}
+
+	now = time(NULL);
+	if ((e = argz_add(&argz, &argz_len, "; diskusage")) != 0) {
+		errno = e;
+		perror_exit("argz_add", "diskusage");
+	}
+
+	for (dspp = disks_monitored; *dspp; dspp++) {
+		uint32_t cur_time_in_queue;
+		time_t delta_time;
+		uint32_t delta_usage;
+		uint32_t mdsk;
+		char *mstr;
+		int mlen;
+		char *fld11_str;
+		diskstat_t *dsp;
+
+		dsp = *dspp;
+		if ((fld11_str = getfield(dsp->path, 11)) == NULL) {
+			fprintf(stderr, "File %s no field 11\n", dsp->path);
+			exit(1);
+		}
+		if ((sscanf(fld11_str, "%u", &cur_time_in_queue)) != 1)
+			perror_exit("sscanf", "cur_time_in_queue");
+		free(fld11_str);
+
+		delta_usage = cur_time_in_queue - dsp->prev_time_in_queue;
+		delta_time = now - prev_now;
+		if (delta_time < 1)
+			delta_time = 1;
+		mdsk = delta_usage / (uint32_t) delta_time;
+		mlen = strlen(dsp->name) + 16;
+		if ((mstr = malloc(mlen)) == NULL)
 			perror_exit("malloc", "mstr");
 		if (snprintf(mstr, mlen, "%s:%u", dsp->name, mdsk) < 0)
 			perror_exit("snprintf", "diskusage");
@@ -1500,234 +4634,3481 @@ char *get_disks_monitored()
 			errno = e;
 			perror_exit("argz_add", "diskusage");
 		}
-		free(mstr);
+		free(mstr);
+
+		dsp->prev_time_in_queue = cur_time_in_queue;
+	}
+
+	prev_now = now;
+	argz_stringify(argz, argz_len, ' ');
+	return argz;
+}
+
+/*
+ * Optional journald sink ("-j socketpath").
+ *
+ * In addition to the usual text on stdout, each header sample and each
+ * hog row can be sent as one structured entry to the systemd journal,
+ * using journald's "native" protocol: one AF_UNIX SOCK_DGRAM datagram
+ * per entry, sent to the journal socket, normally
+ * /run/systemd/journal/socket.  Each datagram is a series of fields:
+ *
+ *	KEY=value\n
+ *
+ * or, for values that might contain a newline (such as a command name),
+ * the binary safe form:
+ *
+ *	KEY\n<64 bit little endian length><value bytes>\n
+ *
+ * Entries are queued up as the header and hog rows of one inner loop
+ * cycle are displayed, and then all sent together with one sendmmsg(2)
+ * call at the end of that cycle, rather than one syscall per entry.
+ *
+ * Every entry from the same overload episode (one pass through the
+ * inner loop) carries the same EPISODE_ID=, the time (seconds since
+ * the epoch) at which the system was first seen to be loaded.
+ *
+ * If the journal socket is missing or refuses entries, say so once
+ * on stderr and drop those entries; don't let journald troubles stop
+ * the stdout output.
+ */
+
+typedef struct {
+	char *buf;			/* this entry's fields */
+	size_t len;			/* bytes used in buf */
+	size_t size;			/* bytes allocated in buf */
+} journal_entry_t;
+
+journal_entry_t *journal_entries;	/* entries queued this cycle */
+int journal_nentries;			/* number queued in this cycle */
+int journal_maxentries;			/* number allocated */
+
+void journal_append(journal_entry_t *jep, const void *p, size_t n)
+{
+	if (jep->len + n > jep->size) {
+		size_t newsize = 2 * (jep->len + n) + 256;
+
+		if ((jep->buf = realloc(jep->buf, newsize)) == NULL)
+			perror_exit("realloc", "journal entry");
+		jep->size = newsize;
+	}
+	memcpy(jep->buf + jep->len, p, n);
+	jep->len += n;
+}
+
+/*
+ * Start a new entry in the current cycle's batch.  The buffers of
+ * previously flushed entries are reused, so after the first few
+ * cycles, queueing entries doesn't malloc.
+ */
+
+journal_entry_t *journal_begin()
+{
+	journal_entry_t *jep;
+
+	if (journal_nentries == journal_maxentries) {
+		int newmax = 2 * journal_maxentries + 16;
+
+		journal_entries = realloc(journal_entries,
+				newmax * sizeof(*journal_entries));
+		if (journal_entries == NULL)
+			perror_exit("realloc", "journal entries");
+		memset(journal_entries + journal_maxentries, 0,
+			(newmax - journal_maxentries) * sizeof(*journal_entries));
+		journal_maxentries = newmax;
+	}
+	jep = journal_entries + journal_nentries++;
+	jep->len = 0;
+	return jep;
+}
+
+void journal_field(journal_entry_t *jep, const char *key, const char *val)
+{
+	size_t klen = strlen(key);
+	size_t vlen = strlen(val);
+
+	journal_append(jep, key, klen);
+	if (memchr(val, '\n', vlen) == NULL) {
+		journal_append(jep, "=", 1);
+	} else {
+		unsigned char le64[8];
+		int i;
+
+		journal_append(jep, "\n", 1);
+		for (i = 0; i < 8; i++)
+			le64[i] = (uint64_t) vlen >> (8 * i);
+		journal_append(jep, le64, sizeof(le64));
+	}
+	journal_append(jep, val, vlen);
+	journal_append(jep, "\n", 1);
+}
+
+void journal_fieldf(journal_entry_t *jep, const char *key, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+void journal_fieldf(journal_entry_t *jep, const char *key, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	journal_field(jep, key, buf);
+}
+
+/*
+ * Fields common to all our entries.
+ */
+
+journal_entry_t *journal_begin_record(const char *record)
+{
+	journal_entry_t *jep = journal_begin();
+
+	journal_field(jep, "SYSLOG_IDENTIFIER", "batch_top");
+	journal_field(jep, "PRIORITY", "6");
+	journal_field(jep, "BATCH_TOP_RECORD", record);
+	journal_fieldf(jep, "EPISODE_ID", "%ld", episode_id);
+	if (nprofiles > 1)
+		journal_field(jep, "BATCH_TOP_PROFILE",
+			profiles[cur_profile].name);
+	return jep;
+}
+
+/* Header's total thread count, or -1 if not shown (without -T or -N) */
+
+long header_nthreads(task_usages_t latest)
+{
+	if (!metrics[M_THREADS].enabled && !metrics[M_THRGROWTH].enabled)
+		return -1;
+	return latest.tu_nthreads;
+}
+
+void journal_header(double lavg, double cpu_load, double mem_load,
+		int mem_pres, long nthreads)
+{
+	journal_entry_t *jep;
+	char thr_str[32];
+	int i;
+
+	if (!journal_path)
+		return;
+	jep = journal_begin_record("header");
+	thr_str[0] = '\0';
+	if (nthreads >= 0)
+		sprintf(thr_str, "; threads %ld", nthreads);
+	journal_fieldf(jep, "MESSAGE", "loadavg %.2f; CPU load %.0f%%; "
+		"Mem load %.0f%%; Mem pres %d%s", lavg,
+		cpu_load * 100., mem_load * 100., mem_pres, thr_str);
+	journal_fieldf(jep, "LOADAVG", "%.2f", lavg);
+	journal_fieldf(jep, "CPULOAD", "%.1f", cpu_load * 100.);
+	journal_fieldf(jep, "MEMLOAD", "%.1f", mem_load * 100.);
+	journal_fieldf(jep, "MEMPRES", "%d", mem_pres);
+	if (nthreads >= 0)
+		journal_fieldf(jep, "THREADS", "%ld", nthreads);
+	if (val_f > 0 && ncpufreqs > 0) {
+		journal_fieldf(jep, "CAPLOSS", "%.1f", cap_loss * 100.);
+		if (cap_have_throttles)
+			journal_fieldf(jep, "THROTTLES", "%ld", cap_throttles);
+	}
+	for (i = MI_EXTRA; i < nmeminfo_fields; i++) {
+		char name[MEMINFO_KEYLEN + 8], *p;
+
+		if (meminfo_fields[i].hidden)
+			continue;
+		sprintf(name, "MEMINFO_%s", meminfo_fields[i].key);
+		for (p = name; *p; p++)
+			*p = isalnum(*p) ? toupper(*p) : '_';
+		journal_fieldf(jep, name, "%lu", meminfo_fields[i].val);
+	}
+}
+
+void journal_hog(pid_t pid, const char *comm, const unsigned *vals,
+		const char *cmdline)
+{
+	journal_entry_t *jep;
+	char msg[256];
+	int k, len;
+
+	if (!journal_path)
+		return;
+	jep = journal_begin_record("hog");
+	len = snprintf(msg, sizeof(msg), "hog %d %s", pid, comm);
+	for (k = 0; k < nactive && len < (int) sizeof(msg); k++) {
+		int m = active_metrics[k];
+
+		len += snprintf(msg + len, sizeof(msg) - len, " %s %u",
+			metrics[m].name, vals[m]);
+	}
+	journal_field(jep, "MESSAGE", msg);
+	journal_fieldf(jep, "PID", "%d", pid);
+	journal_field(jep, "COMM", comm);
+	for (k = 0; k < nactive; k++) {
+		int m = active_metrics[k];
+
+		journal_fieldf(jep, metrics[m].journal_key, "%u", vals[m]);
+	}
+	journal_field(jep, "CMDLINE", cmdline);
+}
+
+void journal_fdleak(const fdtrack_t *ftp, long growth, const char *cmdline)
+{
+	journal_entry_t *jep;
+	int nfds = ftp->nfds[ftp->nsamples - 1];
+
+	if (!journal_path)
+		return;
+	jep = journal_begin_record("fdleak");
+	journal_fieldf(jep, "MESSAGE", "fdleak %d %s fds %d limit %lu "
+		"fds/hour %ld", ftp->pid, comm_name(ftp->comm), nfds,
+		ftp->softlimit, growth);
+	journal_fieldf(jep, "PID", "%d", ftp->pid);
+	journal_field(jep, "COMM", comm_name(ftp->comm));
+	journal_fieldf(jep, "FDS", "%d", nfds);
+	journal_fieldf(jep, "FDLIMIT", "%lu", ftp->softlimit);
+	journal_fieldf(jep, "FDGROWTH", "%ld", growth);
+	journal_field(jep, "CMDLINE", cmdline);
+}
+
+void journal_cgroup(const cgroup_t *cgp)
+{
+	journal_entry_t *jep;
+	char msg[256];
+	int j, len;
+
+	if (!journal_path)
+		return;
+	jep = journal_begin_record("cgroup");
+	len = snprintf(msg, sizeof(msg), "cgroup %s", cgp->path);
+	for (j = 0; j < CG_NSTALLS && len < (int) sizeof(msg); j++)
+		len += snprintf(msg + len, sizeof(msg) - len, " %s %u",
+			cg_headings[j], cgp->val[j]);
+	journal_field(jep, "MESSAGE", msg);
+	journal_field(jep, "CGROUP", cgp->path);
+	for (j = 0; j < CG_NSTALLS; j++)
+		journal_fieldf(jep, cg_journal_keys[j], "%u", cgp->val[j]);
+}
+
+void journal_lockwait(const lockgrp_t *lgp, const char *comm,
+		const char *inode, const char *waiting)
+{
+	journal_entry_t *jep;
+
+	if (!journal_path)
+		return;
+	jep = journal_begin_record("lockwait");
+	journal_fieldf(jep, "MESSAGE", "lockwait %d %s waiters %d inode %s "
+		"waiting %s", lgp->holder, comm, lgp->nwaiters, inode, waiting);
+	journal_fieldf(jep, "PID", "%d", lgp->holder);
+	journal_field(jep, "COMM", comm);
+	journal_fieldf(jep, "WAITERS", "%d", lgp->nwaiters);
+	journal_field(jep, "INODE", inode);
+	journal_field(jep, "WAITING", waiting);
+}
+
+void journal_slab(const slab_t *sp, double growth)
+{
+	journal_entry_t *jep;
+
+	if (!journal_path)
+		return;
+	jep = journal_begin_record("slab");
+	journal_fieldf(jep, "MESSAGE", "slab %s kbytes %llu kB/sec %.0f "
+		"objs %lu", sp->name, (unsigned long long) sp->kbytes, growth,
+		sp->objs);
+	journal_field(jep, "SLAB", sp->name);
+	journal_fieldf(jep, "SLAB_KBYTES", "%llu",
+		(unsigned long long) sp->kbytes);
+	journal_fieldf(jep, "SLAB_GROWTH", "%.0f", growth);
+	journal_fieldf(jep, "SLAB_OBJS", "%lu", sp->objs);
+}
+
+/*
+ * Send all the entries queued during this cycle, with as few
+ * sendmmsg(2) calls as the kernel will let us get away with.
+ */
+
+void journal_flush()
+{
+	static int fd = -1;
+	static struct sockaddr_un addr;
+	static int warned = 0;
+	static struct mmsghdr *msgs;
+	static struct iovec *iovs;
+	static int nmsgs;
+	int i, sent;
+
+	if (!journal_path || journal_nentries == 0)
+		return;
+
+	if (fd < 0) {
+		if (strlen(journal_path) >= sizeof(addr.sun_path)) {
+			errno = ENAMETOOLONG;
+			perror_exit("journal socket", journal_path);
+		}
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, journal_path);
+		if ((fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0)) < 0)
+			perror_exit("socket", journal_path);
+	}
+
+	if (nmsgs < journal_nentries) {
+		nmsgs = journal_maxentries;
+		msgs = realloc(msgs, nmsgs * sizeof(*msgs));
+		iovs = realloc(iovs, nmsgs * sizeof(*iovs));
+		if (msgs == NULL || iovs == NULL)
+			perror_exit("realloc", "journal mmsghdrs");
+	}
+
+	memset(msgs, 0, journal_nentries * sizeof(*msgs));
+	for (i = 0; i < journal_nentries; i++) {
+		iovs[i].iov_base = journal_entries[i].buf;
+		iovs[i].iov_len = journal_entries[i].len;
+		msgs[i].msg_hdr.msg_name = &addr;
+		msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+		msgs[i].msg_hdr.msg_iov = iovs + i;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	for (i = 0; i < journal_nentries; i += sent) {
+		sent = sendmmsg(fd, msgs + i, journal_nentries - i, 0);
+		if (sent <= 0) {
+			if (!warned) {
+				fprintf(stderr, "%s: dropping journal entries: "
+					"%s <%s>\n", cmd, strerror(errno),
+					journal_path);
+				warned = 1;
+			}
+			break;
+		}
+	}
+
+	journal_nentries = 0;
+}
+
+/*
+ * Change-only tables ("-D tol,K").
+ *
+ * Consecutive hogs tables are often nearly the same: the same tasks,
+ * with slightly different numbers.  With -D tol,K, a row is shown only
+ * if its task just entered the top set (the tasks shown), or if some
+ * value changed by more than tol percent since that task's row was last
+ * printed.  Tasks that left the top set are listed as "(left)", and the
+ * rows not shown are counted in an "unchanged: N rows" line.  Every Kth
+ * table is shown in full, so a reader starting anywhere in the log
+ * soon has every row.  The last printed values are kept per profile,
+ * and forgotten when its busy episode ends, so each episode's first
+ * table is full.
+ */
+
+/* Task's values as last printed */
+typedef struct {
+	pid_t pid;
+	comm_id_t comm;
+	unsigned val[NMETRICS];
+} printed_t;
+
+printed_t *printed[MAX_PROFILES];	/* each profile's top set, by pid */
+int nprinted[MAX_PROFILES];		/* number entries in printed[] */
+int since_full[MAX_PROFILES];		/* tables since last full one */
+
+int printed_cmp(const void *p1, const void *p2)
+{
+	const printed_t *pp1 = p1;
+	const printed_t *pp2 = p2;
+
+	return (pp1->pid > pp2->pid) - (pp1->pid < pp2->pid);
+}
+
+/* Return 1 if a changed from b by more than val_D_tol percent */
+
+int changed(unsigned a, unsigned b)
+{
+	unsigned diff = a > b ? a - b : b - a;
+
+	return 100. * diff > val_D_tol * (b ? b : 1);
+}
+
+/*
+ * Clear showme of each row in joinp[] .. jpend[] unchanged since last
+ * printed.  Sets *nowp to the new top set (all rows that had showme
+ * set, with their values as last printed), sorted by pid, for
+ * change_finish().  Returns number of rows cleared.
+ */
+
+int change_filter(join_on_pid_t *joinp, join_on_pid_t *jpend,
+		task_usages_t latest, printed_t **nowp, int *nnowp)
+{
+	int pk = cur_profile;
+	printed_t *now, *op, key;
+	join_on_pid_t *jp;
+	int nnow = 0, nunchanged = 0, full, k, m;
+
+	if ((now = malloc((jpend - joinp + 1) * sizeof(*now))) == NULL)
+		perror_exit("malloc", "printed");
+	full = since_full[pk] == 0;
+	if (++since_full[pk] >= val_D_full)
+		since_full[pk] = 0;
+
+	for (jp = joinp; jp < jpend; jp++) {
+		printed_t *np;
+
+		if (!jp->showme)
+			continue;
+		np = now + nnow++;
+		np->pid = PID(latest, jp->j);
+		np->comm = latest.tu_array[jp->j].comm;
+		memcpy(np->val, jp->val, sizeof(np->val));
+
+		key.pid = np->pid;
+		op = bsearch(&key, printed[pk], nprinted[pk], sizeof(key),
+			printed_cmp);
+		if (full || op == NULL || op->comm != np->comm)
+			continue;
+		for (k = 0; k < nactive; k++) {
+			m = active_metrics[k];
+			if (changed(jp->val[m], op->val[m]))
+				break;
+		}
+		if (k < nactive)
+			continue;
+
+		/* Unchanged: keep its last printed values */
+		memcpy(np->val, op->val, sizeof(np->val));
+		summary_note(np->pid, np->comm, jp->val);
+		jp->showme = 0;
+		nunchanged++;
+	}
+	qsort(now, nnow, sizeof(*now), printed_cmp);
+	*nowp = now;
+	*nnowp = nnow;
+	return nunchanged;
+}
+
+/*
+ * After the rows change_filter() left shown, show the tasks that left
+ * the top set, and how many rows were unchanged, then make the new top
+ * set now[] the last printed.
+ */
+
+void change_finish(printed_t *now, int nnow, int nunchanged)
+{
+	int pk = cur_profile;
+	int i;
+
+	for (i = 0; i < nprinted[pk]; i++) {
+		printed_t *op = printed[pk] + i;
+
+		if (bsearch(op, now, nnow, sizeof(*now), printed_cmp) == NULL)
+			oprintf("    %8d  %16s  (left)\n", op->pid,
+				comm_name(op->comm));
+	}
+	if (nunchanged)
+		oprintf("    unchanged: %d rows\n", nunchanged);
+	free(printed[pk]);
+	printed[pk] = now;
+	nprinted[pk] = nnow;
+}
+
+/* Forget profile pk's last printed top set, as its episode ended */
+
+void change_reset(int pk)
+{
+	free(printed[pk]);
+	printed[pk] = NULL;
+	nprinted[pk] = 0;
+	since_full[pk] = 0;
+}
+
+/*
+ * Episode correlation ranking ("-K n").
+ *
+ * The biggest hog is not always the cause of an overload: a task that
+ * is always busy may just be a bystander, while the task whose activity
+ * rises and falls with the system load usually is the culprit.  With
+ * -K n, each task that is a hog candidate (over some metric's threshold)
+ * in any cycle of an episode is tracked for the rest of that episode.
+ * At the episode's end, the n tasks whose values best correlate with
+ * loadavg, CPU load or Mem load are shown, each with its best fitting
+ * metric and load measure, the correlation (Pearson's r), and whether
+ * the task's values best match the load of the next cycle (leads), the
+ * same cycle (with), or the prior cycle (lags).
+ *
+ * Each task keeps running sums of its values, their squares, and their
+ * products with each load measure at each of those three alignments,
+ * updated in O(1) per task per cycle, by merging the pid ordered tracked
+ * tasks with each cycle's pid ordered join.  A task not seen in a cycle
+ * (say, it exited) counts as zero.  The load sums are kept once for the
+ * episode, and each task notes what they were when it began being
+ * tracked.  The leads and lags correlations reuse the means and
+ * variances of the aligned one, which is close enough over the many
+ * cycles of an episode.
+ */
+
+#define CORR_MAX_TASKS 4096	/* max tasks tracked in an episode */
+#define CORR_MIN_CYCLES 4	/* tasks tracked fewer cycles not ranked */
+
+enum { CORR_LAVG, CORR_CPU, CORR_MEM, CORR_NSYS };
+enum { CORR_LEADS, CORR_WITH, CORR_LAGS, CORR_NLAGS };
+
+const char *corr_sys_names[CORR_NSYS] = { "loadavg", "cpuload", "memload" };
+const char *corr_lag_names[CORR_NLAGS] = { "leads", "with", "lags" };
+
+typedef struct {
+	pid_t pid;
+	comm_id_t comm;
+	long first;			/* corr_ncycles before tracked */
+	unsigned prev[NMETRICS];	/* values in prior cycle */
+	double sy[CORR_NSYS];		/* corr_sy[] before tracked */
+	double syy[CORR_NSYS];		/* corr_syy[] before tracked */
+	double sx[NMETRICS];		/* sum of values */
+	double sxx[NMETRICS];		/* sum of squared values */
+	double sxy[NMETRICS][CORR_NSYS][CORR_NLAGS];	/* sum of products */
+	double r;			/* best r, set by corr_rank() */
+	int m, s, lag;			/* metric, load, alignment of best r */
+} corrtask_t;
+
+corrtask_t *corrtasks;		/* tasks tracked, in pid order */
+corrtask_t *corrtasks2;		/* spare, for merging into */
+int ncorrtasks;			/* number entries in corrtasks[] */
+long corr_ncycles;		/* cycles sampled this episode */
+double corr_y[CORR_NSYS];	/* load measures this cycle */
+double corr_yprev[CORR_NSYS];	/* load measures prior cycle */
+double corr_sy[CORR_NSYS];	/* sum of load measures this episode */
+double corr_syy[CORR_NSYS];	/* sum of their squares */
+
+/* Note this cycle's load measures, before corr_sample() */
+
+void corr_system(double lavg, double cpu_load, double mem_load)
+{
+	int s;
+
+	if (val_K == 0)
+		return;
+	corr_yprev[CORR_LAVG] = corr_y[CORR_LAVG];
+	corr_yprev[CORR_CPU] = corr_y[CORR_CPU];
+	corr_yprev[CORR_MEM] = corr_y[CORR_MEM];
+	corr_y[CORR_LAVG] = lavg;
+	corr_y[CORR_CPU] = cpu_load;
+	corr_y[CORR_MEM] = mem_load;
+	for (s = 0; s < CORR_NSYS; s++) {
+		if (corr_ncycles == 0)
+			corr_yprev[s] = corr_y[s];
+		corr_sy[s] += corr_y[s];
+		corr_syy[s] += corr_y[s] * corr_y[s];
+	}
+	corr_ncycles++;
+}
+
+/* Add this cycle's values vals[] (NULL if not seen) to task's sums */
+
+void corr_update(corrtask_t *ctp, const unsigned *vals)
+{
+	int k, m, s;
+
+	for (k = 0; k < nactive; k++) {
+		double x, xprev;
+
+		m = active_metrics[k];
+		x = vals ? vals[m] : 0;
+		xprev = ctp->prev[m];
+		ctp->sx[m] += x;
+		ctp->sxx[m] += x * x;
+		for (s = 0; s < CORR_NSYS; s++) {
+			ctp->sxy[m][s][CORR_LEADS] += xprev * corr_y[s];
+			ctp->sxy[m][s][CORR_WITH] += x * corr_y[s];
+			ctp->sxy[m][s][CORR_LAGS] += x * corr_yprev[s];
+		}
+		ctp->prev[m] = x;
+	}
+}
+
+/*
+ * Update the tracked tasks from this cycle's join, joinp to jpend,
+ * and start tracking the candidates (showme set) not yet tracked.
+ */
+
+void corr_sample(const join_on_pid_t *joinp, const join_on_pid_t *jpend,
+		task_usages_t latest)
+{
+	const join_on_pid_t *jp = joinp;
+	corrtask_t *tmp;
+	int i = 0, n = 0, s;
+
+	if (val_K == 0 || cur_profile != 0 || cont_nscanned)
+		return;
+	if (corrtasks == NULL) {
+		corrtasks = malloc(CORR_MAX_TASKS * sizeof(*corrtasks));
+		corrtasks2 = malloc(CORR_MAX_TASKS * sizeof(*corrtasks2));
+		if (corrtasks == NULL || corrtasks2 == NULL)
+			perror_exit("malloc", "corrtasks");
+	}
+
+	while (jp < jpend || i < ncorrtasks) {
+		corrtask_t *ctp = corrtasks + i;
+
+		if (i < ncorrtasks &&
+		    (jp == jpend || ctp->pid < PID(latest, jp->j))) {
+			corr_update(ctp, NULL);
+			corrtasks2[n++] = *ctp;
+			i++;
+		} else if (i < ncorrtasks && ctp->pid == PID(latest, jp->j)) {
+			corr_update(ctp, ctp->comm ==
+				latest.tu_array[jp->j].comm ? jp->val : NULL);
+			corrtasks2[n++] = *ctp;
+			i++;
+			jp++;
+		} else {
+			if (jp->showme && n + ncorrtasks - i < CORR_MAX_TASKS) {
+				ctp = corrtasks2 + n++;
+				memset(ctp, 0, sizeof(*ctp));
+				ctp->pid = PID(latest, jp->j);
+				ctp->comm = latest.tu_array[jp->j].comm;
+				ctp->first = corr_ncycles - 1;
+				for (s = 0; s < CORR_NSYS; s++) {
+					ctp->sy[s] = corr_sy[s] - corr_y[s];
+					ctp->syy[s] = corr_syy[s] -
+						corr_y[s] * corr_y[s];
+				}
+				corr_update(ctp, jp->val);
+			}
+			jp++;
+		}
+	}
+	tmp = corrtasks;
+	corrtasks = corrtasks2;
+	corrtasks2 = tmp;
+	ncorrtasks = n;
+}
+
+/* Set task's best r, and the metric, load and alignment giving it */
+
+void corr_rank(corrtask_t *ctp)
+{
+	double n = corr_ncycles - ctp->first;
+	int k, m, s, lag;
+
+	ctp->r = 0;
+	for (k = 0; k < nactive; k++) {
+		double vx;
+
+		m = active_metrics[k];
+		vx = n * ctp->sxx[m] - ctp->sx[m] * ctp->sx[m];
+		for (s = 0; s < CORR_NSYS; s++) {
+			double sy = corr_sy[s] - ctp->sy[s];
+			double vy = n * (corr_syy[s] - ctp->syy[s]) - sy * sy;
+
+			if (vx <= 0 || vy <= 0)
+				continue;
+			for (lag = 0; lag < CORR_NLAGS; lag++) {
+				double r = (n * ctp->sxy[m][s][lag] -
+					ctp->sx[m] * sy) / sqrt(vx * vy);
+
+				if (r > ctp->r) {
+					ctp->r = r;
+					ctp->m = m;
+					ctp->s = s;
+					ctp->lag = lag;
+				}
+			}
+		}
+	}
+}
+
+/* Sort tracked tasks in decreasing order of best r */
+
+int corrtask_cmp(const void *p1, const void *p2)
+{
+	const corrtask_t *ctp1 = p1;
+	const corrtask_t *ctp2 = p2;
+
+	return (ctp2->r > ctp1->r) - (ctp2->r < ctp1->r);
+}
+
+/* At the end of an episode, show the -K best correlated tasks */
+
+void corr_flush()
+{
+	char tmbuf[128];
+	time_t now;
+	int i, n, saved_sink = cur_sink;
+
+	if (val_K == 0)
+		return;
+	for (i = n = 0; i < ncorrtasks; i++) {
+		if (corr_ncycles - corrtasks[i].first < CORR_MIN_CYCLES)
+			continue;
+		corr_rank(corrtasks + i);
+		if (corrtasks[i].r > 0)
+			corrtasks[n++] = corrtasks[i];
+	}
+	if (n > 0) {
+		if (nsinks > 1)
+			cur_sink = 0;
+		now = time(NULL);
+		strftime(tmbuf, sizeof(tmbuf), "%c", localtime(&now));
+		qsort(corrtasks, n, sizeof(*corrtasks), corrtask_cmp);
+		oprintf("\n%s - tasks best correlated with load, "
+			"over %ld cycles\n", tmbuf, corr_ncycles);
+		oprintf("    %8s  %16s  %10s  %8s  %5s  %5s  %6s\n", "pid",
+			"cmd", "metric", "load", "r", "when", "cycles");
+		for (i = 0; i < n && i < val_K; i++) {
+			corrtask_t *ctp = corrtasks + i;
+
+			oprintf("    %8d  %16s  %10s  %8s  %5.2f  %5s  %6ld\n",
+				ctp->pid, comm_name(ctp->comm),
+				metrics[ctp->m].name, corr_sys_names[ctp->s],
+				ctp->r, corr_lag_names[ctp->lag],
+				corr_ncycles - ctp->first);
+		}
+		flush_output();
+		cur_sink = saved_sink;
+	}
+
+	ncorrtasks = 0;
+	corr_ncycles = 0;
+	memset(corr_sy, 0, sizeof(corr_sy));
+	memset(corr_syy, 0, sizeof(corr_syy));
+}
+
+void show_hogs(task_usages_t prior, task_usages_t latest)
+{
+	int ni, nj;		/* number elements in prior, latest */
+	int i, j;		/* scans ni, nj */
+	join_on_pid_t *joinp;	/* join on pid, with delta cpusecs */
+	join_on_pid_t *jp;	/* scans joinp[] */
+	join_on_pid_t *jpend;	/* end (one past last valid entry) of joinp */
+	int got_some;		/* one or more CPU or RAM hogs found */
+	int k, m;		/* scan active_metrics[], metrics[] */
+	int n, nw, w;		/* number joined tasks, mask words; scans nw */
+	uint32_t *kbuf;		/* kernel prior, latest and out arrays */
+	uint64_t *mask;		/* kernel's bitmap of tasks over threshold */
+	int *cand;		/* indices of tasks over threshold */
+	int ncand;		/* number entries in cand[] */
+	int first_m;		/* enabled metric to sort shown tasks by */
+	int nrt = 0;		/* realtime runaways, first in joinp */
+	task_usages_t older;	/* oldest snapshot in history, if any */
+	printed_t *now = NULL;	/* -D: new top set, for change_finish() */
+	int nnow = 0, nunchanged = 0;
+	uint64_t t0 = bt_clock(hogs_joined);
+
+	ni = prior.tu_nelem;
+	nj = latest.tu_nelem;
+	if ((joinp = malloc(sizeof(*joinp) * max(ni, nj))) == NULL)
+		perror_exit("malloc", "joinp");
+
+	/* Join prior and latest on pid field, into joinp, */
+	i = j = 0;
+	jp = joinp;
+
+	while (i < ni && j < nj) {
+		if (j > 0 && PID(latest, j-1) > PID(latest, j)) {
+			fprintf(stderr, "/proc pids out of order - fail\n");
+			fprintf(stderr,
+				"j %d, nj %d, j-1 pid %d, j pid %d\n",
+				j, nj, PID(latest, j-1), PID(latest, j));
+			exit(9);
+		}
+		if (PID(prior, i) == PID(latest, j)) {
+			jp->i = i++;
+			jp->j = j++;
+			jp++;
+		} else if (PID(prior, i) < PID(latest, j)) {
+			i++;
+		} else {
+			j++;
+		}
+	}
+
+	jpend = jp;
+
+	/*
+	 * Set joinp's scaled value of each active metric, one kernel
+	 * pass per metric, and mark as shown the top (at most) val_n
+	 * tasks at or over each enabled metric's threshold (such as
+	 * cpumsecs >= -q value.)
+	 */
+	n = jpend - joinp;
+	nw = (n + 63) / 64;
+	kbuf = malloc(3 * n * sizeof(*kbuf) + 1);
+	mask = malloc(nw * sizeof(*mask) + 1);
+	cand = malloc(n * sizeof(*cand) + 1);
+	if (kbuf == NULL || mask == NULL || cand == NULL)
+		perror_exit("malloc", "kernel buffers");
+
+	for (jp = joinp; jp < jpend; jp++)
+		jp->showme = 0;
+
+	got_some = 0;
+	first_m = -1;
+
+	for (k = 0; k < nactive; k++) {
+		uint32_t *prior_vals = kbuf;
+		uint32_t *latest_vals = kbuf + n;
+		uint32_t *out = kbuf + 2 * n;
+		uint32_t mul, thresh;
+		int shift;
+		double factor;
+
+		m = active_metrics[k];
+		for (i = 0; i < n; i++) {
+			latest_vals[i] = latest.tu_array[joinp[i].j].val[m];
+			prior_vals[i] = metrics[m].kind != METRIC_GAUGE ?
+				prior.tu_array[joinp[i].i].val[m] : 0;
+		}
+		factor = (metrics[m].kind == METRIC_RATE ? 1 / val_t : 1) /
+			(metrics[m].per_cpu ? ncpus : 1);
+		scale_init(factor, &mul, &shift);
+		thresh = metrics[m].enabled ? metrics[m].thresh : UINT32_MAX;
+		scale_kernel(prior_vals, latest_vals, out, n, mul, shift,
+			thresh, mask);
+		for (i = 0; i < n; i++)
+			joinp[i].val[m] = out[i];
+
+		if (!metrics[m].enabled)
+			continue;
+		if (first_m < 0 ||
+		    metrics[m].sort_rank < metrics[first_m].sort_rank)
+			first_m = m;
+
+		ncand = 0;
+		for (w = 0; w < nw; w++) {
+			uint64_t bits;
+
+			for (bits = mask[w]; bits; bits &= bits - 1)
+				cand[ncand++] = w * 64 + __builtin_ctzll(bits);
+		}
+		if (ncand > val_n) {
+			cand_cmp_arg_t arg = { joinp, m };
+
+			qsort_r(cand, ncand, sizeof(*cand), cand_cmp, &arg);
+			ncand = val_n;
+		}
+		for (i = 0; i < ncand; i++)
+			joinp[cand[i]].showme = 1;
+		got_some |= ncand > 0;
+	}
+	bt_probe2(hogs_joined, jpend - joinp, probe_usecs() - t0);
+	corr_sample(joinp, jpend, latest);
+
+	free(kbuf);
+	free(mask);
+	free(cand);
+
+	/*
+	 * Move the tasks to be shown to the front of joinp, and sort
+	 * them by the enabled metric of lowest sort_rank, so that if
+	 * multiple metrics asked for, results are displayed in descending
+	 * order of CPU usage, or without it, of diskwait (-B), and so on.
+	 */
+	for (jp = joinp, i = 0; jp < jpend; jp++)
+		if (jp->showme)
+			joinp[i++] = *jp;
+	jpend = joinp + i;
+	if (first_m >= 0)
+		qsort_r(joinp, jpend - joinp, sizeof(*joinp), metric_cmp,
+			&first_m);
+
+	/*
+	 * With -X, realtime runaways go first, in that same order,
+	 * ahead of whatever else is shown, as the likeliest cause of
+	 * everything else on their CPUs stalling.
+	 */
+	if (metrics[M_RTCPU].enabled) {
+		join_on_pid_t *rest;
+		int nrest = 0;
+
+		if ((rest = malloc((jpend - joinp + 1) * sizeof(*rest))) == NULL)
+			perror_exit("malloc", "rt runaways");
+		for (jp = joinp; jp < jpend; jp++) {
+			if (jp->val[M_RTCPU] >= metrics[M_RTCPU].thresh)
+				joinp[nrt++] = *jp;
+			else
+				rest[nrest++] = *jp;
+		}
+		memcpy(joinp + nrt, rest, nrest * sizeof(*rest));
+		free(rest);
+	}
+	rt_runaways[cur_profile] = nrt;
+
+	/*
+	 * If no tasks have high CPU, RAM or DISKWAIT, say so briefly, but
+	 * skip printing header for empty list.  We left the date time line
+	 * without a trailing newline, so add one, somehow.
+	 */
+
+	if (got_some == 0) {
+		oprintf(" - no individual tasks are hogs.\n");
+		if (val_D_tol > 0 && !cont_nscanned) {
+			free(printed[cur_profile]);
+			printed[cur_profile] = NULL;
+			nprinted[cur_profile] = 0;
+		}
+		goto done;
+	} else {
+		oprintf("\n");
+	}
+
+	if (val_D_tol > 0 && !cont_nscanned) {
+		nunchanged = change_filter(joinp, jpend, latest, &now, &nnow);
+		if (nunchanged == nnow) {
+			change_finish(now, nnow, nunchanged);
+			goto done;
+		}
+	}
+
+	/*
+	 * With -k n, also show each task's mcpus averaged over as many
+	 * as the last n - 1 intervals, from the oldest snapshot in history.
+	 * Not for -Z ticks, whose tasks (a slice of them) and interval
+	 * aren't those of the history.
+	 */
+	older.tu_array = NULL;
+	older.tu_nelem = 0;
+	if (hist_count > 1 && !cont_nscanned)
+		older = hist_get(hist_count - 1);
+
+	oprintf("    %8s  %16s", "pid", "cmd");
+	for (k = 0; k < nactive; k++) {
+		m = active_metrics[k];
+		oprintf("  %10s", metrics[m].name);
+		if (m == M_CPU && older.tu_nelem)
+			oprintf("  %10s", "avgmcpus");
+		if (m == M_RTCPU)
+			oprintf("  %6s", "policy");
+	}
+	oprintf("  %-s\n", "cmdline");
+
+	for (jp = joinp; jp < jpend; jp++) {
+		if (jp->showme) {
+			char *cmdline = get_cmdline(PID(latest, jp->j));
+			char avg_str[16];
+
+			avg_str[0] = '\0';
+			if (older.tu_nelem) {
+				struct task_usage key, *op;
+
+				key.pid = PID(latest, jp->j);
+				op = bsearch(&key, older.tu_array, older.tu_nelem,
+					sizeof(key), task_usage_pid_cmp);
+				if (op == NULL || op->comm != latest.tu_array[jp->j].comm)
+					sprintf(avg_str, "  %10s", "-");
+				else
+					sprintf(avg_str, "  %10u", (unsigned)
+						((latest.tu_array[jp->j].val[M_CPU] -
+						  op->val[M_CPU]) / (val_t *
+						  (hist_count - 1)) / ncpus));
+			}
+
+			oprintf("    %8d  %16s",
+				PID(latest, jp->j),
+				CMD(latest, jp->j));
+			for (k = 0; k < nactive; k++) {
+				m = active_metrics[k];
+				oprintf("  %10u", jp->val[m]);
+				if (m == M_CPU)
+					oprintf("%s", avg_str);
+				if (m == M_RTCPU)
+					oprintf("  %6s", rt_policy_str(
+						latest.tu_array + jp->j));
+			}
+			oprintf("  %-.*s\n", szcmdlinebuf, cmdline);
+			journal_hog(PID(latest, jp->j), CMD(latest, jp->j),
+				jp->val, cmdline);
+			summary_note(PID(latest, jp->j),
+				latest.tu_array[jp->j].comm, jp->val);
+		}
+	}
+	if (val_D_tol > 0 && !cont_nscanned)
+		change_finish(now, nnow, nunchanged);
+
+	free(older.tu_array);
+done:
+	free(joinp);
+}
+
+/* Sort cgroups in decreasing order of rank. */
+
+int cgroup_rank_cmp(const void *p1, const void *p2)
+{
+	const cgroup_t *cgp1 = p1;
+	const cgroup_t *cgp2 = p2;
+
+	return (cgp2->rank > cgp1->rank) - (cgp2->rank < cgp1->rank);
+}
+
+/*
+ * With -G n, show the (at most) n cgroups most stalled, in msecs
+ * per second stalled on each of CPU, memory and I/O.
+ */
+
+void show_cgroup_stalls()
+{
+	int i, j;
+
+	if (ncgroups == 0)
+		return;
+	cgroup_sample();
+	qsort(cgroups, ncgroups, sizeof(*cgroups), cgroup_rank_cmp);
+
+	if (cgroups[0].rank == 0) {
+		oprintf("    - no cgroups stalled.\n");
+		return;
+	}
+
+	oprintf("   ");
+	for (j = 0; j < CG_NSTALLS; j++)
+		oprintf("  %8s", cg_headings[j]);
+	oprintf("  %-s\n", "cgroup");
+
+	for (i = 0; i < ncgroups && i < val_G && cgroups[i].rank > 0; i++) {
+		oprintf("   ");
+		for (j = 0; j < CG_NSTALLS; j++)
+			oprintf("  %8u", cgroups[i].val[j]);
+		oprintf("  %-s\n", cgroups[i].path);
+		journal_cgroup(cgroups + i);
+	}
+}
+
+/*
+ * With -S n, while the kernel slab is large or growing, show the (at
+ * most) n largest slab caches, and their growth in kB per second.
+ */
+
+void show_slab_caches()
+{
+	slab_t **top;
+	int i;
+
+	if (val_S == 0 || !slab_busy() || slab_sample() < 0 || nslabs == 0)
+		return;
+
+	if ((top = malloc(nslabs * sizeof(*top))) == NULL)
+		perror_exit("malloc", "slab caches");
+	for (i = 0; i < nslabs; i++)
+		top[i] = slabs + i;
+	qsort(top, nslabs, sizeof(*top), slab_cmp);
+
+	oprintf("    %24s  %10s  %10s  %10s\n", "slab", "kbytes", "kB/sec",
+		"objs");
+	for (i = 0; i < nslabs && i < val_S; i++) {
+		double growth = slab_growth(top[i]);
+
+		oprintf("    %24s  %10llu  %10.0f  %10lu\n", top[i]->name,
+			(unsigned long long) top[i]->kbytes, growth,
+			top[i]->objs);
+		journal_slab(top[i], growth);
+	}
+	free(top);
+}
+
+/* Return command name of pid in latest, or "-" if not there */
+
+const char *pid_comm(task_usages_t latest, pid_t pid)
+{
+	struct task_usage key, *tup;
+
+	key.pid = pid;
+	tup = bsearch(&key, latest.tu_array, latest.tu_nelem,
+		sizeof(key), task_usage_pid_cmp);
+	return tup ? comm_name(tup->comm) : "-";
+}
+
+/*
+ * With -l n, show the (at most) n lock holders with the most waiters,
+ * and the commands (with how many of each) waiting.
+ */
+
+void show_lock_waits(task_usages_t latest)
+{
+	int i, j, k;
+
+	if (val_l == 0)
+		return;
+	lock_sample();
+	if (nlockgrps == 0)
+		return;
+	qsort(lockgrps, nlockgrps, sizeof(*lockgrps), lockgrp_cmp);
+
+	oprintf("    %8s  %16s  %8s  %20s  %-s\n", "holder", "cmd", "waiters",
+		"inode", "waiting");
+	for (i = 0; i < nlockgrps && i < val_l; i++) {
+		lockgrp_t *lgp = lockgrps + i;
+		char inode[64], waiting[256];
+		const char *comms[LOCKS_MAX_PIDS];
+		int counts[LOCKS_MAX_PIDS], ncomms = 0, len = 0;
+
+		/* Count waiters of each command */
+		for (j = 0; j < lgp->npids; j++) {
+			const char *comm = pid_comm(latest, lgp->pids[j]);
+
+			for (k = 0; k < ncomms; k++)
+				if (strcmp(comms[k], comm) == 0)
+					break;
+			if (k == ncomms) {
+				comms[ncomms] = comm;
+				counts[ncomms++] = 0;
+			}
+			counts[k]++;
+		}
+		waiting[0] = '\0';
+		for (k = 0; k < ncomms && len < (int) sizeof(waiting); k++)
+			len += snprintf(waiting + len, sizeof(waiting) - len,
+				"%s%s*%d", k ? " " : "", comms[k], counts[k]);
+		if (lgp->npids < lgp->nwaiters && len < (int) sizeof(waiting))
+			snprintf(waiting + len, sizeof(waiting) - len, " ...");
+
+		snprintf(inode, sizeof(inode), "%02x:%02x:%lu", lgp->maj,
+			lgp->min, lgp->ino);
+		oprintf("    %8d  %16s  %8d  %20s  %-s\n", lgp->holder,
+			pid_comm(latest, lgp->holder), lgp->nwaiters, inode,
+			waiting);
+		journal_lockwait(lgp, pid_comm(latest, lgp->holder), inode,
+			waiting);
+	}
+}
+
+/* Sort pointers to fdtracks in decreasing order of limit usage. */
+
+int fdtrack_cmp(const void *p1, const void *p2)
+{
+	double u1 = fd_usage(*(const fdtrack_t * const *) p1);
+	double u2 = fd_usage(*(const fdtrack_t * const *) p2);
+
+	return (u2 > u1) - (u2 < u1);
+}
+
+/*
+ * With -F budget, count fds of the next tasks due, then show the
+ * (at most val_n) tasks whose fds are growing, or near their limit,
+ * along with their growth in fds per hour over the counts kept.
+ */
+
+void show_fd_leaks(task_usages_t latest)
+{
+	fdtrack_t **leaks;
+	int i, nleaks = 0;
+
+	if (val_F == 0)
+		return;
+	fd_sample(latest);
+
+	if ((leaks = malloc((nfdtracks + 1) * sizeof(*leaks))) == NULL)
+		perror_exit("malloc", "leaks");
+	for (i = 0; i < nfdtracks; i++)
+		if (fd_growing(fdtracks + i) || fd_near_limit(fdtracks + i))
+			leaks[nleaks++] = fdtracks + i;
+	if (nleaks == 0)
+		goto done;
+	qsort(leaks, nleaks, sizeof(*leaks), fdtrack_cmp);
+
+	oprintf("    %8s  %16s  %10s  %10s  %10s  %-s\n",
+		"pid", "cmd", "fds", "fdlimit", "fds/hour", "cmdline");
+	for (i = 0; i < nleaks && i < val_n; i++) {
+		fdtrack_t *ftp = leaks[i];
+		int last = ftp->nsamples - 1;
+		time_t dt = ftp->when[last] - ftp->when[0];
+		long growth = dt > 0 ? (ftp->nfds[last] - ftp->nfds[0]) *
+			3600L / dt : 0;
+		char *cmdline = get_cmdline(ftp->pid);
+		char limit_str[24];
+
+		if (ftp->softlimit)
+			sprintf(limit_str, "%10lu", ftp->softlimit);
+		else
+			sprintf(limit_str, "%10s", "-");
+		oprintf("    %8d  %16s  %10d  %s  %10ld  %-.*s\n", ftp->pid,
+			comm_name(ftp->comm), ftp->nfds[last], limit_str,
+			growth, szcmdlinebuf, cmdline);
+		journal_fdleak(ftp, growth, cmdline);
+	}
+done:
+	free(leaks);
+}
+
+void show_task_usages(task_usages_t prior, task_usages_t latest,
+		double lavg, double cpu_load, double mem_load,
+		int mem_pres, double zone_room, int cnt_php, int cnt_httpd,
+		char *dsk_str)
+{
+	time_t now;
+	struct tm *tmp;
+	char tmbuf[128];
+	char zone_str[128];
+	char cap_str[128];
+	char fid_str[64];
+	char thr_str[32];
+	char meminfo_str[MEMINFO_MAX * (MEMINFO_KEYLEN + 32)];
+	char php_str[128];
+	char httpd_str[128];
+	int i, dry;
+
+	if (cur_profile == 0)
+		budget_cycle();
+	dry = out_dry;		/* the header is written even if summarizing */
+	out_dry = 0;
+	now = time(NULL);
+	if ((tmp = localtime(&now)) == NULL)
+		perror_exit("localtime", NULL);
+	if (strftime(tmbuf, sizeof(tmbuf), "%c", tmp) == 0) {
+		fprintf(stderr, "strftime returned zero.\n");
+		exit(9);
+	}
+
+	if (val_z > 0 && zone_worst >= 0)
+		sprintf(zone_str, "; Zone %s room %3.0f%%",
+			zones[zone_worst].name, zone_room * (double) 100);
+	else
+		zone_str[0] = '\0';
+
+	cap_str[0] = '\0';
+	if (val_f > 0 && ncpufreqs > 0) {
+		sprintf(cap_str, "; Cap loss %3.0f%%", cap_loss * 100.);
+		if (cap_have_throttles)
+			sprintf(cap_str + strlen(cap_str), "; throttles %ld",
+				cap_throttles);
+	}
+
+	thr_str[0] = '\0';
+	if (header_nthreads(latest) >= 0)
+		sprintf(thr_str, "; threads %ld", latest.tu_nthreads);
+
+	if (cont_nscanned)
+		sprintf(fid_str, "; slices %d/%ld", cont_nscanned, val_Z);
+	else
+		fid_str[0] = '\0';
+
+	meminfo_str[0] = '\0';
+	for (i = MI_EXTRA; i < nmeminfo_fields; i++)
+		if (!meminfo_fields[i].hidden)
+			sprintf(meminfo_str + strlen(meminfo_str),
+				"; %s %lu kB", meminfo_fields[i].key,
+				meminfo_fields[i].val);
+
+	if (flag_P)
+		sprintf(php_str, "; cnt PHP %2d", cnt_php);
+	else
+		php_str[0] = '\0';
+
+	if (flag_H)
+		sprintf(httpd_str, "; cnt httpd %2d", cnt_httpd);
+	else
+		httpd_str[0] = '\0';
+
+	/* This outputs no trailing newline - see show_hogs() - unless dry */
+	oprintf("\n%s - loadavg %5.2f; CPU load %3.0f%%; "
+		"Mem load %2.0f%%; Mem pres %4d%s%s%s%s%s%s%s%s",
+		tmbuf, lavg, cpu_load * (double) 100,
+		mem_load * (double) 100, mem_pres, thr_str, fid_str, zone_str,
+		cap_str, meminfo_str, php_str, httpd_str, dsk_str);
+	if (dry)
+		oprintf("\n");
+	out_dry = dry;
+	journal_header(lavg, cpu_load, mem_load, mem_pres,
+		header_nthreads(latest));
+
+	if (cur_profile == 0 && !cont_nscanned)
+		corr_system(lavg, cpu_load, mem_load);
+	show_hogs(prior, latest);
+	if (!extras_shown && !cont_nscanned) {
+		extras_shown = 1;
+		show_cgroup_stalls();
+		show_fd_leaks(latest);
+		show_slab_caches();
+		show_lock_waits(latest);
+	}
+	out_dry = 0;
+
+	flush_output();
+	journal_flush();
+}
+
+void free_task_usages(task_usages_t t)
+{
+	free(t.tu_array);
+}
+
+/*
+ * Read the first load average (over 1 minute) from /proc/loadavg.
+ */
+
+double read_loadavg()
+{
+	static int fd = -1;
+	char buf[32];
+	const char *loadfile = "/proc/loadavg";
+
+	if (fd < 0) {
+		if ((fd = open(loadfile, O_RDONLY)) < 0)
+			perror_exit("open", loadfile);
+		stash_pread_fd(fd, loadfile);
+	}
+	if (my_pread(fd, buf, sizeof(buf), (off_t)0) < 1)
+		perror_exit("pread", loadfile);
+	return strtod(buf, NULL);
+}
+
+/*
+ * Return 1 if the current profile's triggers find the system loaded.
+ * The -z, -i and -f triggers, set only on the command line, are the
+ * first profile's alone.
+ */
+
+int system_is_loaded(double lavg, double cpu_load, double mem_load,
+		int mem_pres, double zone_room, double max_cpubusy)
+{
+	return lavg > val_p || 100.*cpu_load > val_c ||
+		100.*mem_load > val_m || mem_pres > val_u ||
+		(cur_profile == 0 && ((val_z > 0 && zone_room < val_z) ||
+		 meminfo_triggered() ||
+		 (val_f > 0 && 100.*cap_loss > val_f))) ||
+		(metrics[M_RTCPU].enabled &&
+		 (1000.*max_cpubusy >= metrics[M_RTCPU].thresh ||
+		  rt_runaways[cur_profile] > 0));
+}
+
+/*
+ * Return 1 if the system is loaded by the triggers of any profile,
+ * leaving the first profile current.
+ */
+
+int any_profile_loaded(double lavg, double cpu_load, double mem_load,
+		int mem_pres, double zone_room, double max_cpubusy)
+{
+	int k, loaded = 0;
+
+	for (k = 0; k < nprofiles && !loaded; k++) {
+		if (nprofiles > 1)
+			profile_load(k);
+		loaded = system_is_loaded(lavg, cpu_load, mem_load, mem_pres,
+			zone_room, max_cpubusy);
+	}
+	if (nprofiles > 1)
+		profile_load(0);
+	return loaded;
+}
+
+/*
+ * Continuous mode ("-Z n").
+ *
+ * Normally, below the triggers, the outer loop reads only a few system
+ * wide files, so there is no per-task data at all until the system is
+ * loaded, and then the cost jumps to a full scan of every task each
+ * inner loop.  With -Z n, per-task collection never stops.  The tasks
+ * are split by pid into n slices (pid % n), and each outer loop tick
+ * scans just some of the slices, in turn, showing a header and hogs
+ * table from what it found, in place of the time marks.
+ *
+ * How many slices each tick scans, and how often ticks come, follow the
+ * load level: the largest fraction of its trigger that any measure
+ * (loadavg of -p, CPU load of -c, Mem load of -m, memory pressure of
+ * -u, zone headroom of -z, meminfo fields of -i, capacity loss of -f,
+ * per-CPU RT busy of -X) has reached, in any profile.  Headroom and
+ * '<' fields count down to their triggers, so their fraction is the
+ * limit over the value.  An RT runaway puts the level at 1.  At level l,
+ * each tick scans ceil(l * n) slices (at least one), and the next tick
+ * comes after -s secs, less l of the way from -s to -t secs.  So the
+ * cost rises smoothly, from one slice every -s secs when idle, to all
+ * tasks every -t secs just below the triggers, where the inner loop
+ * takes over at the same cost.
+ *
+ * Each slice keeps its own prior snapshot, and the time it was taken.
+ * The slices scanned in one tick were last scanned at different times,
+ * so before their priors are merged, each rate metric's prior value is
+ * moved so that the change to the latest value over -t secs is the
+ * same rate as the actual change over that slice's elapsed time, and
+ * the hogs table then shows the true rates.  The header's threads are
+ * scaled up from the slices scanned, and it notes how many were.  The
+ * other tables (-G, -F, -S, -l), change-only tables (-D), and the
+ * correlation ranking (-K) need full scans, so are left to the inner
+ * loop.
+ */
+
+#define CONT_MAX_SLICES 64	/* max -Z slices */
+
+task_usages_t cont_prior[CONT_MAX_SLICES];	/* last snapshot of slice */
+double cont_when[CONT_MAX_SLICES];	/* when taken, or 0 if never */
+int cont_next;			/* next slice to scan */
+useconds_t cont_usecs;		/* usecs to next continuous mode tick */
+
+/*
+ * Return the load level: the largest fraction of its trigger reached by
+ * any system wide measure, in any profile, leaving the first profile
+ * current.  Returns at most 1.
+ */
+
+double cont_level(double lavg, double cpu_load, double mem_load,
+		int mem_pres, double zone_room, double max_cpubusy)
+{
+	double level = 0;
+	int k;
+
+	for (k = 0; k < nprofiles; k++) {
+		if (nprofiles > 1)
+			profile_load(k);
+		if (lavg / val_p > level)
+			level = lavg / val_p;
+		if (100. * cpu_load / val_c > level)
+			level = 100. * cpu_load / val_c;
+		if (100. * mem_load / val_m > level)
+			level = 100. * mem_load / val_m;
+		if (val_u > 0 && (double) mem_pres / val_u > level)
+			level = (double) mem_pres / val_u;
+		if (k == 0 && val_z > 0 &&
+		    (zone_room <= 0 || val_z / zone_room > level))
+			level = zone_room > 0 ? val_z / zone_room : 1;
+		if (k == 0 && meminfo_level() > level)
+			level = meminfo_level();
+		if (k == 0 && val_f > 0 && 100. * cap_loss / val_f > level)
+			level = 100. * cap_loss / val_f;
+		if (metrics[M_RTCPU].enabled && metrics[M_RTCPU].thresh > 0 &&
+		    1000. * max_cpubusy / metrics[M_RTCPU].thresh > level)
+			level = 1000. * max_cpubusy / metrics[M_RTCPU].thresh;
+		if (metrics[M_RTCPU].enabled && rt_runaways[k] > 0)
+			level = 1;
+	}
+	if (nprofiles > 1)
+		profile_load(0);
+	return level < 1 ? level : 1;
+}
+
+/*
+ * Move the rate metric values of prior, last read secs ago, so that
+ * their changes to latest are over -t secs, at the same rates.
+ */
+
+void cont_rescale(task_usages_t prior, task_usages_t latest, double secs)
+{
+	struct task_usage *pp, *lp;
+	int i, m;
+
+	for (i = 0; i < prior.tu_nelem; i++) {
+		pp = prior.tu_array + i;
+		lp = bsearch(pp, latest.tu_array, latest.tu_nelem,
+			sizeof(*lp), task_usage_pid_cmp);
+		if (lp == NULL || lp->comm != pp->comm)
+			continue;
+		for (m = 0; m < NMETRICS; m++) {
+			double d;
+
+			if (metrics[m].kind != METRIC_RATE ||
+			    lp->val[m] < pp->val[m])
+				continue;
+			d = (lp->val[m] - pp->val[m]) * val_t / secs;
+			pp->val[m] = d < lp->val[m] ? lp->val[m] - d : 0;
+		}
+	}
+}
+
+/*
+ * One continuous mode outer loop tick: scan the next slices, as many
+ * as the load level calls for, show their hogs, and set cont_usecs to
+ * when the next tick should come.
+ */
+
+void cont_tick(double lavg, double cpu_load, double mem_load,
+		int mem_pres, double zone_room, double max_cpubusy)
+{
+	unsigned char want[CONT_MAX_SLICES];
+	task_usages_t prior, latest;
+	double level, now;
+	char *dsk_str;
+	int i, s, n, nscan, saved_sink = cur_sink;
+
+	if (val_Z == 0)
+		return;
+	level = cont_level(lavg, cpu_load, mem_load, mem_pres, zone_room,
+		max_cpubusy);
+	nscan = (int) (level * val_Z + 0.999999);
+	if (nscan < 1)
+		nscan = 1;
+	memset(want, 0, sizeof(want));
+	for (i = 0; i < nscan; i++)
+		want[(cont_next + i) % val_Z] = 1;
+	cont_next = (cont_next + nscan) % val_Z;
+
+	latest = get_task_slices(want, val_Z);
+	now = mono_secs();
+
+	/* Merge the priors of the slices scanned, as of -t secs ago */
+	for (s = n = 0; s < val_Z; s++)
+		if (want[s])
+			n += cont_prior[s].tu_nelem;
+	if ((prior.tu_array = malloc((n + 1) * sizeof(*prior.tu_array)))
+			== NULL)
+		perror_exit("malloc", "cont prior");
+	prior.tu_nelem = 0;
+	prior.tu_nthreads = 0;
+	for (s = 0; s < val_Z; s++) {
+		task_usages_t *tp = cont_prior + s;
+
+		if (!want[s])
+			continue;
+		if (cont_when[s] > 0) {
+			cont_rescale(*tp, latest, now - cont_when[s]);
+			memcpy(prior.tu_array + prior.tu_nelem, tp->tu_array,
+				tp->tu_nelem * sizeof(*tp->tu_array));
+			prior.tu_nelem += tp->tu_nelem;
+		}
+
+		/* This slice of latest becomes the slice's prior */
+		tp->tu_array = realloc(tp->tu_array, (latest.tu_nelem + 1) *
+			sizeof(*tp->tu_array));
+		if (tp->tu_array == NULL)
+			perror_exit("realloc", "cont_prior");
+		for (i = n = 0; i < latest.tu_nelem; i++)
+			if (latest.tu_array[i].pid % val_Z == s)
+				tp->tu_array[n++] = latest.tu_array[i];
+		tp->tu_nelem = n;
+		cont_when[s] = now;
+	}
+	qsort(prior.tu_array, prior.tu_nelem, sizeof(*prior.tu_array),
+		task_usage_pid_cmp);
+
+	latest.tu_nthreads = latest.tu_nthreads * val_Z / nscan;
+	cont_nscanned = nscan;
+	dsk_str = get_disks_monitored();
+	if (nsinks > 1)
+		cur_sink = 0;
+	show_task_usages(prior, latest, lavg, cpu_load, mem_load, mem_pres,
+		zone_room, flag_P ? get_cnt_php(latest) : 0,
+		flag_H ? get_cnt_httpd(latest) : 0, dsk_str);
+	cur_sink = saved_sink;
+	cont_nscanned = 0;
+	free(dsk_str);
+	free_task_usages(prior);
+	free_task_usages(latest);
+
+	cont_usecs = (useconds_t) ((val_s + (val_t - val_s) * level) * 1e6);
+}
+
+void emit_time_marker_start()
+{
+	if (val_A || val_Z)
+		return;
+	oprintf("%ld.", time(NULL));
+}
+
+void emit_time_marker()
+{
+	if (val_A || val_Z)
+		return;
+	oprintf("%ld.", time(NULL) % 10000);
+	flush_output();
+}
+
+void emit_time_marker_eol()
+{
+	if (val_A || val_Z)
+		return;
+	oprintf("\n");
+}
+
+/*
+ * Low wakeup idle mode ("-I").
+ *
+ * On a large fleet of mostly idle virtual machines, even our cheap
+ * outer loop, waking every few seconds, has a noticeable aggregate
+ * cost: each wakeup is a vCPU wakeup that keeps that CPU out of deeper
+ * idle states.  With -I:
+ *
+ *  1) set a large timer slack (a quarter of the outer loop time, up to
+ *     one second) with prctl(PR_SET_TIMERSLACK), letting the kernel
+ *     defer our wakeup to coincide with some other timer, and
+ *  2) sleep in the outer loop until the next wall clock multiple of
+ *     the outer loop time (every :00, :02, :04, ... at "-s 2"), rather
+ *     than for the outer loop time from whenever we last woke, so that
+ *     our ticks coalesce with other periodic work aligned the same way.
+ *
+ * The /proc files read on each outer loop tick (loadavg, stat, meminfo
+ * and cpuset memory_pressure) are opened once and then pread(), so a
+ * tick costs just those few preads, in either mode.
+ *
+ * All our sleeps go through nap(), which counts our wakeups, for
+ * the wakeups per hour shown with the heartbeat (-A) output.
+ */
+
+unsigned long self_wakeups;	/* times we've woken from a nap() */
+
+void nap(useconds_t usecs)
+{
+	usleep(usecs);
+	self_wakeups++;
+}
+
+void outer_nap(useconds_t usecs)
+{
+	struct timespec ts;
+	uint64_t nsecs, period;
+
+	if (!flag_I) {
+		nap(usecs);
+		return;
+	}
+
+	period = (uint64_t) usecs * 1000;
+	if (period == 0)
+		period = 1;
+	if (clock_gettime(CLOCK_REALTIME, &ts) < 0)
+		perror_exit("clock_gettime", "CLOCK_REALTIME");
+	nsecs = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	nsecs = (nsecs / period + 1) * period;
+	ts.tv_sec = nsecs / 1000000000;
+	ts.tv_nsec = nsecs % 1000000000;
+	while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		continue;
+	self_wakeups++;
+}
+
+void idle_mode_init()
+{
+	unsigned long slack;	/* timer slack in nanoseconds */
+
+	if (!flag_I)
+		return;
+	slack = val_s * 1e9 / 4;
+	if (slack > 1000000000UL)
+		slack = 1000000000UL;
+	if (prctl(PR_SET_TIMERSLACK, slack, 0, 0, 0) < 0)
+		perror_exit("prctl", "PR_SET_TIMERSLACK");
+}
+
+/*
+ * Our own CPU usage so far (user + system), in microseconds.
+ */
+
+uint64_t self_cpu_usecs()
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		perror_exit("getrusage", "RUSAGE_SELF");
+	return (uint64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/*
+ * Heartbeat compaction ("-A n").
+ *
+ * Rather than a "NNNN." time mark every outer loop tick, which at
+ * "-s 2" is 43,200 marks a day that say only "still alive", output one
+ * heartbeat line every n seconds, with the number of outer loop ticks
+ * in that period and the min/mean/max of each system wide measure
+ * sampled on those ticks.  For example:
+ *
+ *   1792364352 heartbeat 300s: ticks 150; loadavg 0.05/0.31/1.20;
+ *	CPU load 1/4/38%; Mem load 8/8/9%; Mem pres 0/0/0
+ *
+ * (all on one line), where the leading number is the time (seconds
+ * since the epoch) that period began.  With -I, the line ends with
+ * our own wakeups per hour and CPU msecs per hour over that period,
+ * as in "; self wakeups/hr 1800 cpu msecs/hr 95".
+ *
+ * The summaries are updated incrementally on each tick, so the cost
+ * of a tick does not depend on the length of the period.  If the
+ * system becomes loaded part way through a period, that partial
+ * period is output just before the inner loop output begins.
+ */
+
+typedef struct {
+	double min, max, sum;
+} hb_stat_t;
+
+struct {
+	time_t start;		/* time this period began (0: not begun) */
+	long ticks;		/* outer loop ticks so far this period */
+	unsigned long start_wakeups;	/* self_wakeups at start */
+	uint64_t start_cpu_usecs;	/* self_cpu_usecs() at start */
+	hb_stat_t lavg, cpu_load, mem_load, mem_pres;
+} heartbeat;
+
+void hb_stat_add(hb_stat_t *hsp, double v)
+{
+	if (heartbeat.ticks == 0) {
+		hsp->min = hsp->max = hsp->sum = v;
+		return;
+	}
+	if (v < hsp->min)
+		hsp->min = v;
+	if (v > hsp->max)
+		hsp->max = v;
+	hsp->sum += v;
+}
+
+void heartbeat_flush()
+{
+	hb_stat_t *l = &heartbeat.lavg;
+	hb_stat_t *c = &heartbeat.cpu_load;
+	hb_stat_t *m = &heartbeat.mem_load;
+	hb_stat_t *u = &heartbeat.mem_pres;
+	double n = heartbeat.ticks;
+	long elapsed;
+	char self_str[128];
+
+	if (!val_A || heartbeat.ticks == 0)
+		return;
+
+	elapsed = time(NULL) - heartbeat.start;
+	if (flag_I) {
+		double hours = max(elapsed, 1) / 3600.;
+
+		sprintf(self_str, "; self wakeups/hr %.0f cpu msecs/hr %.0f",
+			(self_wakeups - heartbeat.start_wakeups) / hours,
+			(self_cpu_usecs() - heartbeat.start_cpu_usecs) /
+				1000. / hours);
+	} else {
+		self_str[0] = '\0';
+	}
+
+	oprintf("%ld heartbeat %lds: ticks %ld; loadavg %.2f/%.2f/%.2f; "
+		"CPU load %.0f/%.0f/%.0f%%; Mem load %.0f/%.0f/%.0f%%; "
+		"Mem pres %.0f/%.0f/%.0f%s\n",
+		(long) heartbeat.start, elapsed, heartbeat.ticks,
+		l->min, l->sum / n, l->max,
+		100. * c->min, 100. * c->sum / n, 100. * c->max,
+		100. * m->min, 100. * m->sum / n, 100. * m->max,
+		u->min, u->sum / n, u->max, self_str);
+	flush_output();
+
+	heartbeat.start = 0;
+	heartbeat.ticks = 0;
+}
+
+void heartbeat_sample(double lavg, double cpu_load, double mem_load,
+		int mem_pres)
+{
+	time_t now;
+
+	if (!val_A)
+		return;
+
+	now = time(NULL);
+	if (heartbeat.start == 0) {
+		heartbeat.start = now;
+		heartbeat.start_wakeups = self_wakeups;
+		if (flag_I)
+			heartbeat.start_cpu_usecs = self_cpu_usecs();
+	}
+
+	hb_stat_add(&heartbeat.lavg, lavg);
+	hb_stat_add(&heartbeat.cpu_load, cpu_load);
+	hb_stat_add(&heartbeat.mem_load, mem_load);
+	hb_stat_add(&heartbeat.mem_pres, mem_pres);
+	heartbeat.ticks++;
+
+	if (now - heartbeat.start >= val_A)
+		heartbeat_flush();
+}
+
+/*
+ * Multi-resolution metrics store ("-R path").
+ *
+ * The system wide measures sampled on each outer (and inner) loop tick
+ * are usually thrown away unless they trigger the inner loop.  With -R,
+ * they are also recorded in a round robin database (in the style of
+ * rrdtool) in a memory mapped file at path, so that later one can ask
+ * "what was the CPU load at 03:10 last Thursday?" with -Y.
+ *
+ * The store holds a few fixed size rings of slots, each ring at a
+ * coarser time resolution and covering a longer span than the last:
+ *
+ *	ring 0: one slot per RRD_STEP0 (10) secs, for a day
+ *	ring 1: one slot per minute, for 30 days
+ *	ring 2: one slot per hour, for 5 years
+ *
+ * Slot k of a ring with step secs holds the mean of all samples taken
+ * during the period number (time / step), where (period % nslots) == k.
+ * Each slot records which period it holds, so stale slots (from a
+ * previous lap around the ring, or from while batch_top wasn't running)
+ * are recognized and reset, rather than averaged into.  An append thus
+ * touches just one slot in each ring - O(1) - and the file size is
+ * fixed when the store is created, about 2.3 Mbytes.  The layout does
+ * not depend on any option, so restarting with another -s keeps the
+ * history; samples coming faster than RRD_STEP0 are just averaged.
+ *
+ * An existing file at path with some other layout (an older store, or
+ * not a store at all) is never overwritten: batch_top exits with an
+ * error instead, and it must be removed, or another path used.
+ */
+
+#define RRD_MAGIC "btrrd01"
+
+enum { RRD_LAVG, RRD_CPU_LOAD, RRD_MEM_LOAD, RRD_MEM_PRES, RRD_NMETRICS };
+
+const char *rrd_metric_names[RRD_NMETRICS] = {
+	"loadavg", "CPU load", "Mem load", "Mem pres"
+};
+
+#define RRD_NRINGS 3
+#define RRD_STEP0 10		/* secs per slot in ring 0 */
+
+typedef struct {
+	uint32_t period;		/* time / step of samples in slot */
+	uint32_t count;			/* number samples averaged in slot */
+	float val[RRD_NMETRICS];	/* mean of samples, per metric */
+} rrd_slot_t;
+
+typedef struct {
+	uint32_t step;			/* seconds per slot */
+	uint32_t nslots;		/* slots in ring */
+	uint64_t offset;		/* file offset of slot[0] */
+} rrd_ring_t;
+
+typedef struct {
+	char magic[8];			/* RRD_MAGIC */
+	uint32_t nmetrics;		/* RRD_NMETRICS */
+	uint32_t nrings;		/* RRD_NRINGS */
+	rrd_ring_t rings[RRD_NRINGS];
+} rrd_header_t;
+
+rrd_header_t *rrd_map;			/* mmap'd store, or NULL */
+
+/*
+ * Build the header that a store for our current settings should have.
+ */
+
+void rrd_layout(rrd_header_t *hp)
+{
+	uint64_t offset;
+	int r;
+
+	memset(hp, 0, sizeof(*hp));
+	memcpy(hp->magic, RRD_MAGIC, sizeof(hp->magic));
+	hp->nmetrics = RRD_NMETRICS;
+	hp->nrings = RRD_NRINGS;
+	hp->rings[0].step = RRD_STEP0;
+	hp->rings[0].nslots = 86400 / RRD_STEP0;
+	hp->rings[1].step = 60;
+	hp->rings[1].nslots = 30 * 24 * 60;
+	hp->rings[2].step = 3600;
+	hp->rings[2].nslots = 5 * 366 * 24;
+
+	offset = sizeof(*hp);
+	for (r = 0; r < RRD_NRINGS; r++) {
+		hp->rings[r].offset = offset;
+		offset += (uint64_t) hp->rings[r].nslots * sizeof(rrd_slot_t);
+	}
+}
+
+uint64_t rrd_size(const rrd_header_t *hp)
+{
+	const rrd_ring_t *last = hp->rings + RRD_NRINGS - 1;
+
+	return last->offset + (uint64_t) last->nslots * sizeof(rrd_slot_t);
+}
+
+rrd_slot_t *rrd_slot(rrd_header_t *hp, int r, uint32_t period)
+{
+	rrd_ring_t *rp = hp->rings + r;
+	rrd_slot_t *slots = (rrd_slot_t *) ((char *) hp + rp->offset);
+
+	return slots + period % rp->nslots;
+}
+
+/*
+ * Return 1 if the header at hp, in a file of size bytes, is of a store
+ * whose every ring lies within the file, after the header.
+ */
+
+int rrd_valid(const rrd_header_t *hp, uint64_t size)
+{
+	int r;
+
+	if (memcmp(hp->magic, RRD_MAGIC, sizeof(hp->magic)) ||
+	    hp->nmetrics != RRD_NMETRICS || hp->nrings != RRD_NRINGS)
+		return 0;
+	for (r = 0; r < RRD_NRINGS; r++) {
+		const rrd_ring_t *rp = hp->rings + r;
+
+		if (rp->step == 0 || rp->nslots == 0 ||
+		    rp->offset < sizeof(*hp) || rp->offset > size ||
+		    (size - rp->offset) / sizeof(rrd_slot_t) < rp->nslots)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Map the store at rrd_path, creating it if need be.  If for_query,
+ * the store must already exist, and is mapped read-only.
+ */
+
+void rrd_open(int for_query)
+{
+	rrd_header_t want;
+	struct stat sb;
+	uint64_t size;
+	int fd;
+	void *p;
+
+	rrd_layout(&want);
+
+	if ((fd = open(rrd_path, for_query ? O_RDONLY : O_RDWR|O_CREAT,
+			0644)) < 0)
+		perror_exit("open", rrd_path);
+	if (fstat(fd, &sb) < 0)
+		perror_exit("fstat", rrd_path);
+
+	if (for_query) {
+		if ((size_t) sb.st_size < sizeof(want)) {
+			fprintf(stderr, "%s: %s: not a metrics store\n",
+				cmd, rrd_path);
+			exit(1);
+		}
+		if ((p = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED,
+				fd, 0)) == MAP_FAILED)
+			perror_exit("mmap", rrd_path);
+		rrd_map = p;
+		if (!rrd_valid(rrd_map, sb.st_size)) {
+			fprintf(stderr, "%s: %s: not a metrics store\n",
+				cmd, rrd_path);
+			exit(1);
+		}
+		close(fd);
+		return;
+	}
+
+	size = rrd_size(&want);
+	if (sb.st_size == 0 && ftruncate(fd, size) < 0)	/* new, all zeros */
+		perror_exit("ftruncate", rrd_path);
+	else if (sb.st_size != 0 && (uint64_t) sb.st_size != size) {
+		fprintf(stderr, "%s: %s: not a metrics store of this layout\n",
+			cmd, rrd_path);
+		exit(1);
+	}
+	if ((p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
+			fd, 0)) == MAP_FAILED)
+		perror_exit("mmap", rrd_path);
+	close(fd);
+	rrd_map = p;
+
+	if (sb.st_size == 0)
+		memcpy(rrd_map, &want, sizeof(want));
+	else if (memcmp(rrd_map, &want, sizeof(want)) != 0) {
+		fprintf(stderr, "%s: %s: not a metrics store of this layout\n",
+			cmd, rrd_path);
+		exit(1);
+	}
+}
+
+void rrd_append(double lavg, double cpu_load, double mem_load, int mem_pres)
+{
+	double v[RRD_NMETRICS];
+	uint32_t now;
+	int r, m;
+
+	if (!rrd_path)
+		return;
+	if (!rrd_map)
+		rrd_open(0);
+
+	v[RRD_LAVG] = lavg;
+	v[RRD_CPU_LOAD] = cpu_load;
+	v[RRD_MEM_LOAD] = mem_load;
+	v[RRD_MEM_PRES] = mem_pres;
+
+	now = time(NULL);
+	for (r = 0; r < RRD_NRINGS; r++) {
+		uint32_t period = now / rrd_map->rings[r].step;
+		rrd_slot_t *sp = rrd_slot(rrd_map, r, period);
+
+		if (sp->period != period || sp->count == 0) {
+			sp->period = period;
+			sp->count = 0;
+			for (m = 0; m < RRD_NMETRICS; m++)
+				sp->val[m] = 0.0;
+		}
+		sp->count++;
+		for (m = 0; m < RRD_NMETRICS; m++)
+			sp->val[m] += (v[m] - sp->val[m]) / sp->count;
+	}
+}
+
+/*
+ * Display what the store recorded at time "when", from the finest
+ * resolution ring still holding that time.  Return 0 if found, else 1.
+ */
+
+int rrd_lookup(long when)
+{
+	struct tm *tmp;
+	char tmbuf[128];
+	time_t t;
+	int r;
+
+	rrd_open(1);
+
+	if (when <= 0)
+		when += time(NULL);
+	t = when;
+	if ((tmp = localtime(&t)) == NULL)
+		perror_exit("localtime", NULL);
+	strftime(tmbuf, sizeof(tmbuf), "%c", tmp);
+
+	for (r = 0; r < (int) rrd_map->nrings; r++) {
+		uint32_t period = when / rrd_map->rings[r].step;
+		rrd_slot_t *sp = rrd_slot(rrd_map, r, period);
+
+		if (sp->period != period || sp->count == 0)
+			continue;
+
+		oprintf("%s - %us mean of %u samples: loadavg %5.2f; "
+			"CPU load %3.0f%%; Mem load %2.0f%%; Mem pres %4.0f\n",
+			tmbuf, rrd_map->rings[r].step, sp->count,
+			sp->val[RRD_LAVG], sp->val[RRD_CPU_LOAD] * 100.,
+			sp->val[RRD_MEM_LOAD] * 100., sp->val[RRD_MEM_PRES]);
+		return 0;
+	}
+
+	oprintf("%s - no samples recorded in %s\n", tmbuf, rrd_path);
+	return 1;
+}
+
+/*
+ * Reading batch_top logs back in.
+ *
+ * The offline modes (-U, below) read the output of earlier batch_top
+ * runs, one record at a time, via log_open(), log_next() and
+ * log_close().  Files ending in ".xz" or ".gz" are read through
+ * "xz -dc" or "gzip -dc".
+ *
+ * log_next() returns the next inner loop header (time, loadavg and so
+ * on), hogs table row (pid, cmd, each metric column, cmdline), or
+ * outer loop line (time marks, heartbeats or -Z ticks, which end any
+ * busy episode.)  Other lines, including the cgroup and fd tables, -w
+ * summaries and -Z ticks' hogs, are skipped.  The hogs table heading
+ * is used to map each column to its metric, so logs written with any
+ * set of metrics enabled can be read.  For -D change-only tables, the
+ * rows of the latest tables are kept, and those a table counts as
+ * "unchanged" returned again (with their values as last printed), so
+ * a long running hog counts for every cycle it was one.
+ *
+ * Times are in the "%c" format of the logging host, in its local time,
+ * so logs from hosts in other timezones should be read with TZ set to
+ * match.
+ */
+
+enum { LOG_EOF, LOG_HEADER, LOG_HOG, LOG_OUTER };
+
+typedef struct {
+	int kind;			/* LOG_HEADER, LOG_HOG or LOG_OUTER */
+	time_t when;			/* time of (latest) header */
+	double lavg, cpu_load, mem_load; /* LOG_HEADER: as in header */
+	int mem_pres;
+	pid_t pid;			/* LOG_HOG: as in hogs table */
+	char comm[TASK_COMM_LEN];
+	unsigned val[NMETRICS];		/* value of each metric in has[] */
+	int has[NMETRICS];		/* set if metric's column was shown */
+	const char *cmdline;		/* valid until next log_next() */
+} log_rec_t;
+
+#define LOG_MAXCOLS 32
+
+/* A row of the -D top set, as last printed */
+typedef struct {
+	log_rec_t rec;			/* its cmdline malloc'd */
+	long table;			/* table it was last in */
+} log_top_t;
+
+typedef struct {
+	const char *path;
+	FILE *fp;
+	pid_t child;			/* decompressor, or 0 */
+	char *line;			/* getline() buffer */
+	size_t linesz;
+	int in_hogs;			/* set if in hogs table */
+	int in_skipped;			/* set if in -w summary or -Z tick */
+	int ncols;			/* number columns after pid, cmd */
+	int col_metric[LOG_MAXCOLS];	/* metrics[] index, or -1 */
+	time_t when;			/* time of latest header */
+	long ntables;			/* headers read */
+	log_top_t *top;			/* rows of latest tables */
+	int ntop, maxtop;
+	int replay;			/* next top[] to replay, or -1 */
+} log_reader_t;
+
+/* Return 1 if s ends with suffix */
+
+int has_suffix(const char *s, const char *suffix)
+{
+	size_t n = strlen(s), k = strlen(suffix);
+
+	return n >= k && strcmp(s + n - k, suffix) == 0;
+}
+
+/* Open log file at path, for log_next().  Exits on failure. */
+
+void log_open(log_reader_t *lrp, const char *path)
+{
+	const char *decompressor = NULL;
+
+	memset(lrp, 0, sizeof(*lrp));
+	lrp->path = path;
+	lrp->replay = -1;
+	if (has_suffix(path, ".xz"))
+		decompressor = "xz";
+	else if (has_suffix(path, ".gz"))
+		decompressor = "gzip";
+
+	if (decompressor == NULL) {
+		if ((lrp->fp = fopen(path, "r")) == NULL)
+			perror_exit("fopen", path);
+		return;
+	} else {
+		int pfd[2];
+
+		/* Close-on-exec, lest other threads' children inherit it */
+		if (pipe2(pfd, O_CLOEXEC) < 0)
+			perror_exit("pipe2", path);
+		if ((lrp->child = fork()) < 0)
+			perror_exit("fork", path);
+		if (lrp->child == 0) {
+			dup2(pfd[1], 1);
+			close(pfd[0]);
+			close(pfd[1]);
+			execlp(decompressor, decompressor, "-dc", "--", path,
+				(char *) NULL);
+			fprintf(stderr, "%s: exec %s: %s\n", cmd, decompressor,
+				strerror(errno));
+			_exit(127);	/* not exit(): don't flush parent's stdio */
+		}
+		close(pfd[1]);
+		if ((lrp->fp = fdopen(pfd[0], "r")) == NULL)
+			perror_exit("fdopen", path);
+	}
+}
+
+void log_close(log_reader_t *lrp)
+{
+	fclose(lrp->fp);
+	if (lrp->child > 0) {
+		int status;
+
+		waitpid(lrp->child, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			fprintf(stderr, "%s: decompressing %s failed\n",
+				cmd, lrp->path);
+	}
+	free(lrp->line);
+	while (lrp->ntop > 0)
+		free((char *) lrp->top[--lrp->ntop].rec.cmdline);
+	free(lrp->top);
+}
+
+/*
+ * Parse a hogs table heading, noting which metric each column is.
+ * Return 1 if it was one, else 0.
+ */
+
+int log_heading(log_reader_t *lrp, char *line)
+{
+	char *tok, *save;
+	int m;
+
+	if ((tok = strtok_r(line, " \n", &save)) == NULL ||
+	    strcmp(tok, "pid") != 0 ||
+	    (tok = strtok_r(NULL, " \n", &save)) == NULL ||
+	    strcmp(tok, "cmd") != 0)
+		return 0;
+
+	lrp->ncols = 0;
+	while ((tok = strtok_r(NULL, " \n", &save)) != NULL &&
+			strcmp(tok, "cmdline") != 0) {
+		if (lrp->ncols == LOG_MAXCOLS)
+			return 0;
+		lrp->col_metric[lrp->ncols] = -1;
+		for (m = 0; m < NMETRICS; m++)
+			if (strcmp(tok, metrics[m].name) == 0)
+				lrp->col_metric[lrp->ncols] = m;
+		lrp->ncols++;
+	}
+	/* The fd leak table also starts "pid cmd", but has no metrics */
+	for (m = 0; m < lrp->ncols; m++)
+		if (lrp->col_metric[m] >= 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * Parse a hogs table row: "    %8d  %16s" pid and cmd, then
+ * ncols columns, then "  " and the cmdline.  Return 0 on success,
+ * or -1 if it isn't one (including if a metric column isn't numeric).
+ */
+
+int log_hog(log_reader_t *lrp, char *line, log_rec_t *rp)
+{
+	char *p, *q, *e;
+	int i;
+
+	if (strlen(line) < 30)
+		return -1;
+	rp->pid = strtol(line, &p, 10);
+	if (p != line + 12)
+		return -1;
+	for (p = line + 14; p < line + 30 && *p == ' '; p++)
+		;
+	snprintf(rp->comm, sizeof(rp->comm), "%.*s", (int) (line + 30 - p), p);
+
+	memset(rp->has, 0, sizeof(rp->has));
+	p = line + 30;
+	for (i = 0; i < lrp->ncols; i++) {
+		int m = lrp->col_metric[i];
+
+		while (*p == ' ')
+			p++;
+		if (*p == '\0' || *p == '\n')
+			return -1;
+		q = p;
+		while (*p && *p != ' ' && *p != '\n')
+			p++;
+		if (m >= 0) {
+			/* Not a number, as in -D's "(left)" rows: not a hog */
+			rp->val[m] = strtoul(q, &e, 10);
+			if (e != p)
+				return -1;
+			rp->has[m] = 1;
+		}
+	}
+	if (p[0] == ' ' && p[1] == ' ')
+		p += 2;
+	p[strcspn(p, "\n")] = '\0';
+	rp->cmdline = p;
+	return 0;
+}
+
+/*
+ * Keep the top[] rows of table ntables (or, if all is set, none),
+ * dropping the rest.
+ */
+
+void log_top_prune(log_reader_t *lrp, int all)
+{
+	int i, n = 0;
+
+	for (i = 0; i < lrp->ntop; i++) {
+		if (!all && lrp->top[i].table == lrp->ntables)
+			lrp->top[n++] = lrp->top[i];
+		else
+			free((char *) lrp->top[i].rec.cmdline);
+	}
+	lrp->ntop = n;
+	lrp->replay = -1;
+}
+
+/* Return index in top[] of pid, or -1 */
+
+int log_top_find(log_reader_t *lrp, pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < lrp->ntop; i++)
+		if (lrp->top[i].rec.pid == pid)
+			return i;
+	return -1;
+}
+
+/* Note hogs table row *rp in top[], as in the current table */
+
+void log_top_note(log_reader_t *lrp, const log_rec_t *rp)
+{
+	log_top_t *tp;
+	int i;
+
+	if ((i = log_top_find(lrp, rp->pid)) >= 0) {
+		tp = lrp->top + i;
+		free((char *) tp->rec.cmdline);
+	} else {
+		if (lrp->ntop == lrp->maxtop) {
+			lrp->maxtop = lrp->maxtop ? 2 * lrp->maxtop : 32;
+			lrp->top = realloc(lrp->top,
+				lrp->maxtop * sizeof(*lrp->top));
+			if (lrp->top == NULL)
+				perror_exit("realloc", "log top set");
+		}
+		tp = lrp->top + lrp->ntop++;
+	}
+	tp->rec = *rp;
+	if ((tp->rec.cmdline = strdup(rp->cmdline)) == NULL)
+		perror_exit("strdup", "log top set");
+	tp->table = lrp->ntables;
+}
+
+/*
+ * Handle a -D change-only table line that isn't a row: a "(left)"
+ * line drops its task from top[], and an "unchanged: N rows" line
+ * starts replaying the top[] rows not printed in this table.  Return
+ * 1 if line was one of those.
+ */
+
+int log_change_line(log_reader_t *lrp, const char *line)
+{
+	char *p;
+	pid_t pid;
+	int i;
+
+	if (strncmp(line, "    unchanged: ", 15) == 0) {
+		lrp->replay = 0;
+		return 1;
+	}
+	pid = strtol(line, &p, 10);
+	if (p != line + 12 || strstr(p, "  (left)\n") == NULL)
+		return 0;
+	if ((i = log_top_find(lrp, pid)) >= 0) {
+		free((char *) lrp->top[i].rec.cmdline);
+		memmove(lrp->top + i, lrp->top + i + 1,
+			(lrp->ntop - i - 1) * sizeof(*lrp->top));
+		lrp->ntop--;
+	}
+	return 1;
+}
+
+/*
+ * Read next record of log into *rp.  Returns its kind,
+ * or LOG_EOF at end of file.
+ */
+
+int log_next(log_reader_t *lrp, log_rec_t *rp)
+{
+	/* Replay -D rows left out as unchanged, as last printed */
+	while (lrp->replay >= 0 && lrp->replay < lrp->ntop) {
+		log_top_t *tp = lrp->top + lrp->replay++;
+
+		if (tp->table == lrp->ntables)
+			continue;	/* printed in this table */
+		tp->table = lrp->ntables;
+		*rp = tp->rec;
+		rp->kind = LOG_HOG;
+		rp->when = lrp->when;
+		return rp->kind;
+	}
+	lrp->replay = -1;
+
+	while (getline(&lrp->line, &lrp->linesz, lrp->fp) >= 0) {
+		char *line = lrp->line;
+		char *p;
+
+		if ((p = strstr(line, " - loadavg ")) != NULL) {
+			struct tm tm;
+
+			lrp->in_hogs = lrp->in_skipped = 0;
+			memset(&tm, 0, sizeof(tm));
+			while (*line == '\n')
+				line++;
+			if (strptime(line, "%c", &tm) == NULL)
+				continue;
+			tm.tm_isdst = -1;
+			lrp->when = mktime(&tm);
+			rp->when = lrp->when;
+			if (strstr(p, "; slices ") != NULL) {
+				/* A -Z tick: outer loop, and not hogs */
+				lrp->in_skipped = 1;
+				log_top_prune(lrp, 1);
+				rp->kind = LOG_OUTER;
+				return rp->kind;
+			}
+			/* Rows of the prior table not in it are gone */
+			log_top_prune(lrp, 0);
+			lrp->ntables++;
+			rp->lavg = rp->cpu_load = rp->mem_load = 0;
+			rp->mem_pres = 0;
+			sscanf(p, " - loadavg %lf; CPU load %lf%%; "
+				"Mem load %lf%%; Mem pres %d", &rp->lavg,
+				&rp->cpu_load, &rp->mem_load, &rp->mem_pres);
+			rp->cpu_load /= 100;
+			rp->mem_load /= 100;
+			rp->kind = LOG_HEADER;
+			return rp->kind;
+		}
+		if (isdigit(line[0])) {
+			lrp->in_hogs = lrp->in_skipped = 0;
+			log_top_prune(lrp, 1);
+			rp->kind = LOG_OUTER;
+			rp->when = lrp->when;
+			return rp->kind;
+		}
+		if (strncmp(line, "    ", 4) != 0) {
+			lrp->in_hogs = 0;
+			lrp->in_skipped = strstr(line, " - summary of ") != NULL;
+			continue;
+		}
+		if (lrp->in_skipped)
+			continue;	/* their tables' rows aren't hogs */
+		if (lrp->in_hogs && log_hog(lrp, line, rp) == 0) {
+			log_top_note(lrp, rp);
+			rp->kind = LOG_HOG;
+			rp->when = lrp->when;
+			return rp->kind;
+		}
+		if (log_change_line(lrp, line)) {	/* even if no heading */
+			if (lrp->replay >= 0)
+				return log_next(lrp, rp);
+			continue;
+		}
+		lrp->in_hogs = log_heading(lrp, line);
+	}
+	return LOG_EOF;
+}
+
+/*
+ * Fleet merge ("-U").
+ *
+ * Given the batch_top logs of many hosts (as the file operands, one
+ * file per host, named for that host, as in "web17.log" or
+ * "web17.log.xz"), merge them into fleet wide rollups:
+ *
+ *  - by host: busy episodes, minutes busy, and peak loadavg;
+ *  - by cmd: the minutes each command was a hog, on how many hosts,
+ *    and its peak mcpus - which binaries caused the most overload;
+ *  - by minute: the minutes in which the most hosts were busy - did
+ *    they all spike at 02:00?
+ *
+ * Each file is decoded by one thread (up to FLEET_MAXTHREADS at a
+ * time), streaming through it record by record, into per host counts
+ * and one shared count of hosts busy in each minute, so memory grows
+ * with the number of distinct hosts, commands and busy minutes, not
+ * with the size of the logs.  A busy cycle counts for the time since the
+ * prior header in the same episode (or, for the first cycle of an
+ * episode, as long as that host's last cycle), up to FLEET_MAXCYCLE.
+ * The by cmd and by minute lists show at most -n entries.
+ */
+
+#define FLEET_MAXTHREADS 64	/* max files decoded at once */
+#define FLEET_MAXCYCLE 3600	/* max secs counted for one cycle */
+
+typedef struct {
+	char *name;			/* command name, or NULL if empty */
+	double hog_secs;		/* secs this cmd was a hog */
+	unsigned max_mcpus;		/* peak mcpus */
+	int hosts;			/* hosts it was a hog on */
+	time_t last_when;		/* header time last counted */
+} fleet_comm_t;
+
+typedef struct {
+	fleet_comm_t *tab;		/* open addressing hash on name */
+	uint32_t size;			/* power of 2 */
+	uint32_t n;			/* number used */
+} fleet_comms_t;
+
+typedef struct {
+	const char *path;		/* log file */
+	char name[64];			/* host name, from path */
+	long episodes;			/* busy episodes */
+	double busy_secs;		/* secs busy */
+	double max_lavg;		/* peak loadavg */
+	time_t first, last;		/* first and last header times */
+	fleet_comms_t comms;		/* this host's hogs */
+} fleet_host_t;
+
+fleet_host_t *fleet_hosts;
+int fleet_nhosts;
+int fleet_next;			/* next fleet_hosts[] to decode */
+pthread_mutex_t fleet_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Hosts busy in a minute */
+typedef struct {
+	time_t minute;			/* as time / 60 */
+	int hosts;			/* hosts busy, 0 if slot empty */
+} fleet_minute_t;
+
+fleet_minute_t *fleet_minutes;		/* open addressing hash on minute */
+uint32_t fleet_minutes_size;		/* power of 2 */
+uint32_t fleet_nminutes;		/* number used */
+
+/* Find, or add, entry for name in fcp. */
+
+fleet_comm_t *fleet_comm_get(fleet_comms_t *fcp, const char *name)
+{
+	uint32_t h;
+	fleet_comm_t *ep;
+
+	if (2 * (fcp->n + 1) > fcp->size) {
+		fleet_comms_t bigger;
+		uint32_t i;
+
+		bigger.size = fcp->size ? 2 * fcp->size : 64;
+		bigger.n = 0;
+		if ((bigger.tab = calloc(bigger.size, sizeof(*bigger.tab))) == NULL)
+			perror_exit("calloc", "fleet comms");
+		for (i = 0; i < fcp->size; i++) {
+			if (fcp->tab[i].name == NULL)
+				continue;
+			h = comm_fnv1a(fcp->tab[i].name, strlen(fcp->tab[i].name));
+			while (bigger.tab[h & (bigger.size - 1)].name != NULL)
+				h++;
+			bigger.tab[h & (bigger.size - 1)] = fcp->tab[i];
+			bigger.n++;
+		}
+		free(fcp->tab);
+		*fcp = bigger;
+	}
+
+	h = comm_fnv1a(name, strlen(name));
+	for (;; h++) {
+		ep = fcp->tab + (h & (fcp->size - 1));
+		if (ep->name == NULL)
+			break;
+		if (strcmp(ep->name, name) == 0)
+			return ep;
+	}
+	if ((ep->name = strdup(name)) == NULL)
+		perror_exit("strdup", "fleet comm");
+	fcp->n++;
+	return ep;
+}
+
+/* Return slot for minute in fleet_minutes[], empty if not there */
+
+fleet_minute_t *fleet_minute_slot(fleet_minute_t *tab, uint32_t size,
+		time_t minute)
+{
+	uint32_t h = (uint32_t) minute * 2654435761u;	/* Knuth's multiplier */
+
+	for (;; h++) {
+		fleet_minute_t *mp = tab + (h & (size - 1));
+
+		if (mp->hosts == 0 || mp->minute == minute)
+			return mp;
+	}
+}
+
+/*
+ * Note that one more host was busy in minutes first .. last.  A host's
+ * minutes are counted in increasing order, so none is counted twice.
+ */
+
+void fleet_add_minutes(time_t first, time_t last)
+{
+	pthread_mutex_lock(&fleet_lock);
+	for (; first <= last; first++) {
+		fleet_minute_t *mp;
+
+		if (2 * (fleet_nminutes + 1) > fleet_minutes_size) {
+			uint32_t size = fleet_minutes_size ?
+				2 * fleet_minutes_size : 4096;
+			fleet_minute_t *tab = calloc(size, sizeof(*tab));
+			uint32_t i;
+
+			if (tab == NULL)
+				perror_exit("calloc", "fleet minutes");
+			for (i = 0; i < fleet_minutes_size; i++)
+				if (fleet_minutes[i].hosts)
+					*fleet_minute_slot(tab, size,
+						fleet_minutes[i].minute) =
+						fleet_minutes[i];
+			free(fleet_minutes);
+			fleet_minutes = tab;
+			fleet_minutes_size = size;
+		}
+		mp = fleet_minute_slot(fleet_minutes, fleet_minutes_size, first);
+		if (mp->hosts++ == 0) {
+			mp->minute = first;
+			fleet_nminutes++;
+		}
+	}
+	pthread_mutex_unlock(&fleet_lock);
+}
+
+/* Decode one host's log, adding it up in *fhp. */
+
+void fleet_decode(fleet_host_t *fhp)
+{
+	log_reader_t lr;
+	log_rec_t rec;
+	int in_episode = 0;
+	time_t prev_when = 0;		/* prior header in this episode */
+	time_t last_minute = -1;	/* last busy minute counted */
+	double cycle = 0;		/* secs of current cycle */
+
+	log_open(&lr, fhp->path);
+	while (log_next(&lr, &rec) != LOG_EOF) {
+		fleet_comm_t *ep;
+
+		switch (rec.kind) {
+		case LOG_OUTER:
+			in_episode = 0;
+			break;
+		case LOG_HEADER:
+			if (!in_episode) {
+				in_episode = 1;
+				fhp->episodes++;
+			} else if (rec.when > prev_when) {
+				cycle = min(rec.when - prev_when, FLEET_MAXCYCLE);
+			}
+			prev_when = rec.when;
+			fhp->busy_secs += cycle;
+			if (rec.lavg > fhp->max_lavg)
+				fhp->max_lavg = rec.lavg;
+			if (fhp->first == 0)
+				fhp->first = rec.when;
+			fhp->last = rec.when;
+			if (rec.when / 60 > last_minute) {
+				time_t from = (rec.when - (time_t) cycle) / 60;
+
+				if (from <= last_minute)
+					from = last_minute + 1;
+				fleet_add_minutes(from, rec.when / 60);
+				last_minute = rec.when / 60;
+			}
+			break;
+		case LOG_HOG:
+			ep = fleet_comm_get(&fhp->comms, rec.comm);
+			if (ep->last_when != rec.when) {
+				ep->hog_secs += cycle;
+				ep->last_when = rec.when;
+			}
+			if (rec.has[M_CPU] && rec.val[M_CPU] > ep->max_mcpus)
+				ep->max_mcpus = rec.val[M_CPU];
+			break;
+		}
+	}
+	log_close(&lr);
+}
+
+void *fleet_worker(void *arg)
+{
+	(void) arg;
+	for (;;) {
+		int i;
+
+		pthread_mutex_lock(&fleet_lock);
+		i = fleet_next++;
+		pthread_mutex_unlock(&fleet_lock);
+		if (i >= fleet_nhosts)
+			return NULL;
+		fleet_decode(fleet_hosts + i);
+	}
+}
+
+int fleet_host_cmp(const void *p1, const void *p2)
+{
+	const fleet_host_t *hp1 = p1;
+	const fleet_host_t *hp2 = p2;
+
+	return (hp2->busy_secs > hp1->busy_secs) -
+		(hp2->busy_secs < hp1->busy_secs);
+}
+
+int fleet_comm_cmp(const void *p1, const void *p2)
+{
+	const fleet_comm_t *ep1 = p1;
+	const fleet_comm_t *ep2 = p2;
+
+	return (ep2->hog_secs > ep1->hog_secs) -
+		(ep2->hog_secs < ep1->hog_secs);
+}
+
+/* Sort fleet_minute_t's most hosts first */
+
+int fleet_minute_cmp(const void *p1, const void *p2)
+{
+	const fleet_minute_t *mp1 = p1;
+	const fleet_minute_t *mp2 = p2;
+
+	if (mp1->hosts != mp2->hosts)
+		return mp2->hosts - mp1->hosts;
+	return (mp1->minute > mp2->minute) - (mp1->minute < mp2->minute);
+}
+
+/* Format time t as "%c" local time, in static buffer */
+
+const char *fmt_time(time_t t)
+{
+	static char tmbuf[128];
+	struct tm *tmp;
+
+	if ((tmp = localtime(&t)) == NULL)
+		perror_exit("localtime", NULL);
+	strftime(tmbuf, sizeof(tmbuf), "%c", tmp);
+	return tmbuf;
+}
+
+/*
+ * Set host name from log path: its basename, less a trailing ".log",
+ * ".log.<ext>" (as in ".log.xz"), ".xz" or ".gz".
+ */
+
+void fleet_host_name(fleet_host_t *fhp)
+{
+	const char *base = strrchr(fhp->path, '/');
+	char *p;
+
+	snprintf(fhp->name, sizeof(fhp->name), "%s", base ? base + 1 : fhp->path);
+	if ((p = strrchr(fhp->name, '.')) == NULL || p == fhp->name)
+		return;
+	if (strcmp(p, ".log") == 0)
+		*p = '\0';
+	else if (p - fhp->name > 4 && strncmp(p - 4, ".log", 4) == 0)
+		p[-4] = '\0';
+	else if (strcmp(p, ".xz") == 0 || strcmp(p, ".gz") == 0)
+		*p = '\0';
+}
+
+int fleet_merge(int nfiles, char **files)
+{
+	pthread_t threads[FLEET_MAXTHREADS];
+	fleet_comms_t comms;		/* all hosts' hogs */
+	int nthreads, nminutes;
+	time_t first = 0, last = 0;
+	size_t i, j;
+	int h;
+
+	if (nfiles == 0) {
+		fprintf(stderr, "%s: -U requires log files to merge\n", cmd);
+		show_usage_and_exit();
+	}
+	if ((fleet_hosts = calloc(nfiles, sizeof(*fleet_hosts))) == NULL)
+		perror_exit("calloc", "fleet hosts");
+	fleet_nhosts = nfiles;
+	for (h = 0; h < nfiles; h++) {
+		fleet_hosts[h].path = files[h];
+		fleet_host_name(fleet_hosts + h);
+	}
+
+	nthreads = min(nfiles, FLEET_MAXTHREADS);
+	for (h = 0; h < nthreads; h++)
+		if ((errno = pthread_create(threads + h, NULL, fleet_worker,
+				NULL)) != 0)
+			perror_exit("pthread_create", NULL);
+	for (h = 0; h < nthreads; h++)
+		pthread_join(threads[h], NULL);
+
+	/* Merge the hosts' hogs */
+	memset(&comms, 0, sizeof(comms));
+	for (h = 0; h < nfiles; h++) {
+		fleet_host_t *fhp = fleet_hosts + h;
+
+		for (i = 0; i < fhp->comms.size; i++) {
+			fleet_comm_t *hep = fhp->comms.tab + i;
+			fleet_comm_t *ep;
+
+			if (hep->name == NULL)
+				continue;
+			ep = fleet_comm_get(&comms, hep->name);
+			ep->hog_secs += hep->hog_secs;
+			ep->hosts++;
+			if (hep->max_mcpus > ep->max_mcpus)
+				ep->max_mcpus = hep->max_mcpus;
+			free(hep->name);
+		}
+		free(fhp->comms.tab);
+		if (fhp->first && (first == 0 || fhp->first < first))
+			first = fhp->first;
+		if (fhp->last > last)
+			last = fhp->last;
+	}
 
-		dsp->prev_time_in_queue = cur_time_in_queue;
+	/* Compact out the empty minute slots, then sort what's left */
+	nminutes = 0;
+	for (i = 0; i < fleet_minutes_size; i++)
+		if (fleet_minutes[i].hosts)
+			fleet_minutes[nminutes++] = fleet_minutes[i];
+	if (nminutes > 0)
+		qsort(fleet_minutes, nminutes, sizeof(*fleet_minutes),
+			fleet_minute_cmp);
+
+	printf("Fleet of %d hosts", nfiles);
+	if (first) {
+		printf(", busy from %s", fmt_time(first));
+		printf(" to %s", fmt_time(last));
+	}
+	printf("\n\nBy host (most busy first):\n");
+	printf("    %16s  %8s  %10s  %8s\n", "host", "episodes", "busymins",
+		"maxlavg");
+	qsort(fleet_hosts, nfiles, sizeof(*fleet_hosts), fleet_host_cmp);
+	for (h = 0; h < nfiles; h++)
+		printf("    %16s  %8ld  %10.1f  %8.2f\n", fleet_hosts[h].name,
+			fleet_hosts[h].episodes, fleet_hosts[h].busy_secs / 60,
+			fleet_hosts[h].max_lavg);
+
+	printf("\nBy cmd (most hog minutes first):\n");
+	printf("    %16s  %10s  %8s  %10s\n", "cmd", "hogmins", "hosts",
+		"maxmcpus");
+	/* Compact out the empty hash slots, then sort what's left */
+	for (i = j = 0; i < comms.size; i++)
+		if (comms.tab[i].name != NULL)
+			comms.tab[j++] = comms.tab[i];
+	qsort(comms.tab, j, sizeof(*comms.tab), fleet_comm_cmp);
+	for (i = 0; i < j && (long) i < val_n; i++) {
+		printf("    %16s  %10.1f  %8d  %10u\n", comms.tab[i].name,
+			comms.tab[i].hog_secs / 60, comms.tab[i].hosts,
+			comms.tab[i].max_mcpus);
 	}
 
-	prev_now = now;
-	argz_stringify(argz, argz_len, ' ');
-	return argz;
+	printf("\nBy minute (most hosts busy first):\n");
+	printf("    %24s  %8s\n", "minute", "hosts");
+	for (h = 0; h < nminutes && h < val_n; h++)
+		printf("    %24s  %8d\n", fmt_time(fleet_minutes[h].minute * 60),
+			fleet_minutes[h].hosts);
+
+	flush_output();
+	return 0;
 }
 
-void show_hogs(task_usages_t prior, task_usages_t latest)
+/*
+ * Columnar archive ("-E" and "-V").
+ *
+ * "-E archive logfile ..." converts batch_top logs (one per host, as
+ * for -U) into one self contained columnar file, holding one row per
+ * hogs table row: its time, host, pid, cmd and each metric.  Missing
+ * metrics (columns not shown in that log) are stored as 0.
+ *
+ * Rows are stored in chunks of COL_ROWS.  Within a chunk, each column
+ * is stored separately, in a block holding either its values less the
+ * chunk minimum ("frame of reference") or the zigzag encoded change
+ * from the row before ("delta", good for times), whichever is smaller,
+ * bit packed to just the width needed.  The host and cmd strings are
+ * kept in a dictionary, and stored as their dictionary ids.
+ *
+ * After the chunks comes a footer, with the column names, dictionary,
+ * and for each chunk its row count and, for each column, its block's
+ * offset, length, and min and max values.  The file ends with the
+ * footer's offset and COL_MAGIC.  All integers are in host byte order.
+ *
+ * "-V query archive" scans an archive.  The query is a comma separated
+ * list of columns to show, optionally followed by ':' and a comma
+ * separated list of conditions, each of the form column=value,
+ * column>=value or column<=value, as in:
+ *
+ *	batch_top -V time,host,pid,mcpus:cmd=java,mcpus>=500 fleet.btc
+ *
+ * Values for host and cmd are names; for time are seconds since the
+ * epoch.  Chunks whose min and max show no row could match are
+ * skipped without reading them, and only the column blocks needed
+ * are read from the others.
+ *
+ * The reader maps the archive's columns to its own by name, so an
+ * archive written with other metrics can still be read: its columns
+ * this binary doesn't know are ignored, and ours it lacks read as 0,
+ * shown as "-".
+ */
+
+#define COL_MAGIC "btcol\0\1\n"	/* 8 bytes, at start and end */
+#define COL_ROWS 4096		/* rows per chunk */
+
+enum { COL_TIME, COL_HOST, COL_PID, COL_COMM, COL_METRIC0 };
+#define COL_NCOLS (COL_METRIC0 + NMETRICS)
+#define COL_MAXFILECOLS 1024	/* max columns in an archive read */
+
+enum { COL_ENC_FOR, COL_ENC_DELTA };
+
+typedef struct {
+	uint64_t off;			/* offset of block in file */
+	uint32_t len;			/* bytes in block */
+	int64_t min, max;		/* of values in block */
+} col_block_t;
+
+const char *archive_path = NULL;	/* -E path to write archive */
+const char *archive_query = NULL;	/* -V query of archive */
+
+const char *col_name(int c)
 {
-	int ni, nj;		/* number elements in prior, latest */
-	int i, j;		/* scans ni, nj */
-	join_on_pid_t *joinp;	/* join on pid, with delta cpusecs */
-	join_on_pid_t *jp;	/* scans joinp[] */
-	join_on_pid_t *jpend;	/* end (one past last valid entry) of joinp */
-	join_on_pid_t *jpmax;	/* at most val_n above joinp */
-	int got_some;		/* one or more CPU or RAM hogs found */
+	static const char *names[] = { "time", "host", "pid", "cmd" };
 
-	ni = prior.tu_nelem;
-	nj = latest.tu_nelem;
-	if ((joinp = malloc(sizeof(*joinp) * max(ni, nj))) == NULL)
-		perror_exit("malloc", "joinp");
+	return c < COL_METRIC0 ? names[c] : metrics[c - COL_METRIC0].name;
+}
 
-	/* Join prior and latest on pid field, into joinp, */
-	i = j = 0;
-	jp = joinp;
+int col_is_dict(int c)
+{
+	return c == COL_HOST || c == COL_COMM;
+}
 
-	while (i < ni && j < nj) {
-		if (j > 0 && PID(latest, j-1) > PID(latest, j)) {
-			fprintf(stderr, "/proc pids out of order - fail\n");
-			fprintf(stderr,
-				"j %d, nj %d, j-1 pid %d, j pid %d\n",
-				j, nj, PID(latest, j-1), PID(latest, j));
-			exit(9);
-		}
-		if (PID(prior, i) == PID(latest, j)) {
-			jp->i = i++;
-			jp->j = j++;
-			jp++;
-		} else if (PID(prior, i) < PID(latest, j)) {
-			i++;
-		} else {
-			j++;
+/* Dictionary of host and cmd names */
+
+char **dict_names;		/* dict_names[id] is name of id */
+uint32_t dict_n, dict_max;	/* number used, allocated in dict_names */
+int32_t *dict_tab;		/* open addressing hash of ids, -1 if empty */
+uint32_t dict_size;		/* power of 2 size of dict_tab[] */
+
+/* Return id of name, adding it if add is set, or -1 if not found. */
+
+int32_t dict_id(const char *name, int add)
+{
+	uint32_t h, i;
+
+	if (add && 2 * (dict_n + 1) > dict_size) {
+		dict_size = dict_size ? 2 * dict_size : 256;
+		free(dict_tab);
+		if ((dict_tab = malloc(dict_size * sizeof(*dict_tab))) == NULL)
+			perror_exit("malloc", "dictionary");
+		memset(dict_tab, -1, dict_size * sizeof(*dict_tab));
+		for (i = 0; i < dict_n; i++) {
+			h = comm_fnv1a(dict_names[i], strlen(dict_names[i]));
+			while (dict_tab[h & (dict_size - 1)] >= 0)
+				h++;
+			dict_tab[h & (dict_size - 1)] = i;
 		}
 	}
 
-	jpend = jp;
+	if (dict_size == 0)
+		return -1;
+	h = comm_fnv1a(name, strlen(name));
+	for (;; h++) {
+		int32_t id = dict_tab[h & (dict_size - 1)];
 
-	/* Set joinp's cpumsecs, rssmrams, diskwait fields. */
-	for (jp = joinp; jp < jpend; jp++) {
-		uint64_t prior_cpumsecs, latest_cpumsecs;
-		uint64_t prior_diskwait, latest_diskwait;
+		if (id < 0)
+			break;
+		if (strcmp(dict_names[id], name) == 0)
+			return id;
+	}
+	if (!add)
+		return -1;
+
+	if (dict_n == dict_max) {
+		dict_max = dict_max ? 2 * dict_max : 256;
+		dict_names = realloc(dict_names, dict_max * sizeof(*dict_names));
+		if (dict_names == NULL)
+			perror_exit("realloc", "dictionary");
+	}
+	if ((dict_names[dict_n] = strdup(name)) == NULL)
+		perror_exit("strdup", "dictionary");
+	dict_tab[h & (dict_size - 1)] = dict_n;
+	return dict_n++;
+}
 
-		prior_cpumsecs = prior.tu_array[jp->i].cpumsecs;
-		latest_cpumsecs = latest.tu_array[jp->j].cpumsecs;
+/* Number of bits needed to hold x */
 
-		prior_diskwait = prior.tu_array[jp->i].diskwait;
-		latest_diskwait = latest.tu_array[jp->j].diskwait;
+int col_bits(uint64_t x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
 
-		jp->cpumsecs = (latest_cpumsecs - prior_cpumsecs) / val_t;
-		jp->cpumsecs /= ncpus;
-		jp->rssmrams = RAM(latest, jp->j);
-		jp->diskwait = (latest_diskwait - prior_diskwait) / val_t;
-		jp->showme = 0;
-	}
+uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
 
-	/*
-	 * Show up to first val_n with cpumsecs > val_q, rssmrams > val_r,
-	 * or diskwait > val_b.
-	 */
-	jpmax = joinp + min(val_n, jpend - joinp);
+int64_t unzigzag(uint64_t u)
+{
+	return (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+}
 
-	got_some = 0;
+/*
+ * Encode n values v[] into block buf[] (2 header words, then packed
+ * values), setting *bp min and max.  Returns length of block in words.
+ */
 
-	/*
-	 * Sort the joined results by each of rssmrams (flag_M), cpumsecs
-	 * (flag_C) or block I/O diskwait (flag_B) asked for.  Sort cpumsecs
-	 * last, so that if multiple asked for, results are displayed in
-	 * descending order of CPU usage.
-	 */
+int col_encode(const int64_t *v, int n, uint64_t *buf, col_block_t *bp)
+{
+	uint64_t maxdelta = 0;
+	int enc, width, nvals, i;
+	int64_t base;
+	uint64_t *out = buf + 2;
+
+	bp->min = bp->max = v[0];
+	for (i = 1; i < n; i++) {
+		uint64_t d = zigzag(v[i] - v[i - 1]);
+
+		if (d > maxdelta)
+			maxdelta = d;
+		if (v[i] < bp->min)
+			bp->min = v[i];
+		if (v[i] > bp->max)
+			bp->max = v[i];
+	}
 
-	 if (flag_M) {
-		qsort(joinp, jpend - joinp, sizeof(*joinp), rssmrams_cmp);
-		for (jp = joinp; jp < jpmax; jp++) {
-			if (jp->rssmrams >= val_r) {
-				jp->showme = 1;
-				got_some = 1;
-			}
-		}
+	width = col_bits((uint64_t) bp->max - (uint64_t) bp->min);
+	enc = COL_ENC_FOR;
+	base = bp->min;
+	nvals = n;
+	if (col_bits(maxdelta) < width) {
+		width = col_bits(maxdelta);
+		enc = COL_ENC_DELTA;
+		base = v[0];
+		nvals = n - 1;
 	}
-	if (flag_B) {
-		qsort(joinp, jpend - joinp, sizeof(*joinp), diskwait_cmp);
-		for (jp = joinp; jp < jpmax; jp++) {
-			if (jp->diskwait >= val_b) {
-				jp->showme = 1;
-				got_some = 1;
-			}
-		}
+
+	memset(out, 0, (((size_t) nvals * width + 63) / 64) * sizeof(*out));
+	for (i = 0; i < nvals; i++) {
+		uint64_t u;
+		size_t bit = (size_t) i * width;
+		int s = bit & 63;
+
+		if (enc == COL_ENC_FOR)
+			u = (uint64_t) v[i] - (uint64_t) base;
+		else
+			u = zigzag(v[i + 1] - v[i]);
+		if (width == 0)
+			continue;
+		out[bit >> 6] |= u << s;
+		if (s + width > 64)
+			out[(bit >> 6) + 1] |= u >> (64 - s);
 	}
-	if (flag_C) {
-		qsort(joinp, jpend - joinp, sizeof(*joinp), cpumsecs_cmp);
-		for (jp = joinp; jp < jpmax; jp++) {
-			if (jp->cpumsecs >= val_q) {
-				jp->showme = 1;
-				got_some = 1;
-			}
+	buf[0] = enc | (width << 8);
+	buf[1] = base;
+	return 2 + ((size_t) nvals * width + 63) / 64;
+}
+
+/* Decode block buf[] of n values into v[] */
+
+void col_decode(const uint64_t *buf, int n, int64_t *v)
+{
+	int enc = buf[0] & 0xff;
+	int width = (buf[0] >> 8) & 0xff;
+	int64_t base = buf[1];
+	const uint64_t *in = buf + 2;
+	uint64_t mask = width < 64 ? (1ULL << width) - 1 : ~0ULL;
+	int i, nvals = enc == COL_ENC_FOR ? n : n - 1;
+
+	if (enc == COL_ENC_DELTA)
+		v[0] = base;
+	for (i = 0; i < nvals; i++) {
+		uint64_t u = 0;
+		size_t bit = (size_t) i * width;
+		int s = bit & 63;
+
+		if (width) {
+			u = in[bit >> 6] >> s;
+			if (s + width > 64)
+				u |= in[(bit >> 6) + 1] << (64 - s);
+			u &= mask;
 		}
+		if (enc == COL_ENC_FOR)
+			v[i] = (uint64_t) base + u;
+		else
+			v[i + 1] = v[i] + unzigzag(u);
 	}
+}
 
-	/*
-	 * If no tasks have high CPU, RAM or DISKWAIT, say so briefly, but
-	 * skip printing header for empty list.  We left the date time line
-	 * without a trailing newline, so add one, somehow.
-	 */
+/* Archive being written by archive_convert() */
 
-	if (got_some == 0) {
-		printf(" - no individual tasks are hogs.\n");
-		goto done;
-	} else {
-		printf("\n");
+FILE *col_fp;
+uint64_t col_off;			/* bytes written so far */
+int64_t col_rows[COL_NCOLS][COL_ROWS];	/* rows of current chunk */
+int col_nrows;				/* rows in current chunk */
+col_block_t *col_dir;			/* col_nfile blocks per chunk */
+uint32_t *col_chunk_rows;		/* rows in each chunk */
+uint32_t col_nchunks, col_maxchunks;
+uint32_t col_nfile = COL_NCOLS;		/* columns in archive */
+int col_map[COL_NCOLS];			/* archive column of ours, or -1 */
+
+void col_write(const void *p, size_t len)
+{
+	if (fwrite(p, 1, len, col_fp) != len)
+		perror_exit("fwrite", archive_path);
+	col_off += len;
+}
+
+/* Write out current chunk of rows, and note where in col_dir[] */
+
+void col_flush_chunk()
+{
+	static uint64_t buf[2 + COL_ROWS];
+	int c;
+
+	if (col_nrows == 0)
+		return;
+	if (col_nchunks == col_maxchunks) {
+		col_maxchunks = col_maxchunks ? 2 * col_maxchunks : 64;
+		col_dir = realloc(col_dir, col_maxchunks * COL_NCOLS *
+			sizeof(*col_dir));
+		col_chunk_rows = realloc(col_chunk_rows, col_maxchunks *
+			sizeof(*col_chunk_rows));
+		if (col_dir == NULL || col_chunk_rows == NULL)
+			perror_exit("realloc", "chunk directory");
 	}
+	for (c = 0; c < COL_NCOLS; c++) {
+		col_block_t *bp = col_dir + col_nchunks * COL_NCOLS + c;
+		int nwords = col_encode(col_rows[c], col_nrows, buf, bp);
 
-	printf("    %8s  %16s  %10s  %10s  %10s  %-s\n",
-		"pid", "cmd", "mcpus", "mrams", "diskwait", "cmdline");
+		bp->off = col_off;
+		bp->len = nwords * sizeof(*buf);
+		col_write(buf, bp->len);
+	}
+	col_chunk_rows[col_nchunks++] = col_nrows;
+	col_nrows = 0;
+}
 
-	for (jp = joinp; jp < jpend; jp++) {
-		if (jp->showme) {
-			printf("    %8d  %16s  %10d  %10d  %10u  %-.*s\n",
-				PID(latest, jp->j),
-				CMD(latest, jp->j),
-				jp->cpumsecs,
-				jp->rssmrams,
-				jp->diskwait,
-				szcmdlinebuf,
-				get_cmdline(PID(latest, jp->j)));
-		}
+void col_write_u32(uint32_t u)
+{
+	col_write(&u, sizeof(u));
+}
+
+/* Write footer: columns, dictionary, chunk directory, then trailer */
+
+void col_write_footer()
+{
+	uint64_t footer_off = col_off;
+	uint32_t i;
+	int c;
+
+	col_write_u32(COL_NCOLS);
+	for (c = 0; c < COL_NCOLS; c++) {
+		uint32_t len = strlen(col_name(c));
+
+		col_write_u32(len);
+		col_write(col_name(c), len);
 	}
+	col_write_u32(dict_n);
+	for (i = 0; i < dict_n; i++) {
+		uint32_t len = strlen(dict_names[i]);
 
-done:
-	free(joinp);
+		col_write_u32(len);
+		col_write(dict_names[i], len);
+	}
+	col_write_u32(col_nchunks);
+	col_write(col_chunk_rows, col_nchunks * sizeof(*col_chunk_rows));
+	col_write(col_dir, (size_t) col_nchunks * COL_NCOLS * sizeof(*col_dir));
+	col_write(&footer_off, sizeof(footer_off));
+	col_write(COL_MAGIC, 8);
 }
 
-void show_task_usages(task_usages_t prior, task_usages_t latest,
-		double lavg, double cpu_load, double mem_load,
-		int mem_pres, int cnt_php, int cnt_httpd, char *dsk_str)
+int archive_convert(int nfiles, char **files)
 {
-	time_t now;
-	struct tm *tmp;
-	char tmbuf[128];
-	char php_str[128];
-	char httpd_str[128];
+	long nrows = 0;
+	int f, m;
 
-	now = time(NULL);
-	if ((tmp = localtime(&now)) == NULL)
-		perror_exit("localtime", NULL);
-	if (strftime(tmbuf, sizeof(tmbuf), "%c", tmp) == 0) {
-		fprintf(stderr, "strftime returned zero.\n");
-		exit(9);
+	if (nfiles == 0) {
+		fprintf(stderr, "%s: -E requires log files to convert\n", cmd);
+		show_usage_and_exit();
+	}
+	if ((col_fp = fopen(archive_path, "w")) == NULL)
+		perror_exit("fopen", archive_path);
+	col_write(COL_MAGIC, 8);
+
+	for (f = 0; f < nfiles; f++) {
+		fleet_host_t host;
+		log_reader_t lr;
+		log_rec_t rec;
+		int32_t host_id;
+
+		memset(&host, 0, sizeof(host));
+		host.path = files[f];
+		fleet_host_name(&host);
+		host_id = dict_id(host.name, 1);
+
+		log_open(&lr, files[f]);
+		while (log_next(&lr, &rec) != LOG_EOF) {
+			if (rec.kind != LOG_HOG)
+				continue;
+			col_rows[COL_TIME][col_nrows] = rec.when;
+			col_rows[COL_HOST][col_nrows] = host_id;
+			col_rows[COL_PID][col_nrows] = rec.pid;
+			col_rows[COL_COMM][col_nrows] = dict_id(rec.comm, 1);
+			for (m = 0; m < NMETRICS; m++)
+				col_rows[COL_METRIC0 + m][col_nrows] =
+					rec.has[m] ? rec.val[m] : 0;
+			nrows++;
+			if (++col_nrows == COL_ROWS)
+				col_flush_chunk();
+		}
+		log_close(&lr);
 	}
+	col_flush_chunk();
+	col_write_footer();
+	if (fclose(col_fp) != 0)
+		perror_exit("fclose", archive_path);
+
+	printf("%s: %ld rows from %d logs in %u chunks, %llu bytes\n",
+		archive_path, nrows, nfiles, col_nchunks,
+		(unsigned long long) col_off);
+	flush_output();
+	return 0;
+}
 
-	if (flag_P)
-		sprintf(php_str, "; cnt PHP %2d", cnt_php);
-	else
-		php_str[0] = '\0';
+/* A condition of a query: lo <= col <= hi */
 
-	if (flag_H)
-		sprintf(httpd_str, "; cnt httpd %2d", cnt_httpd);
-	else
-		httpd_str[0] = '\0';
+typedef struct {
+	int col;
+	int64_t lo, hi;
+} col_cond_t;
 
-	/* This outputs no trailing newline - see show_hogs() */
-	printf("\n%s - loadavg %5.2f; CPU load %3.0f%%; "
-		"Mem load %2.0f%%; Mem pres %4d%s%s%s",
-		tmbuf, lavg, cpu_load * (double) 100,
-		mem_load * (double) 100, mem_pres, php_str, httpd_str, dsk_str);
+void bad_query(const char *msg, const char *at)
+{
+	fprintf(stderr, "%s: -V query %s: %s\n", cmd, msg, at);
+	exit(1);
+}
 
-	show_hogs(prior, latest);
+/* Return column number named name (len chars), or exit if none */
 
-	fflush(stdout);
+int col_lookup(const char *name, size_t len)
+{
+	int c;
+
+	for (c = 0; c < COL_NCOLS; c++)
+		if (strlen(col_name(c)) == len &&
+				strncmp(col_name(c), name, len) == 0)
+			return c;
+	bad_query("no such column", name);
+	return -1;
 }
 
-void free_task_usages(task_usages_t t)
+/* Width of column c in query output */
+
+int col_width(int c)
 {
-	free(t.tu_array);
+	return c == COL_TIME ? 24 : col_is_dict(c) ? 16 : 10;
 }
 
 /*
- * Read the first load average (over 1 minute) from /proc/loadavg.
+ * Read archive footer at fd, setting col_nfile, col_map[], col_dir,
+ * col_chunk_rows and dict.
  */
 
-double read_loadavg()
+void col_read_footer(int fd, const char *path)
 {
-	static int fd = -1;
-	char buf[32];
-	const char *loadfile = "/proc/loadavg";
+	struct stat st;
+	char trailer[16];
+	uint64_t footer_off;
+	char *buf, *p, *end;
+	uint32_t n, len, i;
+	int c;
+
+	if (fstat(fd, &st) < 0)
+		perror_exit("fstat", path);
+	if (st.st_size < 24 || pread(fd, trailer, 16, st.st_size - 16) != 16 ||
+			memcmp(trailer + 8, COL_MAGIC, 8) != 0)
+		goto bad;
+	memcpy(&footer_off, trailer, 8);
+	if (footer_off > (uint64_t) st.st_size - 16)
+		goto bad;
+	len = st.st_size - 16 - footer_off;
+	if ((buf = malloc(len)) == NULL)
+		perror_exit("malloc", path);
+	if (pread(fd, buf, len, footer_off) != (ssize_t) len)
+		perror_exit("pread", path);
+	p = buf;
+	end = buf + len;
+
+#define COL_GET(dst, sz) do {						\
+		if ((size_t) (end - p) < (size_t) (sz))			\
+			goto bad;					\
+		memcpy((dst), p, (sz));					\
+		p += (sz);						\
+	} while (0)
+
+	/* Map columns to ours by name */
+	COL_GET(&col_nfile, 4);
+	if (col_nfile == 0 || col_nfile > COL_MAXFILECOLS)
+		goto bad;
+	for (c = 0; c < COL_NCOLS; c++)
+		col_map[c] = -1;
+	for (i = 0; i < col_nfile; i++) {
+		COL_GET(&len, 4);
+		if ((size_t) (end - p) < len)
+			goto bad;
+		for (c = 0; c < COL_NCOLS; c++)
+			if (col_map[c] < 0 && len == strlen(col_name(c)) &&
+					strncmp(p, col_name(c), len) == 0)
+				col_map[c] = i;
+		p += len;
+	}
 
-	if (fd < 0) {
-		if ((fd = open(loadfile, O_RDONLY)) < 0)
-			perror_exit("open", loadfile);
-		stash_pread_fd(fd, loadfile);
+	COL_GET(&n, 4);
+	for (i = 0; i < n; i++) {
+		char name[256];
+
+		COL_GET(&len, 4);
+		if (len >= sizeof(name))
+			goto bad;
+		COL_GET(name, len);
+		name[len] = '\0';
+		dict_id(name, 1);
 	}
-	if (my_pread(fd, buf, sizeof(buf), (off_t)0) < 1)
-		perror_exit("pread", loadfile);
-	return strtod(buf, NULL);
-}
 
-int system_is_loaded(double lavg, double cpu_load, double mem_load, int mem_pres)
-{
-	return lavg > val_p || 100.*cpu_load > val_c ||
-		100.*mem_load > val_m || mem_pres > val_u;
+	COL_GET(&col_nchunks, 4);
+	if ((col_chunk_rows = malloc(col_nchunks * sizeof(*col_chunk_rows)))
+			== NULL ||
+	    (col_dir = malloc((size_t) col_nchunks * col_nfile *
+			sizeof(*col_dir))) == NULL)
+		perror_exit("malloc", path);
+	COL_GET(col_chunk_rows, col_nchunks * sizeof(*col_chunk_rows));
+	COL_GET(col_dir, (size_t) col_nchunks * col_nfile * sizeof(*col_dir));
+	for (i = 0; i < col_nchunks; i++)
+		if (col_chunk_rows[i] == 0 || col_chunk_rows[i] > COL_ROWS)
+			goto bad;
+	for (i = 0; i < col_nchunks * col_nfile; i++)
+		if (col_dir[i].len > (2 + COL_ROWS) * sizeof(uint64_t) ||
+				col_dir[i].len < 2 * sizeof(uint64_t))
+			goto bad;
+#undef COL_GET
+	free(buf);
+	return;
+bad:
+	fprintf(stderr, "%s: %s is not a batch_top archive\n", cmd, path);
+	exit(1);
 }
 
-void emit_time_marker_start()
+/* Block of our column c in chunk k of archive, or NULL if it lacks c */
+
+col_block_t *col_block(uint32_t k, int c)
 {
-	printf("%ld.", time(NULL));
+	if (col_map[c] < 0)
+		return NULL;
+	return col_dir + (size_t) k * col_nfile + col_map[c];
 }
 
-void emit_time_marker()
+/*
+ * Read and decode block of column c of chunk k into v[] (all 0 if
+ * the archive lacks c.)  The block's encoding and bit width come from
+ * the file, so check them, and that its packed values fit in the
+ * block, before decoding.  Returns number of blocks read, 1 or 0.
+ */
+
+int col_load(int fd, uint32_t k, int c, int64_t *v)
 {
-	printf("%ld.", time(NULL) % 10000);
-	fflush(stdout);
+	static uint64_t buf[2 + COL_ROWS];
+	col_block_t *bp = col_block(k, c);
+	uint32_t n = col_chunk_rows[k];
+	int enc, width;
+	uint64_t nvals;
+
+	if (bp == NULL) {
+		memset(v, 0, n * sizeof(*v));
+		return 0;
+	}
+	if (pread(fd, buf, bp->len, bp->off) != (ssize_t) bp->len)
+		perror_exit("pread", archive_path);
+	enc = buf[0] & 0xff;
+	width = (buf[0] >> 8) & 0xff;
+	nvals = enc == COL_ENC_FOR ? n : n - 1;
+	if ((enc != COL_ENC_FOR && enc != COL_ENC_DELTA) || width > 64 ||
+	    (2 + (nvals * width + 63) / 64) * sizeof(uint64_t) > bp->len) {
+		fprintf(stderr, "%s: %s is not a batch_top archive\n", cmd,
+			archive_path);
+		exit(1);
+	}
+	col_decode(buf, n, v);
+	return 1;
 }
 
-void emit_time_marker_eol()
+int query_archive(int nfiles, char **files)
 {
-	puts("");
+	static int64_t vals[COL_NCOLS][COL_ROWS];
+	static unsigned char match[COL_ROWS];
+	int show[COL_NCOLS], nshow = 0;
+	col_cond_t conds[COL_NCOLS * 2];
+	int nconds = 0;
+	const char *p, *q;
+	long nmatched = 0, chunks_read = 0, blocks_read = 0;
+	uint32_t k;
+	int fd, i, c;
+
+	if (nfiles != 1) {
+		fprintf(stderr, "%s: -V requires one archive to query\n", cmd);
+		show_usage_and_exit();
+	}
+	archive_path = files[0];
+	if ((fd = open(archive_path, O_RDONLY)) < 0)
+		perror_exit("open", archive_path);
+	col_read_footer(fd, archive_path);
+
+	/* Parse query: columns to show, then any conditions */
+	for (p = archive_query; *p && *p != ':'; p = q + (*q == ',')) {
+		q = p + strcspn(p, ",:");
+		if (nshow < COL_NCOLS)
+			show[nshow++] = col_lookup(p, q - p);
+	}
+	if (nshow == 0)
+		bad_query("shows no columns", archive_query);
+	for (p += (*p == ':'); *p; p = q + (*q == ',')) {
+		col_cond_t *cp;
+		const char *op, *val;
+		char *endp;
+
+		q = p + strcspn(p, ",");
+		op = p + strcspn(p, "<>=");
+		if (op >= q || nconds == COL_NCOLS * 2)
+			bad_query("bad condition", p);
+		cp = conds + nconds++;
+		cp->col = col_lookup(p, op - p);
+		cp->lo = INT64_MIN;
+		cp->hi = INT64_MAX;
+		val = op + (op[0] == '=' ? 1 : 2);
+		if (op[0] != '=' && op[1] != '=')
+			bad_query("bad condition", p);
+		if (col_is_dict(cp->col)) {
+			char name[256];
+
+			if (op[0] != '=')
+				bad_query("names only compare equal", p);
+			snprintf(name, sizeof(name), "%.*s", (int) (q - val), val);
+			cp->lo = cp->hi = dict_id(name, 0);
+			if (cp->lo < 0) {	/* no such name, so no match */
+				cp->lo = 1;
+				cp->hi = 0;
+			}
+			continue;
+		}
+		if (op[0] != '>')
+			cp->hi = strtoll(val, &endp, 10);
+		if (op[0] != '<')
+			cp->lo = strtoll(val, &endp, 10);
+		if (endp != q)
+			bad_query("bad condition value", p);
+	}
+
+	for (i = 0; i < nshow; i++)
+		printf("  %*s", col_width(show[i]), col_name(show[i]));
+	printf("\n");
+
+	for (k = 0; k < col_nchunks; k++) {
+		uint32_t n = col_chunk_rows[k], r;
+		int loaded[COL_NCOLS] = { 0 };
+		int any = 0;
+
+		/* Skip chunks the min/max show can't match */
+		for (i = 0; i < nconds; i++) {
+			col_block_t *bp = col_block(k, conds[i].col);
+			int64_t min = bp ? bp->min : 0, max = bp ? bp->max : 0;
+
+			if (conds[i].hi < min || conds[i].lo > max)
+				break;
+		}
+		if (i < nconds)
+			continue;
+		chunks_read++;
+
+		memset(match, 1, n);
+		for (i = 0; i < nconds; i++) {
+			int64_t *v = vals[conds[i].col];
+
+			if (!loaded[conds[i].col]) {
+				blocks_read += col_load(fd, k, conds[i].col, v);
+				loaded[conds[i].col] = 1;
+			}
+			for (r = 0; r < n; r++)
+				match[r] &= v[r] >= conds[i].lo &&
+					v[r] <= conds[i].hi;
+		}
+		for (r = 0; r < n; r++)
+			any |= match[r];
+		if (!any)
+			continue;
+
+		for (i = 0; i < nshow; i++) {
+			if (!loaded[show[i]]) {
+				blocks_read += col_load(fd, k, show[i],
+					vals[show[i]]);
+				loaded[show[i]] = 1;
+			}
+		}
+		for (r = 0; r < n; r++) {
+			if (!match[r])
+				continue;
+			nmatched++;
+			for (i = 0; i < nshow; i++) {
+				int64_t v = vals[show[i]][r];
+
+				c = show[i];
+				if (col_map[c] < 0)
+					printf("  %*s", col_width(c), "-");
+				else if (c == COL_TIME)
+					printf("  %*s", col_width(c), fmt_time(v));
+				else if (col_is_dict(c) && v >= 0 &&
+						v < (int64_t) dict_n)
+					printf("  %*s", col_width(c), dict_names[v]);
+				else
+					printf("  %*lld", col_width(c), (long long) v);
+			}
+			printf("\n");
+		}
+	}
+	printf("%ld rows; read %ld of %u chunks, %ld of %u column blocks\n",
+		nmatched, chunks_read, col_nchunks, blocks_read,
+		col_nchunks * col_nfile);
+	flush_output();
+	close(fd);
+	return 0;
 }
 
 int main(int argc, char *argv[])
@@ -1737,19 +8118,18 @@ int main(int argc, char *argv[])
 	int c;			/* most recently parsed char in argv[] */
 	useconds_t osleepusecs;	/* outer loop sleep in microseconds */
 	useconds_t isleepusecs;	/* inner loop sleep in microseconds */
+	unsigned long ncycles = 0;	/* inner loop cycles so far */
+	char optstring[128];		/* getopt() options, plus metrics' */
+	char *endp;			/* end of number parsed by strtod() */
 
 	cmd = argv[0];
-	while ((c = getopt(argc, argv, "CMBQP:H:s:t:p:c:m:u:q:r:b:n:L:d:")) != EOF) {
+	sinks[0] = stdout;
+	strcpy(optstring, "QIUP:H:E:V:s:t:p:c:m:u:z:f:y:i:n:L:A:k:G:F:S:l:w:K:Z:D:O:d:j:R:Y:");
+	metric_optstring(optstring);
+	while ((c = getopt(argc, argv, optstring)) != EOF) {
+		if (metric_option(c, optarg) || trigger_option(c, optarg))
+			continue;
 		switch (c) {
-		case 'C':			/* show CPU hogs */
-			flag_C = 1;
-			break;
-		case 'M':			/* show Memory hogs */
-			flag_M = 1;
-			break;
-		case 'B':			/* show Block I/O diskwait */
-			flag_B = 1;
-			break;
 		case 'P':			/* show cnt PHP tasks in header */
 			flag_P = strtod(optarg, NULL);
 			break;
@@ -1766,44 +8146,31 @@ int main(int argc, char *argv[])
 			if (val_t < 0.001)
 				fatal_usage("-t val < 0.001", val_t);
 			break;
-		case 'p':			/* min busy loadavg */
-			val_p = strtod(optarg, NULL);
-			if (val_p < 0.001)
-				fatal_usage("-p val < 0.001", val_p);
-			break;
-		case 'c':			/* min CPU load % */
-			val_c = strtod(optarg, NULL);
-			if (val_c < .1)
-				fatal_usage("-c val < .1%", val_c);
-			if (val_c > 100.)
-				fatal_usage("-c val > 100%", val_c);
+		case 'z':			/* max busy zone headroom */
+			val_z = strtod(optarg, NULL);
+			if (val_z < 0)
+				fatal_usage("-z val < 0", val_z);
 			break;
-		case 'm':			/* min Mem load % */
-			val_m = strtod(optarg, NULL);
-			if (val_m < .1)
-				fatal_usage("-m val < .1%", val_m);
-			if (val_m > 100.)
-				fatal_usage("-m val > 100%", val_m);
+		case 'f':			/* min capacity loss % */
+			val_f = strtod(optarg, NULL);
+			if (val_f < 0)
+				fatal_usage("-f val < 0", val_f);
+			if (val_f > 100.)
+				fatal_usage("-f val > 100%", val_f);
 			break;
-		case 'u':			/* min cpuset memory pressure */
-			val_u = strtod(optarg, NULL);
-			if (val_u < 0)
-				fatal_usage("-u val < 0", val_u);
-			break;
-		case 'q':			/* busy task milli-CPU's */
-			val_q = strtol(optarg, NULL, 10);
-			if (val_q < 1)
-				fatal_usage("-q val < 1", val_q);
-			break;
-		case 'r':			/* big rss task milli-RAM */
-			val_r = strtol(optarg, NULL, 10);
-			if (val_r < 1)
-				fatal_usage("-r val < 1", val_r);
+		case 'y':			/* CPU sysfs dir[,stat file] */
+			if ((endp = strchr(optarg, ',')) != NULL) {
+				*endp++ = '\0';
+				if (*endp == '\0')
+					fatal_usage("-y statfile empty", 0);
+				cpustat_path = endp;
+			}
+			if (*optarg == '\0')
+				fatal_usage("-y cpudir empty", 0);
+			cpufreq_root = optarg;
 			break;
-		case 'b':
-			val_b = strtol(optarg, NULL, 10);
-			if (val_b < 1)
-				fatal_usage("-b val < 1", val_b);
+		case 'i':			/* extra meminfo fields */
+			meminfo_select(optarg);
 			break;
 		case 'n':			/* max num tasks to show */
 			val_n = strtol(optarg, NULL, 10);
@@ -1815,27 +8182,126 @@ int main(int argc, char *argv[])
 			if (szcmdlinebuf < 2 || szcmdlinebuf > 1000)
 				fatal_usage("-L val not in [2, 1000]", szcmdlinebuf);
 			break;
+		case 'A':			/* heartbeat period (secs) */
+			val_A = strtol(optarg, NULL, 10);
+			if (val_A < 0)
+				fatal_usage("-A val < 0", val_A);
+			break;
+		case 'k':			/* snapshots kept in history */
+			val_k = strtol(optarg, NULL, 10);
+			if (val_k < 0)
+				fatal_usage("-k val < 0", val_k);
+			break;
+		case 'G':			/* max stalled cgroups shown */
+			val_G = strtol(optarg, NULL, 10);
+			if (val_G < 0)
+				fatal_usage("-G val < 0", val_G);
+			break;
+		case 'F':			/* syscalls counting fds */
+			val_F = strtol(optarg, NULL, 10);
+			if (val_F < 0)
+				fatal_usage("-F val < 0", val_F);
+			break;
+		case 'S':			/* max slab caches shown */
+			val_S = strtol(optarg, NULL, 10);
+			if (val_S < 0)
+				fatal_usage("-S val < 0", val_S);
+			break;
+		case 'l':			/* max lock holders shown */
+			val_l = strtol(optarg, NULL, 10);
+			if (val_l < 0)
+				fatal_usage("-l val < 0", val_l);
+			break;
+		case 'w':			/* output budget */
+			val_w = strtol(optarg, NULL, 10);
+			if (val_w < 0)
+				fatal_usage("-w val < 0", val_w);
+			break;
+		case 'K':			/* max correlated tasks shown */
+			val_K = strtol(optarg, NULL, 10);
+			if (val_K < 0)
+				fatal_usage("-K val < 0", val_K);
+			break;
+		case 'Z':			/* continuous mode slices */
+			val_Z = strtol(optarg, NULL, 10);
+			if (val_Z < 0 || val_Z > CONT_MAX_SLICES)
+				fatal_usage("-Z val not in [0, 64]", val_Z);
+			break;
+		case 'D':			/* change-only tables */
+			val_D_tol = strtod(optarg, &endp);
+			if (val_D_tol < 0)
+				fatal_usage("-D tol < 0", val_D_tol);
+			if (*endp == ',')
+				val_D_full = strtol(endp + 1, NULL, 10);
+			if (val_D_full < 1)
+				fatal_usage("-D K < 1", val_D_full);
+			break;
+		case 'O':			/* extra profile */
+			profile_add(optarg);
+			break;
 		case 'd':
 			monitor_disk(optarg);
 			break;
+		case 'j':			/* journald socket path */
+			journal_path = optarg;
+			break;
+		case 'R':			/* metrics store path */
+			rrd_path = optarg;
+			break;
+		case 'Y':			/* look up time in store */
+			rrd_query = optarg;
+			break;
 		case 'Q':			/* Quiet option display */
 			flag_Q = 1;
 			break;
+		case 'I':			/* low wakeup idle mode */
+			flag_I = 1;
+			break;
+		case 'U':			/* fleet merge of logs */
+			flag_U = 1;
+			break;
+		case 'E':			/* convert logs to archive */
+			archive_path = optarg;
+			break;
+		case 'V':			/* query archive */
+			archive_query = optarg;
+			break;
 		default:	/* '?' */
 			show_usage_and_exit();
 		}
 	}
+	if (flag_U + (archive_path != NULL) + (archive_query != NULL) > 1)
+		fatal_usage("only one of -U, -E and -V",
+			flag_U + (archive_path != NULL) + (archive_query != NULL));
+	if (flag_U)
+		exit(fleet_merge(argc - optind, argv + optind));
+	if (archive_query)
+		exit(query_archive(argc - optind, argv + optind));
+	if (archive_path)
+		exit(archive_convert(argc - optind, argv + optind));
 	if (optind < argc)
 		show_usage_and_exit();
  
-	if ( ! (flag_C || flag_M || flag_B) )	/* set default C flag if none set */
-		flag_C = 1;
+	metrics_init();			/* set default C flag if none set */
+	rt_init();			/* set default -x threshold */
+	slab_init();			/* want Slab, SUnreclaim from meminfo */
+	profiles_init();		/* set up -O profiles */
 
 	tzset();			/* Initialize timezone information */
 
+	if (rrd_query) {
+		if (!rrd_path) {
+			fprintf(stderr, "%s: -Y requires -R path\n", cmd);
+			show_usage_and_exit();
+		}
+		exit(rrd_lookup(strtol(rrd_query, NULL, 10)));
+	}
+
 	ncpus = get_ncpus();
+	simd_init();
 
 	osleepusecs = (useconds_t) (val_s * 1000000.0);
+	cont_usecs = osleepusecs;
 	isleepusecs = (useconds_t) (val_t * 1000000.0);
 
 	if ((cmdlinebuf = malloc(szcmdlinebuf)) == NULL)
@@ -1844,6 +8310,8 @@ int main(int argc, char *argv[])
 	if (!flag_Q)
 		show_current_settings();
 
+	idle_mode_init();
+
 	/*
 	 * Initialize global CPU load values.
 	 */
@@ -1861,19 +8329,32 @@ int main(int argc, char *argv[])
 	 */
 	for (;;) {
 		task_usages_t prior, latest;
-		double load_avg, cpu_load, mem_load;
-		int mem_pres;
+		double load_avg, cpu_load, mem_load, zone_room, max_cpubusy;
+		int mem_pres, k, loaded;
 
 		emit_time_marker_start();
 		do {
 			emit_time_marker();
-			usleep(osleepusecs);
+			outer_nap(val_Z ? cont_usecs : osleepusecs);
 			load_avg = read_loadavg();
 			cpu_load = read_cpuload();
 			mem_load = read_memload();
 			mem_pres = read_mempres();
-		} while (!system_is_loaded(load_avg, cpu_load, mem_load, mem_pres));
+			zone_room = read_zoneroom();
+			read_cpus_busy();
+			read_capacity();
+			max_cpubusy = read_max_cpubusy();
+			heartbeat_sample(load_avg, cpu_load, mem_load, mem_pres);
+			rrd_append(load_avg, cpu_load, mem_load, mem_pres);
+			loaded = any_profile_loaded(load_avg, cpu_load,
+				mem_load, mem_pres, zone_room, max_cpubusy);
+			if (!loaded)
+				cont_tick(load_avg, cpu_load, mem_load,
+					mem_pres, zone_room, max_cpubusy);
+		} while (!loaded);
 		emit_time_marker_eol();
+		heartbeat_flush();
+		episode_id = time(NULL);
 
 		/*
 		 * Before entering inner loop, sample the per-thread stats.
@@ -1885,9 +8366,14 @@ int main(int argc, char *argv[])
 		 * system is no longer loaded.
 		 */
 		prior = get_task_usages();
+		cgroup_scan();
+		hist_reset();
+		hist_push(prior);
+		for (k = 0; k < nprofiles; k++)
+			change_reset(k);
 		free(get_disks_monitored());
 
-		usleep(min(osleepusecs, isleepusecs));
+		nap(min(osleepusecs, isleepusecs));
 
 		/*
 		 * Inner loop: displays system wide loading measures, and
@@ -1898,29 +8384,75 @@ int main(int argc, char *argv[])
 			char *dsk_str;
 			int cnt_php;
 			int cnt_httpd;
+			uint64_t t0 = bt_clock(cycle_end);
 
+			ncycles++;
+			bt_probe1(cycle_start, ncycles);
 			latest = get_task_usages();
+			hist_push(latest);
 			dsk_str = get_disks_monitored();
 			cnt_php = flag_P ? get_cnt_php(latest) : 0;
 			cnt_httpd = flag_H ? get_cnt_httpd(latest) : 0;
 
-			show_task_usages(prior, latest, load_avg, cpu_load,
-				mem_load, mem_pres, cnt_php, cnt_httpd, dsk_str);
+			/*
+			 * Each profile loaded by its own triggers shows its
+			 * header and hogs, to its own sink.  A profile no
+			 * longer loaded ends its episode with a time mark.
+			 */
+			extras_shown = 0;
+			for (k = 0; k < nprofiles; k++) {
+				if (nprofiles > 1) {
+					profile_load(k);
+					cur_sink = k;
+				}
+				if (!system_is_loaded(load_avg, cpu_load,
+						mem_load, mem_pres, zone_room,
+						max_cpubusy)) {
+					if (profiles[k].busy) {
+						emit_time_marker_start();
+						emit_time_marker_eol();
+						flush_output();
+						change_reset(k);
+					}
+					profiles[k].busy = 0;
+					continue;
+				}
+				profiles[k].busy = 1;
+				show_task_usages(prior, latest, load_avg,
+					cpu_load, mem_load, mem_pres,
+					zone_room, cnt_php, cnt_httpd,
+					dsk_str);
+			}
+			if (nprofiles > 1) {
+				profile_load(0);
+				cur_sink = -1;
+			}
 			free_task_usages(prior);
 			prior = latest;
 			free(dsk_str);
+			bt_probe2(cycle_end, ncycles, probe_usecs() - t0);
 
-			usleep(isleepusecs);
+			nap(isleepusecs);
 
 			load_avg = read_loadavg();
 			cpu_load = read_cpuload();
 			mem_load = read_memload();
 			mem_pres = read_mempres();
-
-			if (!system_is_loaded(load_avg, cpu_load, mem_load, mem_pres))
+			zone_room = read_zoneroom();
+			read_cpus_busy();
+			read_capacity();
+			max_cpubusy = read_max_cpubusy();
+			rrd_append(load_avg, cpu_load, mem_load, mem_pres);
+
+			if (!any_profile_loaded(load_avg, cpu_load, mem_load,
+					mem_pres, zone_room, max_cpubusy))
 				break;
 		}
 		free_task_usages(prior);
+		for (k = 0; k < nprofiles; k++)
+			profiles[k].busy = 0;
+		summary_flush();	/* end of episode ends -w summary */
+		corr_flush();		/* and shows -K correlated tasks */
 	}
 	exit(0);
 }